@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# 对比两次make bench的结果：同一个lower、同一项测试的jzpfs_value并排
+# 列出来，最后一列是b/a。例如组提交打开前后的fsync：
+#
+#   make
+#   BENCH_TESTS="fsync fsyncp99" sh bench/run.sh a.json
+#   BENCH_TESTS="fsync fsyncp99" BENCH_OPTS=group_commit sh bench/run.sh b.json
+#   sh bench/compare.sh a.json b.json
+#
+# 只在一边有的行（比如tmpfs不支持group_commit被跳过）b/a列是"-"。
+#
+
+if [ $# != 2 ]; then
+	echo "usage: compare.sh <a.json> <b.json>" >&2
+	exit 2
+fi
+
+# guest.sh每个结果一行，按字段名取值
+extract() {
+	sed -n 's/.*"lower": "\([^"]*\)", "test": "\([^"]*\)", "unit": "\([^"]*\)".*"jzpfs_value": \([^,]*\),.*/\1 \2 \3 \4/p' "$1"
+}
+
+options() {
+	sed -n 's/.*"options": "\([^"]*\)".*/\1/p' "$1"
+}
+
+{
+	extract "$1" | sed 's/^/a /'
+	extract "$2" | sed 's/^/b /'
+} | awk -v oa="$(options "$1")" -v ob="$(options "$2")" '
+{
+	key = $2 " " $3
+	if (!(key in unit)) {
+		order[n++] = key
+		unit[key] = $4
+	}
+	val[$1, key] = $5
+}
+END {
+	printf "%-6s %-10s %-8s %12s %12s %7s\n", "lower", "test", "unit",
+	       "a", "b", "b/a"
+	printf "%-6s %-10s %-8s %12s %12s\n", "", "options", "",
+	       oa == "" ? "-" : oa, ob == "" ? "-" : ob
+	for (i = 0; i < n; i++) {
+		key = order[i]
+		split(key, k, " ")
+		a = (("a", key) in val) ? val["a", key] : "-"
+		b = (("b", key) in val) ? val["b", key] : "-"
+		printf "%-6s %-10s %-8s %12s %12s ", k[1], k[2], unit[key], a, b
+		if (a != "-" && b != "-" && a > 0)
+			printf "%7.3f\n", b / a
+		else
+			printf "%7s\n", "-"
+	}
+}'
@@ -0,0 +1,197 @@
+#!/bin/sh
+#
+# 在虚拟机里执行（由run.sh通过virtme启动）：加载jzpfs.ko，分别以tmpfs和
+# ext4镜像为lower，对lower本身和叠在上面的jzpfs跑同一组测试，把结果以
+# JSON写到$1。
+#
+# 环境变量：
+#   BENCH_SIZE   fio测试文件大小（默认256M）
+#   BENCH_FILES  小文件测试的文件数（默认20000）
+#   BENCH_OPTS   jzpfs的挂载选项（如csum、compress=lz4）
+#   BENCH_IMG    ext4镜像大小（默认4G，稀疏文件，只占写进去的部分）
+#   BENCH_ZPCT   z*测试的数据有多少百分比可压缩（默认60，看compress=）
+#   BENCH_TESTS  只跑这几项（空格分开，默认全部）。读测试要有前面写测试
+#                的文件，fsync、fsyncp99、create之类可以单独跑
+#   BENCH_DELAY  非空时ext4镜像下面垫一层dm-delay，每个I/O延迟这么多毫秒，
+#                模拟慢的lower（如BENCH_FILES=100000 BENCH_DELAY=2
+#                BENCH_OPTS=readdir_prefetch看lsl）
+#
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+OUT=$1
+SIZE=${BENCH_SIZE:-256M}
+FILES=${BENCH_FILES:-20000}
+OPTS=${BENCH_OPTS:-}
+IMG=${BENCH_IMG:-4G}
+DELAY=${BENCH_DELAY:-}
+ZPCT=${BENCH_ZPCT:-60}
+ONLY=${BENCH_TESTS:-}
+WORK=/tmp/jzbench
+THREADS=$(nproc)
+
+insmod "$BENCH/../jzpfs.ko"
+# jzpfs每个操作都会printk，别让控制台拖慢测试
+echo 1 > /proc/sys/kernel/printk
+
+mkdir -p $WORK
+mount -t tmpfs -o size=90% tmpfs $WORK
+
+# fio --output-format=terse的第7、8列是读带宽(KiB/s)和IOPS，48、49列是写
+fio_run() {
+	dir=$1; name=$2; rw=$3; bs=$4; engine=$5; field=$6
+	fio --name="$name" --directory="$dir" --size="$SIZE" --bs="$bs" \
+	    --rw="$rw" --ioengine="$engine" --end_fsync=1 --randrepeat=1 \
+	    --output-format=terse --terse-version=3 |
+		awk -F';' -v f="$field" '{ print $f } END { if (!NR) print 0 }'
+}
+
+# 可压缩的数据：每4K里ZPCT%是重复的，fio每次写都重新生成
+fio_z() {
+	dir=$1; rw=$2; field=$3
+	fio --name=ztext --directory="$dir" --size="$SIZE" --bs=1M \
+	    --rw="$rw" --ioengine=psync --end_fsync=1 \
+	    --buffer_compress_percentage="$ZPCT" --buffer_compress_chunk=4k \
+	    --refill_buffers --output-format=terse --terse-version=3 |
+		awk -F';' -v f="$field" '{ print $f } END { if (!NR) print 0 }'
+}
+
+# 逻辑大小比lower上实际占用的空间，store是这个目录在lower上的位置
+z_ratio() {
+	dir=$1; store=$2
+	size=$(stat -c %s "$dir/ztext.0.0" 2>/dev/null || echo 0)
+	used=$(du -B1 "$store/ztext.0.0" 2>/dev/null | cut -f1)
+	awk -v s="$size" -v u="${used:-0}" \
+		'BEGIN { printf "%.2f", (u > 0 ? s / u : 0) }'
+}
+
+# 不支持的测试（比如压缩文件不能mmap）记为0
+jzbench() {
+	"$BENCH/jzbench" "$@" || echo 0
+}
+
+# 一个测试在一个目录下的结果，store是这个目录在lower上的位置
+run_test() {
+	dir=$1; test=$2; store=$3
+	sync; echo 3 > /proc/sys/vm/drop_caches
+	case $test in
+	seqwrite)	fio_run "$dir" seq write 1M psync 48 ;;
+	seqread)	fio_run "$dir" seq read 1M psync 7 ;;
+	randwrite)	fio_run "$dir" rand randwrite 4k psync 49 ;;
+	randread)	fio_run "$dir" rand randread 4k psync 8 ;;
+	mmap)		fio_run "$dir" mmap randread 4k mmap 8 ;;
+	sendfile)	jzbench sendfile "$dir/seq.0.0" ;;
+	zwrite)		fio_z "$dir" write 48 ;;
+	zratio)		z_ratio "$dir" "$store" ;;
+	zread)		fio_z "$dir" read 7 ;;
+	mtread)		jzbench mtread "$dir/seq.0.0" "$THREADS" 200000 ;;
+	willneed)	jzbench willneed "$dir/seq.0.0" 20000 ;;
+	mtwrite)	jzbench mtwrite "$dir/mtwrite.dat" "$SIZE" "$THREADS" ;;
+	openstorm)	jzbench openstorm "$dir/seq.0.0" $((THREADS * 4)) 256 ;;
+	fsync)		jzbench fsync "$dir" $((THREADS * 4)) 500 ;;
+	fsyncp99)	jzbench fsyncp99 "$dir" $((THREADS * 4)) 500 ;;
+	create)		jzbench create "$dir/small" "$FILES" ;;
+	stat)		jzbench stat "$dir/small" "$FILES" ;;
+	readdir)	jzbench readdir "$dir/small" 10 ;;
+	lsl)		jzbench lsl "$dir/small" ;;
+	mtstat)		jzbench mtstat "$dir/small" "$FILES" "$THREADS" ;;
+	mtreaddir)	jzbench mtreaddir "$dir/small" 10 "$THREADS" ;;
+	unlink)		jzbench unlink "$dir/small" "$FILES" ;;
+	esac
+}
+
+# 顺序有依赖：读测试用前面写出来的文件，小文件测试最后删掉
+TESTS="seqwrite seqread randwrite randread mmap sendfile zwrite zratio zread openstorm mtread willneed mtwrite fsync fsyncp99 create stat readdir lsl mtstat mtreaddir unlink"
+TESTS=${ONLY:-$TESTS}
+
+unit() {
+	case $1 in
+	seq*|zread|zwrite|sendfile|mtwrite)	echo "MB/s" ;;
+	zratio)			echo "x" ;;
+	rand*|mmap|mtread|willneed)	echo "IOPS" ;;
+	openstorm)		echo "us/open" ;;
+	fsyncp99)		echo "us" ;;
+	fsync)			echo "fsync/s" ;;
+	*)			echo "ops/s" ;;
+	esac
+}
+
+# 在lower上准备raw和jzpfs两个目录，跑完整组测试
+bench_lower() {
+	lower=$1; dir=$2
+	mkdir -p "$dir/raw/small" "$dir/via"
+	mnt=$WORK/mnt-$lower
+	mkdir -p "$mnt"
+	# 有的选项不支持某些lower（group_commit要lower有sync_fs，tmpfs没有）
+	if ! mount -t jzpfs ${OPTS:+-o "$OPTS"} "$dir/via" "$mnt"; then
+		echo "bench: jzpfs -o '$OPTS' not supported on $lower, skipped" >&2
+		return 0
+	fi
+	mkdir -p "$mnt/small"
+
+	for test in $TESTS; do
+		raw=$(run_test "$dir/raw" $test "$dir/raw")
+		via=$(run_test "$mnt" $test "$dir/via")
+		# fio的带宽单位是KiB/s
+		case $test in
+		seq*|zwrite|zread)
+			raw=$(awk -v v="$raw" 'BEGIN { printf "%.1f", v / 1024 }')
+			via=$(awk -v v="$via" 'BEGIN { printf "%.1f", v / 1024 }')
+			;;
+		esac
+		echo "$lower $test $(unit $test) $raw $via"
+	done
+
+	umount "$mnt"
+}
+
+results=$WORK/results.txt
+: > $results
+
+mkdir -p $WORK/tmpfs
+mount -t tmpfs -o size=45% tmpfs $WORK/tmpfs
+bench_lower tmpfs $WORK/tmpfs >> $results
+umount $WORK/tmpfs
+
+# ext4放在内存里的镜像上，测的是文件系统本身的开销
+truncate -s "$IMG" $WORK/ext4.img
+dev=$WORK/ext4.img
+loopopt="-o loop"
+if [ -n "$DELAY" ]; then
+	loop=$(losetup -f --show $WORK/ext4.img)
+	echo "0 $(blockdev --getsz "$loop") delay $loop 0 $DELAY" |
+		dmsetup create jzbench-delay
+	dev=/dev/mapper/jzbench-delay
+	loopopt=
+fi
+mkfs.ext4 -q -F $dev
+mkdir -p $WORK/ext4
+mount $loopopt $dev $WORK/ext4
+bench_lower ext4 $WORK/ext4 >> $results
+umount $WORK/ext4
+if [ -n "$DELAY" ]; then
+	dmsetup remove jzbench-delay
+	losetup -d "$loop"
+fi
+
+# 比值是jzpfs/lower，越接近1开销越小（us/open和us是延迟，比值大于1是变慢）
+awk -v kernel="$(uname -r)" -v opts="$OPTS" -v size="$SIZE" \
+    -v files="$FILES" -v threads="$THREADS" '
+BEGIN {
+	printf "{\n  \"kernel\": \"%s\",\n  \"options\": \"%s\",\n", kernel, opts
+	printf "  \"size\": \"%s\",\n  \"files\": %d,\n  \"threads\": %d,\n", size, files, threads
+	printf "  \"results\": ["
+}
+{
+	ratio = $4 > 0 ? $5 / $4 : 0
+	printf "%s\n    {\"lower\": \"%s\", \"test\": \"%s\", \"unit\": \"%s\", " \
+	       "\"lower_value\": %s, \"jzpfs_value\": %s, \"ratio\": %.3f}",
+	       NR > 1 ? "," : "", $1, $2, $3, $4, $5, ratio
+}
+END {
+	printf "\n  ]\n}\n"
+}' $results > "$OUT"
+
+umount $WORK
+rmmod jzpfs
@@ -0,0 +1,642 @@
+/*
+ * jzpfs性能测试里fio覆盖不到的小测试，每个测试在标准输出打印一个数
+ *
+ *   jzbench create  <dir> <n>             每秒创建的文件数
+ *   jzbench stat    <dir> <n>             每秒stat的次数
+ *   jzbench unlink  <dir> <n>             每秒删除的文件数
+ *   jzbench readdir <dir> <rounds>        每秒读到的目录项数
+ *   jzbench lsl <dir>                     像ls -l一样读目录并lstat每一项，
+ *                                         每秒的目录项数（冷缓存时看
+ *                                         readdir_prefetch的效果）
+ *   jzbench sendfile <file>               sendfile到/dev/null的MB/s
+ *   jzbench mtstat  <dir> <n> <threads>   多线程stat，每秒总次数
+ *   jzbench mtreaddir <dir> <rounds> <threads>
+ *                                         一半线程读目录、一半线程查找不
+ *                                         存在的名字，每秒总的目录项数加
+ *                                         查找数
+ *   jzbench mtread <file> <threads> <n>  每个线程自己打开同一个文件做n次
+ *                                         4K随机pread，每秒总的读次数
+ *   jzbench willneed <file> <n>           对整个文件fadvise(WILLNEED)之后
+ *                                         做n次4K随机pread，每秒的读次数
+ *                                         （冷缓存时看预读有没有转给lower）
+ *   jzbench mtwrite <file> <size> <threads>
+ *                                         多线程写同一个文件里互不重叠的
+ *                                         区域，总的MB/s
+ *   jzbench openstorm <file> <procs> <n>  procs个进程同时各打开同一个文件
+ *                                         n次（不关），每个fd读1字节，
+ *                                         平均每次open的微秒数
+ *   jzbench fsync <dir> <threads> <n>     每个线程往自己的文件追加小记录并
+ *                                         fsync n次，每秒总的fsync次数
+ *   jzbench fsyncp99 <dir> <threads> <n>  同上，fsync延迟的p99（微秒）
+ *
+ * stat、unlink和mtstat用的是create建出来的f<i>文件。
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MTSTAT_ROUNDS	4
+#define MTREAD_BS	4096
+#define MTWRITE_BS	(64 * 1024)
+#define FSYNC_RECORD	512
+
+static void usage(void);
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void name(char *buf, size_t len, const char *dir, long i)
+{
+	snprintf(buf, len, "%s/f%ld", dir, i);
+}
+
+static double bench_create(const char *dir, long n)
+{
+	char path[4096];
+	double t = now();
+	long i;
+	int fd;
+
+	for (i = 0; i < n; i++) {
+		name(path, sizeof(path), dir, i);
+		fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0)
+			die(path);
+		close(fd);
+	}
+	return n / (now() - t);
+}
+
+static double bench_stat(const char *dir, long n)
+{
+	char path[4096];
+	struct stat st;
+	double t = now();
+	long i;
+
+	for (i = 0; i < n; i++) {
+		name(path, sizeof(path), dir, i);
+		if (stat(path, &st))
+			die(path);
+	}
+	return n / (now() - t);
+}
+
+static double bench_unlink(const char *dir, long n)
+{
+	char path[4096];
+	double t = now();
+	long i;
+
+	for (i = 0; i < n; i++) {
+		name(path, sizeof(path), dir, i);
+		if (unlink(path))
+			die(path);
+	}
+	return n / (now() - t);
+}
+
+static double bench_readdir(const char *dir, long rounds)
+{
+	struct dirent *de;
+	long entries = 0, i;
+	double t = now();
+	DIR *d;
+
+	for (i = 0; i < rounds; i++) {
+		d = opendir(dir);
+		if (!d)
+			die(dir);
+		while ((de = readdir(d)) != NULL)
+			entries++;
+		closedir(d);
+	}
+	return entries / (now() - t);
+}
+
+static double bench_lsl(const char *dir)
+{
+	char path[4096];
+	struct dirent *de;
+	struct stat st;
+	long entries = 0;
+	double t = now();
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		die(dir);
+	while ((de = readdir(d)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (lstat(path, &st))
+			die(path);
+		entries++;
+	}
+	closedir(d);
+	return entries / (now() - t);
+}
+
+static double bench_sendfile(const char *file)
+{
+	struct stat st;
+	off_t off = 0;
+	ssize_t ret;
+	double t;
+	int in, out;
+
+	in = open(file, O_RDONLY);
+	if (in < 0 || fstat(in, &st))
+		die(file);
+	out = open("/dev/null", O_WRONLY);
+	if (out < 0)
+		die("/dev/null");
+
+	t = now();
+	while (off < st.st_size) {
+		ret = sendfile(out, in, &off, st.st_size - off);
+		if (ret < 0)
+			die("sendfile");
+		if (!ret)
+			break;
+	}
+	t = now() - t;
+	close(in);
+	close(out);
+	return off / t / (1024 * 1024);
+}
+
+struct mtstat_arg {
+	const char *dir;
+	long n;
+	int seed;
+};
+
+static void *mtstat_thread(void *p)
+{
+	struct mtstat_arg *arg = p;
+	char path[4096];
+	struct stat st;
+	long i, r;
+
+	/* 各线程从不同的位置开始，不总是撞在同一个dentry上 */
+	for (r = 0; r < MTSTAT_ROUNDS; r++)
+		for (i = 0; i < arg->n; i++) {
+			name(path, sizeof(path), arg->dir,
+			     (i + arg->seed) % arg->n);
+			if (stat(path, &st))
+				die(path);
+		}
+	return NULL;
+}
+
+static double bench_mtstat(const char *dir, long n, int threads)
+{
+	pthread_t tid[threads];
+	struct mtstat_arg arg[threads];
+	double t = now();
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		arg[i].dir = dir;
+		arg[i].n = n;
+		arg[i].seed = i * (n / threads);
+		if (pthread_create(&tid[i], NULL, mtstat_thread, &arg[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	return (double)n * MTSTAT_ROUNDS * threads / (now() - t);
+}
+
+struct mtreaddir_arg {
+	const char *dir;
+	long rounds;
+	int id;
+	long ops;
+};
+
+/*
+ * 偶数线程把目录从头读到尾，奇数线程在同一个目录下查找每次都不一样的
+ * 不存在的名字（不会被dcache挡住，每次都到文件系统）。
+ */
+static void *mtreaddir_thread(void *p)
+{
+	struct mtreaddir_arg *arg = p;
+	char path[4096];
+	struct dirent *de;
+	struct stat st;
+	long r, i;
+	DIR *d;
+
+	for (r = 0; r < arg->rounds; r++) {
+		if (arg->id % 2 == 0) {
+			d = opendir(arg->dir);
+			if (!d)
+				die(arg->dir);
+			while ((de = readdir(d)) != NULL)
+				arg->ops++;
+			closedir(d);
+			continue;
+		}
+		for (i = 0; i < 1000; i++, arg->ops++) {
+			snprintf(path, sizeof(path), "%s/missing.%d.%ld.%ld",
+				 arg->dir, arg->id, r, i);
+			if (!stat(path, &st) || errno != ENOENT)
+				die(path);
+		}
+	}
+	return NULL;
+}
+
+static double bench_mtreaddir(const char *dir, long rounds, int threads)
+{
+	pthread_t tid[threads];
+	struct mtreaddir_arg arg[threads];
+	double t = now();
+	long ops = 0;
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		arg[i].dir = dir;
+		arg[i].rounds = rounds;
+		arg[i].id = i;
+		arg[i].ops = 0;
+		if (pthread_create(&tid[i], NULL, mtreaddir_thread, &arg[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(tid[i], NULL);
+		ops += arg[i].ops;
+	}
+	return ops / (now() - t);
+}
+
+/* 带K、M、G后缀的大小 */
+struct mtread_arg {
+	const char *file;
+	long n;
+	off_t blocks;
+	unsigned int seed;
+};
+
+/* 文件在页缓存里，测的是每次读本身的开销随线程数怎么变 */
+static void *mtread_thread(void *p)
+{
+	struct mtread_arg *arg = p;
+	char buf[MTREAD_BS];
+	long i;
+	int fd;
+
+	fd = open(arg->file, O_RDONLY);
+	if (fd < 0)
+		die(arg->file);
+	for (i = 0; i < arg->n; i++)
+		if (pread(fd, buf, sizeof(buf),
+			  (off_t)(rand_r(&arg->seed) % arg->blocks) *
+			  MTREAD_BS) < 0)
+			die("pread");
+	close(fd);
+	return NULL;
+}
+
+static double bench_mtread(const char *file, int threads, long n)
+{
+	pthread_t tid[threads];
+	struct mtread_arg arg[threads];
+	struct stat st;
+	double t;
+	int i;
+
+	if (threads < 1 || n < 1)
+		usage();
+	if (stat(file, &st))
+		die(file);
+	if (st.st_size < MTREAD_BS)
+		usage();
+	for (i = 0; i < threads; i++) {
+		arg[i].file = file;
+		arg[i].n = n;
+		arg[i].blocks = st.st_size / MTREAD_BS;
+		arg[i].seed = i + 1;
+	}
+	t = now();
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tid[i], NULL, mtread_thread, &arg[i]))
+			die("pthread_create");
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	return (double)threads * n / (now() - t);
+}
+
+/* 提示和读都算在时间里，预读跟不上的部分读的时候自己去lower取 */
+static double bench_willneed(const char *file, long n)
+{
+	char buf[MTREAD_BS];
+	unsigned int seed = 1;
+	struct stat st;
+	off_t blocks;
+	double t;
+	long i;
+	int fd;
+
+	if (n < 1)
+		usage();
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		die(file);
+	blocks = st.st_size / MTREAD_BS;
+	if (!blocks)
+		usage();
+	t = now();
+	errno = posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+	if (errno)
+		die("posix_fadvise");
+	for (i = 0; i < n; i++)
+		if (pread(fd, buf, sizeof(buf),
+			  (off_t)(rand_r(&seed) % blocks) * MTREAD_BS) < 0)
+			die("pread");
+	t = now() - t;
+	close(fd);
+	return n / t;
+}
+
+static long long parse_size(const char *s)
+{
+	char *end;
+	long long v = strtoll(s, &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		v <<= 10;
+	}
+	return v;
+}
+
+struct mtwrite_arg {
+	int fd;
+	off_t start, len;
+};
+
+static void *mtwrite_thread(void *p)
+{
+	struct mtwrite_arg *arg = p;
+	char *buf;
+	off_t off;
+
+	buf = malloc(MTWRITE_BS);
+	if (!buf)
+		die("malloc");
+	memset(buf, 'a' + (arg->start / MTWRITE_BS) % 26, MTWRITE_BS);
+	for (off = 0; off < arg->len; off += MTWRITE_BS)
+		if (pwrite(arg->fd, buf, MTWRITE_BS, arg->start + off) !=
+		    MTWRITE_BS)
+			die("pwrite");
+	free(buf);
+	return NULL;
+}
+
+/*
+ * 先把文件写满（预分配），再计时让每个线程覆盖写自己那一段。只测覆盖写，
+ * 不让文件变长，否则测到的是追加写的串行化。
+ */
+static double bench_mtwrite(const char *file, long long size, int threads)
+{
+	pthread_t tid[threads];
+	struct mtwrite_arg arg[threads];
+	off_t part;
+	double t;
+	int fd, i;
+
+	part = size / threads / MTWRITE_BS * MTWRITE_BS;
+	if (!part)
+		usage();
+	fd = open(file, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0)
+		die(file);
+
+	for (i = 0; i < threads; i++) {
+		arg[i].fd = fd;
+		arg[i].start = i * part;
+		arg[i].len = part;
+	}
+	mtwrite_thread(&arg[threads - 1]);
+	for (i = 0; i < threads - 1; i++)
+		mtwrite_thread(&arg[i]);
+	fsync(fd);
+
+	t = now();
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tid[i], NULL, mtwrite_thread, &arg[i]))
+			die("pthread_create");
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	t = now() - t;
+	close(fd);
+	unlink(file);
+	return (double)part * threads / t / (1024 * 1024);
+}
+
+static void openstorm_child(const char *file, long n)
+{
+	char c;
+	long i;
+	int fd;
+
+	for (i = 0; i < n; i++) {
+		fd = open(file, O_RDONLY);
+		if (fd < 0)
+			die(file);
+		if (pread(fd, &c, 1, 0) < 0)
+			die("pread");
+	}
+	/* 退出时一起关掉 */
+	exit(0);
+}
+
+/*
+ * 很多进程同时打开同一个文件（比如一堆worker启动时读同一个配置或模型
+ * 文件），fd都不关，看open的延迟。n受RLIMIT_NOFILE限制。
+ */
+static double bench_openstorm(const char *file, int procs, long n)
+{
+	double t = now();
+	int i, status;
+	pid_t pid;
+
+	for (i = 0; i < procs; i++) {
+		pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (!pid)
+			openstorm_child(file, n);
+	}
+	for (i = 0; i < procs; i++)
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			exit(1);
+	return (now() - t) * 1e6 / ((double)procs * n);
+}
+
+struct fsync_arg {
+	char path[4096];
+	long n;
+	double *lat;		/* n latencies in seconds */
+};
+
+static void *fsync_thread(void *p)
+{
+	struct fsync_arg *arg = p;
+	char rec[FSYNC_RECORD];
+	double t;
+	long i;
+	int fd;
+
+	memset(rec, 'm', sizeof(rec));
+	fd = open(arg->path, O_CREAT | O_WRONLY | O_APPEND | O_TRUNC, 0644);
+	if (fd < 0)
+		die(arg->path);
+	for (i = 0; i < arg->n; i++) {
+		if (write(fd, rec, sizeof(rec)) != sizeof(rec))
+			die("write");
+		t = now();
+		if (fsync(fd))
+			die("fsync");
+		arg->lat[i] = now() - t;
+	}
+	close(fd);
+	unlink(arg->path);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * 消息队列式的负载：很多线程各自追加写自己的文件，每条记录fsync一次。
+ * 返回每秒fsync总数，p99为真时返回fsync延迟的p99（微秒）。
+ */
+static double bench_fsync(const char *dir, int threads, long n, int p99)
+{
+	pthread_t tid[threads];
+	struct fsync_arg arg[threads];
+	double t, *lat;
+	int i;
+
+	if (threads < 1 || n < 1)
+		usage();
+	lat = calloc((size_t)threads * n, sizeof(*lat));
+	if (!lat)
+		die("calloc");
+	for (i = 0; i < threads; i++) {
+		snprintf(arg[i].path, sizeof(arg[i].path), "%s/fsync.%d", dir, i);
+		arg[i].n = n;
+		arg[i].lat = lat + (size_t)i * n;
+	}
+
+	t = now();
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tid[i], NULL, fsync_thread, &arg[i]))
+			die("pthread_create");
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	t = now() - t;
+
+	if (p99) {
+		qsort(lat, (size_t)threads * n, sizeof(*lat), cmp_double);
+		t = lat[(size_t)threads * n * 99 / 100] * 1e6;
+	} else {
+		t = threads * n / t;
+	}
+	free(lat);
+	return t;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: jzbench create|stat|unlink <dir> <n>\n"
+		"       jzbench readdir <dir> <rounds>\n"
+		"       jzbench lsl <dir>\n"
+		"       jzbench sendfile <file>\n"
+		"       jzbench mtstat <dir> <n> <threads>\n"
+		"       jzbench mtreaddir <dir> <rounds> <threads>\n"
+		"       jzbench mtread <file> <threads> <n>\n"
+		"       jzbench willneed <file> <n>\n"
+		"       jzbench mtwrite <file> <size> <threads>\n"
+		"       jzbench openstorm <file> <procs> <n>\n"
+		"       jzbench fsync|fsyncp99 <dir> <threads> <n>\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	double v;
+
+	if (argc < 3)
+		usage();
+	if (!strcmp(argv[1], "create") && argc == 4)
+		v = bench_create(argv[2], atol(argv[3]));
+	else if (!strcmp(argv[1], "stat") && argc == 4)
+		v = bench_stat(argv[2], atol(argv[3]));
+	else if (!strcmp(argv[1], "unlink") && argc == 4)
+		v = bench_unlink(argv[2], atol(argv[3]));
+	else if (!strcmp(argv[1], "readdir") && argc == 4)
+		v = bench_readdir(argv[2], atol(argv[3]));
+	else if (!strcmp(argv[1], "lsl") && argc == 3)
+		v = bench_lsl(argv[2]);
+	else if (!strcmp(argv[1], "sendfile") && argc == 3)
+		v = bench_sendfile(argv[2]);
+	else if (!strcmp(argv[1], "mtstat") && argc == 5)
+		v = bench_mtstat(argv[2], atol(argv[3]), atoi(argv[4]));
+	else if (!strcmp(argv[1], "mtreaddir") && argc == 5)
+		v = bench_mtreaddir(argv[2], atol(argv[3]), atoi(argv[4]));
+	else if (!strcmp(argv[1], "mtread") && argc == 5)
+		v = bench_mtread(argv[2], atoi(argv[3]), atol(argv[4]));
+	else if (!strcmp(argv[1], "willneed") && argc == 4)
+		v = bench_willneed(argv[2], atol(argv[3]));
+	else if (!strcmp(argv[1], "mtwrite") && argc == 5)
+		v = bench_mtwrite(argv[2], parse_size(argv[3]),
+				  atoi(argv[4]));
+	else if (!strcmp(argv[1], "openstorm") && argc == 5)
+		v = bench_openstorm(argv[2], atoi(argv[3]), atol(argv[4]));
+	else if (!strcmp(argv[1], "fsync") && argc == 5)
+		v = bench_fsync(argv[2], atoi(argv[3]), atol(argv[4]), 0);
+	else if (!strcmp(argv[1], "fsyncp99") && argc == 5)
+		v = bench_fsync(argv[2], atoi(argv[3]), atol(argv[4]), 1);
+	else
+		usage();
+	printf("%.1f\n", v);
+	return 0;
+}
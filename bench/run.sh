@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# make bench调用：用virtme起一个虚拟机，在里面跑guest.sh，结果JSON写到$1
+# （默认bench/results-<时间>.json）。
+#
+# 环境变量：
+#   KDIR        编译jzpfs.ko用的内核目录，虚拟机跑同一个内核
+#   BENCH_CPUS  虚拟机CPU数（默认4）
+#   BENCH_MEM   虚拟机内存（默认4G）
+# 另外BENCH_SIZE、BENCH_FILES、BENCH_OPTS、BENCH_IMG、BENCH_DELAY、
+# BENCH_ZPCT、BENCH_TESTS原样传给guest.sh。两次结果用compare.sh对比。
+#
+# 需要virtme-run和qemu；虚拟机里用的是主机的根文件系统，所以主机上要有fio。
+#
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+KDIR=${KDIR:-/lib/modules/$(uname -r)/build}
+CPUS=${BENCH_CPUS:-4}
+MEM=${BENCH_MEM:-4G}
+OUT=${1:-$BENCH/results-$(date +%Y%m%d-%H%M%S).json}
+
+for tool in virtme-run fio; do
+	if ! command -v $tool >/dev/null 2>&1; then
+		echo "bench: $tool not found" >&2
+		exit 1
+	fi
+done
+
+${CC:-cc} -O2 -Wall -pthread -o "$BENCH/jzbench" "$BENCH/jzbench.c"
+
+# 装好的内核直接用，否则用源码树里编出来的
+case $KDIR in
+/lib/modules/*)	kernel="--installed-kernel $(basename "$(dirname "$KDIR")")" ;;
+*)		kernel="--kdir $KDIR" ;;
+esac
+
+OUT=$(cd "$(dirname "$OUT")" && pwd)/$(basename "$OUT")
+
+virtme-run $kernel --rwdir "$BENCH/.." --rwdir "$(dirname "$OUT")" \
+	--memory "$MEM" --qemu-opts -smp "$CPUS" \
+	--script-sh "BENCH_SIZE='${BENCH_SIZE:-}' BENCH_FILES='${BENCH_FILES:-}' \
+BENCH_OPTS='${BENCH_OPTS:-}' BENCH_IMG='${BENCH_IMG:-}' \
+BENCH_DELAY='${BENCH_DELAY:-}' BENCH_ZPCT='${BENCH_ZPCT:-}' \
+BENCH_TESTS='${BENCH_TESTS:-}' sh '$BENCH/guest.sh' '$OUT'"
+
+echo "bench: results in $OUT"
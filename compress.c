@@ -0,0 +1,299 @@
+/*
+ * 按extent透明压缩
+ *
+ * 挂载选项compress=<算法>打开后，新建的普通文件成为压缩文件。文件的逻辑
+ * 内容按JZPFS_EXT_SIZE（64KiB）切成extent（读写循环见extent.c），每个
+ * extent独立压缩，随机读只需要解压读到的extent。lower文件的布局：
+ *
+ *   [文件头 4KiB]  魔数"JFZ"，见extent.c
+ *   [组0: 索引 4KiB][extent槽 0..1023，每个64KiB]
+ *   [组1: 索引 4KiB][extent槽 1024..2047]
+ *   ...
+ *
+ * 索引里每个extent一个__le32：0表示空洞（全0），否则是压缩后的长度，
+ * 最高位表示不可压缩、原样保存。extent的位置由编号直接算出来，所以
+ * 索引不需要保存偏移，4KiB索引管64MiB数据。槽里没用到的部分打洞释放，
+ * lower上实际占用的空间和读的字节数都只跟压缩后的大小有关。
+ *
+ * extent原地重写，写入先写数据再改索引。
+ */
+
+#include "jzpfs.h"
+#include <linux/crypto.h>
+#include <linux/falloc.h>
+
+#define JZPFS_Z_IDX_SIZE	4096
+#define JZPFS_Z_GROUP_EXTENTS	(JZPFS_Z_IDX_SIZE / sizeof(__le32))
+#define JZPFS_Z_GROUP_SIZE	(JZPFS_Z_IDX_SIZE + \
+				 ((loff_t)JZPFS_Z_GROUP_EXTENTS << \
+				  JZPFS_EXT_SHIFT))
+
+/* 索引项 */
+#define JZPFS_Z_RAW		0x80000000	/* stored uncompressed */
+#define JZPFS_Z_LEN_MASK	0x0001ffff
+
+static const char * const jzpfs_z_algos[JZPFS_Z_NR_ALGOS] = {
+	[JZPFS_Z_LZ4]		= "lz4",
+	[JZPFS_Z_ZSTD]		= "zstd",
+	[JZPFS_Z_DEFLATE]	= "deflate",
+	[JZPFS_Z_LZO]		= "lzo",
+};
+
+/* 挂载选项里的算法名转成编号，内核不支持时返回负数 */
+int jzpfs_z_algo(const char *name)
+{
+	int i;
+
+	for (i = 1; i < JZPFS_Z_NR_ALGOS; i++) {
+		if (strcmp(name, jzpfs_z_algos[i]))
+			continue;
+		if (!crypto_has_comp(name, 0, 0))
+			return -ENOPKG;
+		return i;
+	}
+	return -EINVAL;
+}
+
+const char *jzpfs_z_algo_name(int algo)
+{
+	return jzpfs_z_algos[algo];
+}
+
+static inline loff_t jzpfs_z_group_off(u64 ext)
+{
+	return JZPFS_EXT_HDR_SIZE +
+	       div_u64(ext, JZPFS_Z_GROUP_EXTENTS) * JZPFS_Z_GROUP_SIZE;
+}
+
+static inline loff_t jzpfs_z_idx_off(u64 ext)
+{
+	u32 k;
+
+	div_u64_rem(ext, JZPFS_Z_GROUP_EXTENTS, &k);
+	return jzpfs_z_group_off(ext) + k * sizeof(__le32);
+}
+
+static inline loff_t jzpfs_z_slot_off(u64 ext)
+{
+	u32 k;
+
+	div_u64_rem(ext, JZPFS_Z_GROUP_EXTENTS, &k);
+	return jzpfs_z_group_off(ext) + JZPFS_Z_IDX_SIZE +
+	       ((loff_t)k << JZPFS_EXT_SHIFT);
+}
+
+static int jzpfs_z_get_entry(struct file *lower_file, u64 ext, u32 *entry)
+{
+	__le32 raw = 0;
+	ssize_t ret;
+
+	/* 文件尾之后的索引读不到，就是空洞 */
+	ret = jzpfs_ext_pread(lower_file, &raw, sizeof(raw),
+			    jzpfs_z_idx_off(ext));
+	if (ret < 0)
+		return ret;
+	*entry = le32_to_cpu(raw);
+	return 0;
+}
+
+/*
+ * 压缩和解压共用inode上的一个tfm，第一次用时分配
+ */
+static int jzpfs_z_transform(struct inode *inode, bool compress,
+			     const u8 *src, unsigned int slen,
+			     u8 *dst, unsigned int *dlen)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct crypto_comp *tfm;
+	int err;
+
+	mutex_lock(&info->z_mutex);
+	if (!info->z_tfm) {
+		tfm = crypto_alloc_comp(jzpfs_z_algos[info->ext_algo], 0, 0);
+		if (IS_ERR(tfm)) {
+			mutex_unlock(&info->z_mutex);
+			return PTR_ERR(tfm);
+		}
+		info->z_tfm = tfm;
+	}
+	if (compress)
+		err = crypto_comp_compress(info->z_tfm, src, slen, dst, dlen);
+	else
+		err = crypto_comp_decompress(info->z_tfm, src, slen, dst, dlen);
+	mutex_unlock(&info->z_mutex);
+	return err;
+}
+
+/*
+ * 读出第ext个extent解压到buf（JZPFS_EXT_SIZE字节），文件尾之后和空洞
+ * 都填0。cbuf是压缩数据的临时缓冲区。
+ */
+static int jzpfs_z_read_extent(struct inode *inode, struct file *lower_file,
+			       u64 ext, u8 *buf, u8 *cbuf)
+{
+	unsigned int clen, dlen;
+	loff_t slot;
+	ssize_t ret;
+	u32 entry;
+	u8 *dst;
+	int err;
+
+	err = jzpfs_z_get_entry(lower_file, ext, &entry);
+	if (err)
+		return err;
+	if (!entry) {
+		memset(buf, 0, JZPFS_EXT_SIZE);
+		return 0;
+	}
+
+	clen = entry & JZPFS_Z_LEN_MASK;
+	if (!clen || clen > JZPFS_EXT_SIZE)
+		goto corrupt;
+
+	/* 按整块读，打开校验和时可以直接校验 */
+	slot = jzpfs_z_slot_off(ext);
+	dst = (entry & JZPFS_Z_RAW) ? buf : cbuf;
+	ret = jzpfs_ext_pread(lower_file, dst,
+			    round_up(clen, JZPFS_CSUM_BLOCK), slot);
+	if (ret < 0)
+		return ret;
+	if (ret < clen)
+		goto corrupt;
+	jzpfs_stat_add(inode->i_sb, JZPFS_STAT_EXT_READ_LOWER, ret);
+	if (jzpfs_inode_csum(inode)) {
+		err = jzpfs_csum_verify(inode, dst, slot, ret);
+		if (err)
+			return err;
+	}
+
+	if (entry & JZPFS_Z_RAW) {
+		dlen = clen;
+	} else {
+		dlen = JZPFS_EXT_SIZE;
+		err = jzpfs_z_transform(inode, false, cbuf, clen, buf, &dlen);
+		if (err)
+			goto corrupt;
+	}
+	memset(buf + dlen, 0, JZPFS_EXT_SIZE - dlen);
+	return 0;
+
+corrupt:
+	printk_ratelimited(KERN_ERR
+	       "jzpfs: ino %lu: bad compressed extent %llu (0x%08x)\n",
+	       inode->i_ino, ext, entry);
+	return -EIO;
+}
+
+/*
+ * 压缩buf里的len字节写成第ext个extent。全0的extent不占空间；压缩后不比
+ * 原来小就原样保存。槽里不再用到的部分打洞。
+ */
+static int jzpfs_z_write_extent(struct inode *inode, struct file *lower_file,
+				u64 ext, u8 *buf, size_t len, u8 *cbuf)
+{
+	unsigned int clen = 0, wlen = 0, oldlen = 0;
+	loff_t slot = jzpfs_z_slot_off(ext);
+	u32 entry = 0, old;
+	__le32 raw;
+	u8 *src;
+	int err;
+
+	err = jzpfs_z_get_entry(lower_file, ext, &old);
+	if (err)
+		return err;
+	if (old)
+		oldlen = round_up(old & JZPFS_Z_LEN_MASK, JZPFS_CSUM_BLOCK);
+
+	if (memchr_inv(buf, 0, len)) {
+		clen = JZPFS_EXT_SIZE;
+		err = jzpfs_z_transform(inode, true, buf, len, cbuf, &clen);
+		if (err || clen >= len) {
+			src = buf;
+			clen = len;
+			entry = clen | JZPFS_Z_RAW;
+		} else {
+			src = cbuf;
+			entry = clen;
+		}
+		/* 补齐到整块，块尾的内容也是确定的 */
+		wlen = round_up(clen, JZPFS_CSUM_BLOCK);
+		memset(src + clen, 0, wlen - clen);
+		err = jzpfs_ext_pwrite(lower_file, src, wlen, slot);
+		if (err)
+			return err;
+		jzpfs_stat_add(inode->i_sb, JZPFS_STAT_EXT_WRITE_LOWER, wlen);
+	}
+
+	if (wlen < oldlen)
+		vfs_fallocate(lower_file,
+			      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      slot + wlen, oldlen - wlen);
+
+	if (entry != old) {
+		raw = cpu_to_le32(entry);
+		err = jzpfs_ext_pwrite(lower_file, &raw, sizeof(raw),
+				     jzpfs_z_idx_off(ext));
+		if (err)
+			return err;
+	}
+
+	if (jzpfs_inode_csum(inode)) {
+		jzpfs_csum_written(inode, lower_file, slot,
+				   slot + max(wlen, oldlen));
+		if (entry != old)
+			jzpfs_csum_written(inode, lower_file,
+					   jzpfs_z_idx_off(ext),
+					   jzpfs_z_idx_off(ext) + sizeof(raw));
+	}
+	return 0;
+}
+
+/* 有nr个extent时lower文件的大小：最后一个extent槽之后的都不要了 */
+static loff_t jzpfs_z_lower_size(u64 nr)
+{
+	return jzpfs_z_slot_off(nr);
+}
+
+/*
+ * 截断后清掉同一组里first及以后的索引项。索引块本身在截断点之前，
+ * 不清的话以后读到的是已经被截掉的槽。
+ */
+static int jzpfs_z_drop_extents(struct inode *inode, struct file *lower_file,
+				u64 first, u8 *scratch)
+{
+	loff_t idx = jzpfs_z_idx_off(first);
+	u32 k;
+
+	if (idx >= i_size_read(file_inode(lower_file)))
+		return 0;
+	div_u64_rem(first, JZPFS_Z_GROUP_EXTENTS, &k);
+	memset(scratch, 0, JZPFS_Z_IDX_SIZE);
+	return jzpfs_ext_pwrite(lower_file, scratch,
+				(JZPFS_Z_GROUP_EXTENTS - k) * sizeof(__le32),
+				idx);
+}
+
+static bool jzpfs_z_algo_ok(struct super_block *sb, u8 algo)
+{
+	return algo && algo < JZPFS_Z_NR_ALGOS;
+}
+
+const struct jzpfs_ext_ops jzpfs_z_ops = {
+	.name		= "compressed",
+	.magic		= JZPFS_Z_MAGIC,
+	.algo_ok	= jzpfs_z_algo_ok,
+	.read_extent	= jzpfs_z_read_extent,
+	.write_extent	= jzpfs_z_write_extent,
+	.lower_size	= jzpfs_z_lower_size,
+	.drop_extents	= jzpfs_z_drop_extents,
+};
+
+/* inode回收时释放压缩tfm */
+void jzpfs_z_drop(struct inode *inode)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+
+	if (info->z_tfm)
+		crypto_free_comp(info->z_tfm);
+	info->z_tfm = NULL;
+}
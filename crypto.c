@@ -0,0 +1,413 @@
+/*
+ * 每个文件独立的数据密钥
+ *
+ * 挂载时用key=<描述>指定内核keyring中的一个logon类型主密钥。每个加密文件
+ * 在lower上有一个随机nonce（xattr user.jzpfs.nonce），文件密钥为
+ *
+ *   HKDF-SHA256(IKM = 主密钥, salt = nonce, info = "jzpfs file key")
+ *
+ * 文件密钥只在inode第一次打开时派生一次，展开后的ctr(aes) tfm和处理
+ * 不对齐开头用的单块aes tfm挂在jzpfs_inode_info上，直到inode被回收或
+ * 主密钥被撤销。读写热路径上只做加解密，不做任何密钥设置和内存分配。
+ *
+ * 数据用AES-256-CTR加密，计数器就是lower文件偏移/16，所以任意偏移、任意
+ * 长度的读写都可以独立加解密；文件头（JZPFS_HDR_SIZE字节）不加密。
+ *
+ * 注意：同一个文件同一个偏移每次都用同一段密钥流。原地覆盖写之后，
+ * 能拿到lower上新旧两个版本的人把两份密文异或，得到的就是两份明文的
+ * 异或。所以这个方案只保护写一次的数据（归档、备份、只追加的日志），
+ * 对lower的快照、备份或被多次窃取的盘，反复改写的文件不安全。需要防
+ * 这种攻击的数据不要放在这里原地改写。
+ */
+
+#include "jzpfs.h"
+#include <linux/key.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+#include <asm/unaligned.h>
+#include <keys/user-type.h>
+#include <crypto/aes.h>
+#include <crypto/hash.h>
+#include <crypto/sha.h>
+#include <crypto/skcipher.h>
+
+#define JZPFS_FILE_KEY_SIZE	AES_KEYSIZE_256
+#define JZPFS_HKDF_INFO		"jzpfs file key"
+
+/*
+ * HKDF-SHA256，输出长度固定为一个SHA256块，正好是AES-256的密钥长度
+ */
+static int jzpfs_hkdf_sha256(const u8 *ikm, unsigned int ikm_len,
+			     const u8 *salt, unsigned int salt_len,
+			     u8 *okm)
+{
+	struct crypto_shash *hmac;
+	u8 prk[SHA256_DIGEST_SIZE];
+	const u8 counter = 1;
+	int err;
+
+	hmac = crypto_alloc_shash("hmac(sha256)", 0, 0);
+	if (IS_ERR(hmac))
+		return PTR_ERR(hmac);
+
+	{
+		SHASH_DESC_ON_STACK(desc, hmac);
+
+		desc->tfm = hmac;
+		desc->flags = 0;
+
+		/* extract */
+		err = crypto_shash_setkey(hmac, salt, salt_len);
+		if (err)
+			goto out;
+		err = crypto_shash_digest(desc, ikm, ikm_len, prk);
+		if (err)
+			goto out;
+
+		/* expand: T(1) = HMAC(PRK, info | 0x01) */
+		err = crypto_shash_setkey(hmac, prk, sizeof(prk));
+		if (err)
+			goto out;
+		err = crypto_shash_init(desc);
+		if (!err)
+			err = crypto_shash_update(desc, JZPFS_HKDF_INFO,
+						  strlen(JZPFS_HKDF_INFO));
+		if (!err)
+			err = crypto_shash_update(desc, &counter, 1);
+		if (!err)
+			err = crypto_shash_final(desc, okm);
+out:
+		shash_desc_zero(desc);
+	}
+	memzero_explicit(prk, sizeof(prk));
+	crypto_free_shash(hmac);
+	return err;
+}
+
+/*
+ * 取得可用的主密钥。主密钥被撤销或过期后，重新到keyring里找一次，这样
+ * 管理员换上新密钥后不需要重新挂载。返回时持有一个引用。
+ */
+static struct key *jzpfs_get_master_key(struct super_block *sb)
+{
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct key *key, *old = NULL;
+
+	mutex_lock(&sbi->key_mutex);
+	if (!sbi->master_key || key_validate(sbi->master_key)) {
+		key = request_key(&key_type_logon, sbi->key_desc, NULL);
+		if (IS_ERR(key)) {
+			mutex_unlock(&sbi->key_mutex);
+			return key;
+		}
+		old = sbi->master_key;
+		sbi->master_key = key;
+	}
+	key = key_get(sbi->master_key);
+	mutex_unlock(&sbi->key_mutex);
+
+	key_put(old);
+	return key;
+}
+
+/*
+ * 从主密钥和nonce派生文件密钥，并展开成ctr(aes) tfm和单块的aes tfm
+ * （*blockp）。*keyp返回派生时用的主密钥（带引用），之后用它判断密钥
+ * 是否被撤销。
+ */
+static struct crypto_skcipher *jzpfs_derive_file_tfm(struct super_block *sb,
+						      const u8 *nonce,
+						      struct crypto_cipher **blockp,
+						      struct key **keyp)
+{
+	struct crypto_cipher *block = NULL;
+	const struct user_key_payload *ukp;
+	struct crypto_skcipher *tfm;
+	u8 file_key[JZPFS_FILE_KEY_SIZE];
+	struct key *key;
+	int err;
+
+	key = jzpfs_get_master_key(sb);
+	if (IS_ERR(key))
+		return ERR_CAST(key);
+
+	down_read(&key->sem);
+	ukp = user_key_payload(key);
+	if (!ukp) {
+		/* key was revoked before we took the semaphore */
+		err = -EKEYREVOKED;
+	} else if (ukp->datalen < JZPFS_MASTER_KEY_MIN ||
+		   ukp->datalen > JZPFS_MASTER_KEY_MAX) {
+		err = -EINVAL;
+	} else {
+		err = jzpfs_hkdf_sha256(ukp->data, ukp->datalen,
+					nonce, JZPFS_NONCE_SIZE, file_key);
+	}
+	up_read(&key->sem);
+	if (err) {
+		key_put(key);
+		return ERR_PTR(err);
+	}
+
+	/* 只要同步实现，读写路径上直接在调用者上下文里完成 */
+	tfm = crypto_alloc_skcipher("ctr(aes)", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(tfm))
+		goto out;
+	err = crypto_skcipher_setkey(tfm, file_key, sizeof(file_key));
+	if (err)
+		goto out_free;
+	block = crypto_alloc_cipher("aes", 0, 0);
+	if (IS_ERR(block)) {
+		err = PTR_ERR(block);
+		goto out_free;
+	}
+	err = crypto_cipher_setkey(block, file_key, sizeof(file_key));
+	if (!err)
+		goto out;
+	crypto_free_cipher(block);
+out_free:
+	crypto_free_skcipher(tfm);
+	tfm = ERR_PTR(err);
+out:
+	memzero_explicit(file_key, sizeof(file_key));
+	if (IS_ERR(tfm)) {
+		key_put(key);
+	} else {
+		*blockp = block;
+		*keyp = key;
+	}
+	return tfm;
+}
+
+static int jzpfs_get_nonce(struct dentry *lower_dentry, u8 *nonce)
+{
+	ssize_t len;
+
+	len = __vfs_getxattr(lower_dentry, d_inode(lower_dentry),
+			     JZPFS_XATTR_NONCE, nonce, JZPFS_NONCE_SIZE);
+	if (len == -ENODATA || len == -EOPNOTSUPP)
+		return -ENODATA;
+	if (len < 0)
+		return len;
+	if (len != JZPFS_NONCE_SIZE)
+		return -EUCLEAN;
+	return 0;
+}
+
+/*
+ * 新建的文件在挂载了主密钥时生成nonce，成为加密文件
+ */
+int jzpfs_crypto_create(struct inode *inode, struct dentry *lower_dentry)
+{
+	printk(KERN_ALERT "jzpfs_crypto_create");
+	struct inode *lower_inode = d_inode(lower_dentry);
+	u8 nonce[JZPFS_NONCE_SIZE];
+	int err;
+
+	if (!JZPFS_SB(inode->i_sb)->key_desc)
+		return 0;
+
+	err = jzpfs_get_nonce(lower_dentry, nonce);
+	if (err != -ENODATA)
+		goto out;
+
+	get_random_bytes(nonce, sizeof(nonce));
+	inode_lock(lower_inode);
+	err = __vfs_setxattr_noperm(lower_dentry, JZPFS_XATTR_NONCE,
+				    nonce, sizeof(nonce), XATTR_CREATE);
+	inode_unlock(lower_inode);
+	jzpfs_xattr_invalidate(inode, JZPFS_XATTR_NONCE);
+	/* lost a race with another creator: use the nonce it stored */
+	if (err == -EEXIST)
+		err = jzpfs_get_nonce(lower_dentry, nonce);
+out:
+	memzero_explicit(nonce, sizeof(nonce));
+	if (err)
+		return err;
+	return jzpfs_crypto_setup(inode, lower_dentry);
+}
+
+/*
+ * 打开带文件头的文件时调用。没有nonce的是旧格式文件，不加密；
+ * 有nonce但是挂载时没有给主密钥，就无法访问。
+ */
+int jzpfs_crypto_setup(struct inode *inode, struct dentry *lower_dentry)
+{
+	printk(KERN_ALERT "jzpfs_crypto_setup");
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct crypto_skcipher *tfm;
+	u8 nonce[JZPFS_NONCE_SIZE];
+	int err;
+
+	/* fast path: key already derived for this inode */
+	if (READ_ONCE(info->key_tfm))
+		return 0;
+
+	err = jzpfs_get_nonce(lower_dentry, nonce);
+	if (err == -ENODATA)
+		return 0;
+	if (err)
+		return err;
+	set_bit(JZPFS_INODE_ENCRYPTED, &info->flags);
+	if (!JZPFS_SB(inode->i_sb)->key_desc) {
+		err = -ENOKEY;
+		goto out;
+	}
+
+	down_write(&info->key_sem);
+	if (!info->key_tfm) {
+		tfm = jzpfs_derive_file_tfm(inode->i_sb, nonce,
+					    &info->key_block, &info->key);
+		if (IS_ERR(tfm))
+			err = PTR_ERR(tfm);
+		else
+			info->key_tfm = tfm;
+	}
+	up_write(&info->key_sem);
+out:
+	memzero_explicit(nonce, sizeof(nonce));
+	return err;
+}
+
+/*
+ * 丢掉inode上缓存的密钥，在回收inode和发现主密钥被撤销时调用
+ */
+void jzpfs_crypto_drop(struct inode *inode)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct crypto_skcipher *tfm;
+	struct crypto_cipher *block;
+	struct key *key;
+
+	down_write(&info->key_sem);
+	tfm = info->key_tfm;
+	block = info->key_block;
+	key = info->key;
+	info->key_tfm = NULL;
+	info->key_block = NULL;
+	info->key = NULL;
+	up_write(&info->key_sem);
+
+	if (tfm)
+		crypto_free_skcipher(tfm);
+	if (block)
+		crypto_free_cipher(block);
+	key_put(key);
+}
+
+static void jzpfs_ctr_iv(u8 *iv, loff_t pos)
+{
+	u64 ctr = (u64)pos >> 4;
+
+	memset(iv, 0, AES_BLOCK_SIZE);
+	put_unaligned_be64(ctr, iv + 8);
+}
+
+static int jzpfs_ctr_crypt(struct crypto_skcipher *tfm, u8 *buf, size_t len,
+			   loff_t pos)
+{
+	SKCIPHER_REQUEST_ON_STACK(req, tfm);
+	struct scatterlist sg;
+	u8 iv[AES_BLOCK_SIZE];
+	int err;
+
+	jzpfs_ctr_iv(iv, pos);
+	sg_init_one(&sg, buf, len);
+	skcipher_request_set_tfm(req, tfm);
+	skcipher_request_set_callback(req, 0, NULL, NULL);
+	skcipher_request_set_crypt(req, &sg, &sg, len, iv);
+	err = crypto_skcipher_encrypt(req);
+	skcipher_request_zero(req);
+	return err;
+}
+
+/*
+ * 对buf中位于lower偏移pos处的len字节加密或解密（CTR模式两者相同）。
+ * buf必须是线性映射的内核内存（kmalloc或页），不能在栈上。
+ */
+int jzpfs_crypt(struct inode *inode, u8 *buf, size_t len, loff_t pos)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	u8 iv[AES_BLOCK_SIZE], ks[AES_BLOCK_SIZE];
+	unsigned int head, i;
+	int err;
+
+	/* 文件头不加密 */
+	if (pos < JZPFS_HDR_SIZE) {
+		head = min_t(size_t, len, JZPFS_HDR_SIZE - pos);
+		buf += head;
+		len -= head;
+		pos += head;
+	}
+	if (!len)
+		return 0;
+
+	down_read(&info->key_sem);
+	if (!info->key_tfm) {
+		up_read(&info->key_sem);
+		return -ENOKEY;
+	}
+	err = key_validate(info->key);
+	if (err) {
+		up_read(&info->key_sem);
+		jzpfs_crypto_drop(inode);
+		return err;
+	}
+
+	/*
+	 * 不在16字节边界上的开头部分：用单块aes算出这一块的密钥流直接异或，
+	 * 不经过scatterlist，栈上的缓冲区就可以
+	 */
+	head = pos & (AES_BLOCK_SIZE - 1);
+	if (head) {
+		unsigned int n = min_t(size_t, len, AES_BLOCK_SIZE - head);
+
+		jzpfs_ctr_iv(iv, pos);
+		crypto_cipher_encrypt_one(info->key_block, ks, iv);
+		for (i = 0; i < n; i++)
+			buf[i] ^= ks[head + i];
+		memzero_explicit(ks, sizeof(ks));
+		buf += n;
+		len -= n;
+		pos += n;
+	}
+	err = 0;
+	if (len)
+		err = jzpfs_ctr_crypt(info->key_tfm, buf, len, pos);
+	up_read(&info->key_sem);
+	return err;
+}
+
+/*
+ * 挂载时检查主密钥存在，之后由jzpfs_get_master_key按需重新查找
+ */
+int jzpfs_crypto_init_sb(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_crypto_init_sb");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct key *key;
+
+	mutex_init(&sbi->key_mutex);
+	if (!sbi->key_desc)
+		return 0;
+
+	key = jzpfs_get_master_key(sb);
+	if (IS_ERR(key)) {
+		printk(KERN_ERR "jzpfs: master key '%s' not found: %ld\n",
+		       sbi->key_desc, PTR_ERR(key));
+		return PTR_ERR(key);
+	}
+	key_put(key);
+	return 0;
+}
+
+void jzpfs_crypto_exit_sb(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_crypto_exit_sb");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+
+	key_put(sbi->master_key);
+	sbi->master_key = NULL;
+	kfree(sbi->key_desc);
+	sbi->key_desc = NULL;
+}
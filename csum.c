@@ -0,0 +1,373 @@
+/*
+ * 数据块校验和
+ *
+ * 挂载选项csum打开后，普通文件的lower数据按JZPFS_CSUM_BLOCK（4KiB）分块，
+ * 每块一个crc32c（用内核的crc32c，有硬件指令时自动用加速实现）。
+ * 校验和保存在元数据目录的csum/<lower inode号>文件里：
+ *
+ *   struct jzpfs_csum_hdr    文件属于哪个lower inode（防止inode号重用）
+ *   __le32 sum[n]            第n块crc32c的低31位；JZPFS_CSUM_NONE表示这
+ *                            一块没有校验和
+ *
+ * 校验的是lower上实际存放的字节（加密文件就是密文），写之后按批重新
+ * 计算被写到的块，读的时候先校验再做反变换，不一致返回-EIO。
+ *
+ * 没有校验和必须显式写成JZPFS_CSUM_NONE：被清零、被截短（读不到）的
+ * 项都当作校验和0去比，数据对不上就报错，而不是悄悄不校验。唯一的例外
+ * 是数据全零的块：lower上的空洞对应的校验和文件也是空洞（比如跳着写、
+ * 截断变长），读出来都是0。建校验和文件时已有的数据块、整体作废的
+ * 校验和都写成JZPFS_CSUM_NONE。
+ */
+
+#include "jzpfs.h"
+#include <linux/crc32c.h>
+
+#define JZPFS_CSUM_MAGIC	0x4a5a4332	/* "JZC2" */
+#define JZPFS_CSUM_MASK		0x7fffffff
+#define JZPFS_CSUM_NONE		0xffffffff	/* block has no checksum */
+
+struct jzpfs_csum_hdr {
+	__le32 magic;
+	__le32 generation;
+	__le64 ino;
+};
+
+static inline loff_t jzpfs_csum_off(u64 blk)
+{
+	return sizeof(struct jzpfs_csum_hdr) + blk * sizeof(__le32);
+}
+
+static inline u32 jzpfs_csum_block(const u8 *data, size_t len)
+{
+	return crc32c(~0, data, len) & JZPFS_CSUM_MASK;
+}
+
+static ssize_t jzpfs_csum_io(struct file *file, void *buf, size_t len,
+			     loff_t pos, bool write)
+{
+	mm_segment_t old_fs;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	if (write)
+		ret = vfs_write(file, (const char __user *)buf, len, &pos);
+	else
+		ret = vfs_read(file, (char __user *)buf, len, &pos);
+	set_fs(old_fs);
+	return ret;
+}
+
+/*
+ * 把[0, nblk)块的校验和都写成JZPFS_CSUM_NONE，校验和文件里原来只有
+ * 文件头
+ */
+static int jzpfs_csum_fill_none(struct file *file, u64 nblk)
+{
+	loff_t pos = jzpfs_csum_off(0), end = jzpfs_csum_off(nblk);
+	ssize_t ret;
+	size_t n;
+	u8 *buf;
+	int err = 0;
+
+	if (!nblk)
+		return 0;
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0xff, PAGE_SIZE);
+	while (pos < end) {
+		n = min_t(loff_t, end - pos, PAGE_SIZE);
+		ret = jzpfs_csum_io(file, buf, n, pos, true);
+		if (ret != n) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+		pos += n;
+		cond_resched();
+	}
+	kfree(buf);
+	return err;
+}
+
+/*
+ * 取得inode的校验和文件。create为false时没有校验和文件返回NULL，并记住
+ * 这个结果，避免每次读都去查找。
+ */
+static struct file *jzpfs_csum_file(struct inode *inode, bool create)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct inode *lower_inode = jzpfs_lower_inode(inode);
+	struct jzpfs_csum_hdr hdr, want;
+	struct file *file;
+	char name[24];
+	ssize_t ret;
+	int err;
+
+	file = READ_ONCE(info->csum_file);
+	if (file)
+		return file;
+	if (!create && test_bit(JZPFS_INODE_CSUM_NONE, &info->flags))
+		return NULL;
+
+	mutex_lock(&info->csum_mutex);
+	file = info->csum_file;
+	if (file)
+		goto out;
+
+	want.magic = cpu_to_le32(JZPFS_CSUM_MAGIC);
+	want.generation = cpu_to_le32(lower_inode->i_generation);
+	want.ino = cpu_to_le64(lower_inode->i_ino);
+
+	snprintf(name, sizeof(name), "%lx", lower_inode->i_ino);
+	file = jzpfs_meta_open(inode->i_sb, JZPFS_SB(inode->i_sb)->csum_dir,
+			       name, create);
+	if (IS_ERR(file)) {
+		if (PTR_ERR(file) == -ENOENT && !create) {
+			set_bit(JZPFS_INODE_CSUM_NONE, &info->flags);
+			file = NULL;
+		}
+		goto out;
+	}
+
+	ret = jzpfs_csum_io(file, &hdr, sizeof(hdr), 0, false);
+	if (ret == sizeof(hdr) && !memcmp(&hdr, &want, sizeof(hdr)))
+		goto found;
+
+	/* 空文件或者是被删除的文件留下的（inode号被重用了） */
+	if (!create) {
+		fput(file);
+		file = NULL;
+		set_bit(JZPFS_INODE_CSUM_NONE, &info->flags);
+		goto out;
+	}
+	err = jzpfs_meta_truncate(inode->i_sb, file, 0);
+	if (!err) {
+		ret = jzpfs_csum_io(file, &want, sizeof(want), 0, true);
+		err = ret == sizeof(want) ? 0 : (ret < 0 ? ret : -EIO);
+	}
+	/* 已经在lower上的数据没有校验和（调用者随后更新它写到的块） */
+	if (!err)
+		err = jzpfs_csum_fill_none(file,
+			DIV_ROUND_UP(i_size_read(lower_inode),
+				     JZPFS_CSUM_BLOCK));
+	if (err) {
+		fput(file);
+		file = ERR_PTR(err);
+		goto out;
+	}
+found:
+	clear_bit(JZPFS_INODE_CSUM_NONE, &info->flags);
+	smp_store_release(&info->csum_file, file);
+out:
+	mutex_unlock(&info->csum_mutex);
+	return file;
+}
+
+/*
+ * 校验从lower偏移pos（块对齐）读到的len字节。最后一个不完整的块只有
+ * 在文件尾时才校验（写的时候就是按到文件尾的长度算的）。
+ */
+int jzpfs_csum_verify(struct inode *inode, const u8 *data, loff_t pos,
+		      size_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	__le32 sums[JZPFS_CSUM_BATCH];
+	struct file *file;
+	u64 blk, nblk, i, j, n;
+	size_t blen, off;
+	ssize_t ret;
+	u32 crc;
+
+	file = jzpfs_csum_file(inode, false);
+	if (IS_ERR_OR_NULL(file))
+		return PTR_ERR(file);
+
+	blk = pos >> JZPFS_CSUM_SHIFT;
+	nblk = DIV_ROUND_UP(len, JZPFS_CSUM_BLOCK);
+	if ((len & (JZPFS_CSUM_BLOCK - 1)) &&
+	    pos + len < i_size_read(jzpfs_lower_inode(inode)))
+		nblk--;
+
+	for (i = 0; i < nblk; i += n) {
+		n = min_t(u64, nblk - i, JZPFS_CSUM_BATCH);
+		/* entries past a short read compare as 0, see the top */
+		memset(sums, 0, sizeof(sums));
+		ret = jzpfs_csum_io(file, sums, n * sizeof(__le32),
+				    jzpfs_csum_off(blk + i), false);
+		if (ret < 0)
+			return ret;
+
+		for (j = 0; j < n; j++) {
+			if (sums[j] == cpu_to_le32(JZPFS_CSUM_NONE))
+				continue;
+			off = (i + j) << JZPFS_CSUM_SHIFT;
+			blen = min_t(size_t, JZPFS_CSUM_BLOCK, len - off);
+			crc = jzpfs_csum_block(data + off, blen);
+			jzpfs_stat_inc(sb, JZPFS_STAT_CSUM_VERIFIED);
+			if (crc == le32_to_cpu(sums[j]))
+				continue;
+			/* lower和校验和文件上都是空洞 */
+			if (!sums[j] && !memchr_inv(data + off, 0, blen))
+				continue;
+			jzpfs_stat_inc(sb, JZPFS_STAT_CSUM_FAILED);
+			printk_ratelimited(KERN_ERR
+			       "jzpfs: checksum mismatch ino %lu block %llu: "
+			       "0x%08x != 0x%08x\n", inode->i_ino, blk + i + j,
+			       crc, le32_to_cpu(sums[j]));
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * lower文件[from, to)被写过以后，重新计算覆盖到的块的校验和。数据从
+ * lower（的页缓存）读回来，按JZPFS_CSUM_BATCH块一批计算、一次写入。
+ */
+int jzpfs_csum_update(struct inode *inode, struct file *lower_file,
+		      loff_t from, loff_t to)
+{
+	struct inode *lower_inode = file_inode(lower_file);
+	__le32 sums[JZPFS_CSUM_BATCH];
+	struct file *file;
+	u64 blk, end, i, n;
+	mm_segment_t old_fs;
+	loff_t size, pos;
+	ssize_t ret;
+	size_t blen;
+	u8 *buf;
+	int err = 0;
+
+	size = i_size_read(lower_inode);
+	if (to > size)
+		to = size;
+	if (from >= to)
+		return 0;
+
+	file = jzpfs_csum_file(inode, true);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	buf = kmalloc(JZPFS_CSUM_BATCH << JZPFS_CSUM_SHIFT,
+		      GFP_KERNEL | __GFP_NOWARN);
+	if (!buf)
+		return -ENOMEM;
+
+	blk = from >> JZPFS_CSUM_SHIFT;
+	end = DIV_ROUND_UP(to, JZPFS_CSUM_BLOCK);
+	for (; blk < end; blk += n) {
+		n = min_t(u64, end - blk, JZPFS_CSUM_BATCH);
+		pos = blk << JZPFS_CSUM_SHIFT;
+		/* lower可能是只写打开的，直接用__vfs_read */
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = __vfs_read(lower_file, (char __user *)buf,
+				 n << JZPFS_CSUM_SHIFT, &pos);
+		set_fs(old_fs);
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (ret <= (ssize_t)(i << JZPFS_CSUM_SHIFT)) {
+				sums[i] = cpu_to_le32(JZPFS_CSUM_NONE);
+				continue;
+			}
+			blen = min_t(size_t, JZPFS_CSUM_BLOCK,
+				     ret - (i << JZPFS_CSUM_SHIFT));
+			sums[i] = cpu_to_le32(jzpfs_csum_block(
+					buf + (i << JZPFS_CSUM_SHIFT), blen));
+		}
+		ret = jzpfs_csum_io(file, sums, n * sizeof(__le32),
+				    jzpfs_csum_off(blk), true);
+		if (ret != n * sizeof(__le32)) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+		jzpfs_stat_add(inode->i_sb, JZPFS_STAT_CSUM_UPDATED, n);
+	}
+	kfree(buf);
+	return err;
+}
+
+/*
+ * 丢掉所有校验和（比如文件被可写mmap，之后的修改不经过我们）：现有的
+ * 块都标成没有校验和
+ */
+int jzpfs_csum_invalidate(struct inode *inode)
+{
+	struct file *file;
+	int err;
+
+	file = jzpfs_csum_file(inode, false);
+	if (IS_ERR_OR_NULL(file))
+		return PTR_ERR(file);
+	err = jzpfs_meta_truncate(inode->i_sb, file, jzpfs_csum_off(0));
+	if (!err)
+		err = jzpfs_csum_fill_none(file,
+			DIV_ROUND_UP(i_size_read(jzpfs_lower_inode(inode)),
+				     JZPFS_CSUM_BLOCK));
+	return err;
+}
+
+/*
+ * 文件被截断到newsize：去掉多余的校验和，重算新的最后一块
+ */
+int jzpfs_csum_truncate(struct inode *inode, struct file *lower_file,
+			loff_t newsize)
+{
+	struct file *file;
+	int err;
+
+	file = jzpfs_csum_file(inode, false);
+	if (IS_ERR_OR_NULL(file))
+		return PTR_ERR(file);
+
+	err = jzpfs_meta_truncate(inode->i_sb, file,
+		jzpfs_csum_off(DIV_ROUND_UP(newsize, JZPFS_CSUM_BLOCK)));
+	if (err || !(newsize & (JZPFS_CSUM_BLOCK - 1)))
+		return err;
+	return jzpfs_csum_update(inode, lower_file,
+				 round_down(newsize, JZPFS_CSUM_BLOCK),
+				 newsize);
+}
+
+/*
+ * 写完之后更新校验和。更新失败时数据已经写下去了，只能丢掉校验和，
+ * 不然以后读会报-EIO。
+ */
+void jzpfs_csum_written(struct inode *inode, struct file *lower_file,
+			loff_t from, loff_t to)
+{
+	int err;
+
+	err = jzpfs_csum_update(inode, lower_file, from, to);
+	if (!err)
+		return;
+	printk_ratelimited(KERN_ERR
+	       "jzpfs: ino %lu: checksum update failed (%d), dropping checksums\n",
+	       inode->i_ino, err);
+	jzpfs_csum_invalidate(inode);
+}
+
+/*
+ * lower文件被删除后删掉它的校验和文件
+ */
+void jzpfs_csum_unlink(struct super_block *sb, struct inode *lower_inode)
+{
+	char name[24];
+
+	snprintf(name, sizeof(name), "%lx", lower_inode->i_ino);
+	jzpfs_meta_unlink(sb, JZPFS_SB(sb)->csum_dir, name);
+}
+
+/* inode回收时关闭校验和文件 */
+void jzpfs_csum_release(struct inode *inode)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+
+	if (info->csum_file)
+		fput(info->csum_file);
+	info->csum_file = NULL;
+}
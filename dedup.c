@@ -0,0 +1,408 @@
+/*
+ * 按内容寻址的块去重
+ *
+ * 挂载选项dedup打开后，新建的普通文件成为去重文件。逻辑内容按
+ * JZPFS_EXT_SIZE（64KiB）切成定长的块（读写循环见extent.c），每块算
+ * SHA-256（内核crypto会选有硬件加速的实现），块的内容只在元数据目录
+ * chunks/下以摘要的十六进制为文件名保存一份。lower上的文件只有：
+ *
+ *   [文件头 4KiB]  魔数"JFD"，见extent.c
+ *   [块映射]       每块32字节的摘要，全0表示空洞
+ *
+ * 读经过块映射，每个挂载点有一个按摘要索引的块缓存，多个文件共享的
+ * 热块直接从缓存拷贝。写先保存块再改映射，已经存在的块不再写。
+ *
+ * 块没有引用计数，删除、截断和覆盖都不会回收块。没有挂载时用
+ * tools/jzpfs-gc扫一遍lower，删掉没有任何块映射引用的块。
+ */
+
+#include "jzpfs.h"
+#include <linux/hashtable.h>
+#include <linux/vmalloc.h>
+#include <asm/unaligned.h>
+#include <crypto/hash.h>
+#include <crypto/sha.h>
+
+#define JZPFS_DEDUP_SHA256	1
+#define JZPFS_DIGEST_SIZE	SHA256_DIGEST_SIZE
+#define JZPFS_CHUNK_HASH_BITS	8
+#define JZPFS_CHUNK_CACHE_MAX	128	/* chunks, 8 MiB */
+
+/* 缓存的块，引用计数为0时释放 */
+struct jzpfs_chunk {
+	struct hlist_node hash;
+	struct list_head lru;
+	atomic_t count;
+	u8 digest[JZPFS_DIGEST_SIZE];
+	unsigned int len;
+	u8 *data;
+};
+
+struct jzpfs_chunk_cache {
+	spinlock_t lock;	/* protects hash, lru and nr */
+	DECLARE_HASHTABLE(hash, JZPFS_CHUNK_HASH_BITS);
+	struct list_head lru;
+	unsigned int nr;
+};
+
+static const u8 jzpfs_zero_digest[JZPFS_DIGEST_SIZE];
+
+static inline loff_t jzpfs_dedup_map_off(u64 ext)
+{
+	return JZPFS_EXT_HDR_SIZE + ext * JZPFS_DIGEST_SIZE;
+}
+
+static int jzpfs_chunk_digest(struct super_block *sb, const u8 *data,
+			      unsigned int len, u8 *digest)
+{
+	SHASH_DESC_ON_STACK(desc, JZPFS_SB(sb)->chunk_tfm);
+	int err;
+
+	desc->tfm = JZPFS_SB(sb)->chunk_tfm;
+	desc->flags = 0;
+	err = crypto_shash_digest(desc, data, len, digest);
+	shash_desc_zero(desc);
+	return err;
+}
+
+static void jzpfs_chunk_put(struct jzpfs_chunk *chunk)
+{
+	if (!atomic_dec_and_test(&chunk->count))
+		return;
+	kvfree(chunk->data);
+	kfree(chunk);
+}
+
+/* 在缓存里找块，找到时带一个引用返回 */
+static struct jzpfs_chunk *jzpfs_chunk_lookup(struct jzpfs_chunk_cache *cache,
+					      const u8 *digest)
+{
+	struct jzpfs_chunk *chunk;
+	u32 key = get_unaligned((u32 *)digest);
+
+	spin_lock(&cache->lock);
+	hash_for_each_possible(cache->hash, chunk, hash, key) {
+		if (memcmp(chunk->digest, digest, JZPFS_DIGEST_SIZE))
+			continue;
+		list_move(&chunk->lru, &cache->lru);
+		atomic_inc(&chunk->count);
+		spin_unlock(&cache->lock);
+		return chunk;
+	}
+	spin_unlock(&cache->lock);
+	return NULL;
+}
+
+/* 把读到的块放进缓存，超出容量时淘汰最久没用的 */
+static void jzpfs_chunk_insert(struct jzpfs_chunk_cache *cache,
+			       const u8 *digest, const u8 *data,
+			       unsigned int len)
+{
+	struct jzpfs_chunk *chunk, *old;
+	u32 key = get_unaligned((u32 *)digest);
+
+	chunk = kmalloc(sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
+		return;
+	chunk->data = kmalloc(len, GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY);
+	if (!chunk->data)
+		chunk->data = vmalloc(len);
+	if (!chunk->data) {
+		kfree(chunk);
+		return;
+	}
+	memcpy(chunk->digest, digest, JZPFS_DIGEST_SIZE);
+	memcpy(chunk->data, data, len);
+	chunk->len = len;
+	atomic_set(&chunk->count, 1);
+
+	spin_lock(&cache->lock);
+	hash_for_each_possible(cache->hash, old, hash, key) {
+		/* 别人先放进去了 */
+		if (!memcmp(old->digest, digest, JZPFS_DIGEST_SIZE)) {
+			spin_unlock(&cache->lock);
+			jzpfs_chunk_put(chunk);
+			return;
+		}
+	}
+	hash_add(cache->hash, &chunk->hash, key);
+	list_add(&chunk->lru, &cache->lru);
+	if (++cache->nr <= JZPFS_CHUNK_CACHE_MAX) {
+		spin_unlock(&cache->lock);
+		return;
+	}
+	old = list_last_entry(&cache->lru, struct jzpfs_chunk, lru);
+	hash_del(&old->hash);
+	list_del(&old->lru);
+	cache->nr--;
+	spin_unlock(&cache->lock);
+	jzpfs_chunk_put(old);
+}
+
+static struct file *jzpfs_chunk_open(struct super_block *sb, const u8 *digest,
+				     bool create)
+{
+	char name[2 * JZPFS_DIGEST_SIZE + 1];
+
+	snprintf(name, sizeof(name), "%*phN", JZPFS_DIGEST_SIZE, digest);
+	return jzpfs_meta_open(sb, JZPFS_SB(sb)->chunk_dir, name, create);
+}
+
+/*
+ * 取得摘要为digest的块放到buf里，返回块的长度
+ */
+static int jzpfs_chunk_read(struct inode *inode, const u8 *digest, u8 *buf,
+			    u8 *scratch)
+{
+	struct super_block *sb = inode->i_sb;
+	struct jzpfs_chunk *chunk;
+	struct file *file;
+	ssize_t ret;
+	int err;
+
+	chunk = jzpfs_chunk_lookup(JZPFS_SB(sb)->chunk_cache, digest);
+	if (chunk) {
+		jzpfs_stat_inc(sb, JZPFS_STAT_CHUNK_CACHE_HIT);
+		memcpy(buf, chunk->data, chunk->len);
+		ret = chunk->len;
+		jzpfs_chunk_put(chunk);
+		return ret;
+	}
+	jzpfs_stat_inc(sb, JZPFS_STAT_CHUNK_CACHE_MISS);
+
+	file = jzpfs_chunk_open(sb, digest, false);
+	if (IS_ERR(file)) {
+		printk_ratelimited(KERN_ERR
+		       "jzpfs: ino %lu: missing chunk %*phN: %ld\n",
+		       inode->i_ino, JZPFS_DIGEST_SIZE, digest, PTR_ERR(file));
+		return PTR_ERR(file) == -ENOENT ? -EIO : PTR_ERR(file);
+	}
+	ret = jzpfs_ext_pread(file, buf, JZPFS_EXT_SIZE, 0);
+	fput(file);
+	if (ret <= 0)
+		return ret ? ret : -EIO;
+	jzpfs_stat_add(sb, JZPFS_STAT_EXT_READ_LOWER, ret);
+
+	/* 打开了校验和时，块的摘要就是它的校验和 */
+	if (JZPFS_SB(sb)->csum) {
+		err = jzpfs_chunk_digest(sb, buf, ret, scratch);
+		if (err)
+			return err;
+		jzpfs_stat_inc(sb, JZPFS_STAT_CSUM_VERIFIED);
+		if (memcmp(scratch, digest, JZPFS_DIGEST_SIZE)) {
+			jzpfs_stat_inc(sb, JZPFS_STAT_CSUM_FAILED);
+			printk_ratelimited(KERN_ERR
+			       "jzpfs: chunk %*phN is corrupted\n",
+			       JZPFS_DIGEST_SIZE, digest);
+			return -EIO;
+		}
+	}
+
+	jzpfs_chunk_insert(JZPFS_SB(sb)->chunk_cache, digest, buf, ret);
+	return ret;
+}
+
+/*
+ * 保存块，已经在块仓库里而且内容对得上摘要就不再写。scratch用来读出
+ * 已有的块，至少JZPFS_EXT_SIZE字节
+ */
+static int jzpfs_chunk_store(struct inode *inode, const u8 *digest,
+			     const u8 *buf, unsigned int len, u8 *scratch)
+{
+	struct super_block *sb = inode->i_sb;
+	u8 sum[JZPFS_DIGEST_SIZE];
+	struct jzpfs_chunk *chunk;
+	struct file *file;
+	ssize_t ret;
+	int err = 0;
+
+	chunk = jzpfs_chunk_lookup(JZPFS_SB(sb)->chunk_cache, digest);
+	if (chunk) {
+		jzpfs_chunk_put(chunk);
+		jzpfs_stat_inc(sb, JZPFS_STAT_DEDUP_HIT);
+		return 0;
+	}
+
+	file = jzpfs_chunk_open(sb, digest, true);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	/*
+	 * 上次没写完（崩溃或者lower写满）的块长度可能刚好对得上，
+	 * 内容要重新算一遍摘要，对不上就整块重写
+	 */
+	if (i_size_read(file_inode(file)) == len) {
+		ret = jzpfs_ext_pread(file, scratch, len, 0);
+		if (ret < 0) {
+			err = ret;
+			goto out;
+		}
+		if (ret == len) {
+			err = jzpfs_chunk_digest(sb, scratch, len, sum);
+			if (err)
+				goto out;
+			if (!memcmp(sum, digest, JZPFS_DIGEST_SIZE)) {
+				jzpfs_stat_inc(sb, JZPFS_STAT_DEDUP_HIT);
+				jzpfs_chunk_insert(JZPFS_SB(sb)->chunk_cache,
+						   digest, scratch, len);
+				goto out;
+			}
+		}
+		printk_ratelimited(KERN_WARNING
+		       "jzpfs: rewriting torn chunk %*phN\n",
+		       JZPFS_DIGEST_SIZE, digest);
+	}
+	err = jzpfs_ext_pwrite(file, buf, len, 0);
+	if (!err) {
+		jzpfs_stat_inc(sb, JZPFS_STAT_DEDUP_NEW);
+		jzpfs_stat_add(sb, JZPFS_STAT_EXT_WRITE_LOWER, len);
+	}
+out:
+	fput(file);
+	return err;
+}
+
+static int jzpfs_dedup_get_digest(struct file *lower_file, u64 ext,
+				  u8 *digest)
+{
+	ssize_t ret;
+
+	/* 映射之外的块是空洞 */
+	memset(digest, 0, JZPFS_DIGEST_SIZE);
+	ret = jzpfs_ext_pread(lower_file, digest, JZPFS_DIGEST_SIZE,
+			      jzpfs_dedup_map_off(ext));
+	return ret < 0 ? ret : 0;
+}
+
+static int jzpfs_dedup_read_extent(struct inode *inode, struct file *lower_file,
+				   u64 ext, u8 *buf, u8 *scratch)
+{
+	u8 digest[JZPFS_DIGEST_SIZE];
+	int ret;
+
+	ret = jzpfs_dedup_get_digest(lower_file, ext, digest);
+	if (ret)
+		return ret;
+	if (!memcmp(digest, jzpfs_zero_digest, JZPFS_DIGEST_SIZE)) {
+		memset(buf, 0, JZPFS_EXT_SIZE);
+		return 0;
+	}
+
+	ret = jzpfs_chunk_read(inode, digest, buf, scratch);
+	if (ret < 0)
+		return ret;
+	memset(buf + ret, 0, JZPFS_EXT_SIZE - ret);
+	return 0;
+}
+
+static int jzpfs_dedup_write_extent(struct inode *inode,
+				    struct file *lower_file, u64 ext,
+				    u8 *buf, size_t len, u8 *scratch)
+{
+	u8 digest[JZPFS_DIGEST_SIZE], old[JZPFS_DIGEST_SIZE];
+	loff_t off = jzpfs_dedup_map_off(ext);
+	int err;
+
+	err = jzpfs_dedup_get_digest(lower_file, ext, old);
+	if (err)
+		return err;
+
+	if (!memchr_inv(buf, 0, len)) {
+		memset(digest, 0, JZPFS_DIGEST_SIZE);
+	} else {
+		err = jzpfs_chunk_digest(inode->i_sb, buf, len, digest);
+		if (!err)
+			err = jzpfs_chunk_store(inode, digest, buf, len,
+						scratch);
+		if (err)
+			return err;
+	}
+
+	if (!memcmp(digest, old, JZPFS_DIGEST_SIZE))
+		return 0;
+	err = jzpfs_ext_pwrite(lower_file, digest, JZPFS_DIGEST_SIZE, off);
+	if (!err && jzpfs_inode_csum(inode))
+		jzpfs_csum_written(inode, lower_file, off,
+				   off + JZPFS_DIGEST_SIZE);
+	return err;
+}
+
+/* 有nr块时lower文件（文件头加映射）的大小 */
+static loff_t jzpfs_dedup_lower_size(u64 nr)
+{
+	return jzpfs_dedup_map_off(nr);
+}
+
+/* 块仓库只在dedup挂载时才准备 */
+static bool jzpfs_dedup_algo_ok(struct super_block *sb, u8 algo)
+{
+	return algo == JZPFS_DEDUP_SHA256 && JZPFS_SB(sb)->chunk_cache;
+}
+
+const struct jzpfs_ext_ops jzpfs_dedup_ops = {
+	.name		= "deduplicated",
+	.magic		= JZPFS_DEDUP_MAGIC,
+	.algo_ok	= jzpfs_dedup_algo_ok,
+	.read_extent	= jzpfs_dedup_read_extent,
+	.write_extent	= jzpfs_dedup_write_extent,
+	.lower_size	= jzpfs_dedup_lower_size,
+};
+
+/* dedup挂载下新建的文件 */
+int jzpfs_dedup_create(struct inode *inode, struct file *lower_file)
+{
+	return jzpfs_ext_create(inode, lower_file, &jzpfs_dedup_ops,
+				JZPFS_DEDUP_SHA256);
+}
+
+/*
+ * dedup挂载时准备摘要tfm、块缓存和块仓库目录
+ */
+int jzpfs_dedup_init_sb(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_dedup_init_sb");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct jzpfs_chunk_cache *cache;
+	struct dentry *dir;
+
+	sbi->chunk_tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(sbi->chunk_tfm)) {
+		int err = PTR_ERR(sbi->chunk_tfm);
+
+		sbi->chunk_tfm = NULL;
+		return err;
+	}
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return -ENOMEM;
+	spin_lock_init(&cache->lock);
+	hash_init(cache->hash);
+	INIT_LIST_HEAD(&cache->lru);
+	sbi->chunk_cache = cache;
+
+	dir = jzpfs_meta_subdir(sb, "chunks");
+	if (IS_ERR(dir))
+		return PTR_ERR(dir);
+	sbi->chunk_dir = dir;
+	return 0;
+}
+
+void jzpfs_dedup_exit_sb(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_dedup_exit_sb");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct jzpfs_chunk_cache *cache = sbi->chunk_cache;
+	struct jzpfs_chunk *chunk, *next;
+
+	dput(sbi->chunk_dir);
+	sbi->chunk_dir = NULL;
+	if (cache) {
+		list_for_each_entry_safe(chunk, next, &cache->lru, lru)
+			jzpfs_chunk_put(chunk);
+		kfree(cache);
+		sbi->chunk_cache = NULL;
+	}
+	if (sbi->chunk_tfm)
+		crypto_free_shash(sbi->chunk_tfm);
+	sbi->chunk_tfm = NULL;
+}
@@ -22,6 +22,19 @@ static int jzpfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 
 	jzpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
+
+	/*
+	 * inode现在会留在缓存里，lower被直接改名/删除/替换后，这里必须让
+	 * 上层dentry失效，否则会继续指向旧的lower inode。
+	 */
+	if (d_unhashed(lower_dentry) ||
+	    d_inode(lower_dentry) != (d_inode(dentry) ?
+		jzpfs_lower_inode(d_inode(dentry)) : NULL)) {
+		jzpfs_stat_inc(dentry->d_sb, JZPFS_STAT_DENTRY_STALE);
+		err = 0;
+		goto out;
+	}
+
 	if (!(lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
 		goto out;
 	err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
@@ -36,6 +49,9 @@ out:
 static void jzpfs_d_release(struct dentry *dentry)
 {	
 	printk(KERN_ALERT "jzpfs_d_release");
+	/* 私有数据还没接上就被放掉的（分配失败、解码失败）什么都没有 */
+	if (!dentry->d_fsdata)
+		return;
 	/* release and reset the lower paths */
 	jzpfs_put_reset_lower_path(dentry);
 	free_dentry_private_data(dentry);
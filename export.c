@@ -0,0 +1,244 @@
+/*
+ * nfs导出操作
+ *
+ * jzpfs的文件句柄就是把lower文件系统的句柄包一层：
+ *
+ *   fh[0]    lower句柄的类型(低8位)和jzpfs句柄版本(8-15位)
+ *   fh[1..]  lower文件系统编码出来的原始句柄
+ *
+ * lower句柄在重新挂载后不变，所以jzpfs句柄也不变。解码时直接交给
+ * lower的exportfs_decode_fh，再经jzpfs_iget得到我们的inode。
+ *
+ * 解码出来的lower文件必须在jzpfs的lower根目录下、不在元数据目录里，
+ * 否则伪造的句柄能打开lower上的任何文件。按挂载方式分两种：
+ *
+ *   - 整个lower文件系统挂在jzpfs下（lower根目录就是lower的根）：lower
+ *     上所有文件都在jzpfs里，只要排除元数据文件，它们带JZPFS_XATTR_META
+ *     标记（见meta.c）。句柄不带父目录，disconnected的普通文件直接接受，
+ *     解码不用读父目录；文件改名、移到别的目录之后句柄照样有效。
+ *   - 挂的是lower的子目录，或者元数据文件没有标记（lower不支持xattr、
+ *     旧版本建的元数据目录）：disconnected的普通文件要靠句柄里的父目录
+ *     接回树上才能检查，所以普通文件的句柄总是带上父目录；和nfs的
+ *     subtree_check一样，文件移到别的目录之后旧句柄会失效。
+ */
+
+#include "jzpfs.h"
+#include <linux/exportfs.h>
+
+#define JZPFS_FH_VERSION	1
+#define JZPFS_FH_HDR_LEN	1	/* in 32-bit words */
+
+static inline u32 jzpfs_fh_hdr(int lower_type)
+{
+	return (lower_type & 0xff) | (JZPFS_FH_VERSION << 8);
+}
+
+static inline int jzpfs_fh_lower_type(const struct fid *fid)
+{
+	return fid->raw[0] & 0xff;
+}
+
+static inline struct fid *jzpfs_fh_lower_fid(struct fid *fid)
+{
+	return (struct fid *)(fid->raw + JZPFS_FH_HDR_LEN);
+}
+
+static bool jzpfs_fh_valid(struct fid *fid, int fh_len, int fh_type)
+{
+	if (fh_type != JZPFS_FILEID && fh_type != JZPFS_FILEID_PARENT)
+		return false;
+	if (fh_len <= JZPFS_FH_HDR_LEN)
+		return false;
+	return ((fid->raw[0] >> 8) & 0xff) == JZPFS_FH_VERSION;
+}
+
+static int jzpfs_encode_fh(struct inode *inode, __u32 *fh, int *max_len,
+			   struct inode *parent)
+{
+	printk(KERN_ALERT "jzpfs_encode_fh");
+	struct inode *lower_inode = jzpfs_lower_inode(inode);
+	struct inode *lower_parent = NULL;
+	struct dentry *alias, *dparent = NULL;
+	int lower_len, lower_type;
+
+	/* 调用者没给父目录的普通文件，用dcache里的父目录，见文件开头 */
+	if (!parent && !S_ISDIR(inode->i_mode) &&
+	    !JZPFS_SB(inode->i_sb)->export_flat) {
+		alias = d_find_alias(inode);
+		if (alias) {
+			dparent = dget_parent(alias);
+			if (dparent != alias)
+				parent = d_inode(dparent);
+			dput(alias);
+		}
+	}
+	if (parent)
+		lower_parent = jzpfs_lower_inode(parent);
+
+	lower_len = *max_len - JZPFS_FH_HDR_LEN;
+	if (lower_len < 0)
+		lower_len = 0;
+	lower_type = exportfs_encode_inode_fh(lower_inode,
+			(struct fid *)(fh + JZPFS_FH_HDR_LEN),
+			&lower_len, lower_parent);
+	dput(dparent);
+	/* 空间不够时lower_len是lower需要的长度，告诉调用者总长度 */
+	*max_len = lower_len + JZPFS_FH_HDR_LEN;
+	if (lower_type < 0 || lower_type >= FILEID_INVALID)
+		return FILEID_INVALID;
+
+	fh[0] = jzpfs_fh_hdr(lower_type);
+	return parent ? JZPFS_FILEID_PARENT : JZPFS_FILEID;
+}
+
+/*
+ * 为lower dentry找到（或建立）对应的jzpfs dentry。
+ * 消耗调用者对lower_path的引用。
+ */
+static struct dentry *jzpfs_obtain_alias(struct super_block *sb,
+					 struct path *lower_path)
+{
+	struct inode *inode;
+	struct dentry *dentry;
+	int err;
+
+	if (d_inode(lower_path->dentry)->i_sb != jzpfs_lower_super(sb)) {
+		path_put(lower_path);
+		return ERR_PTR(-EXDEV);
+	}
+
+	inode = jzpfs_iget(sb, d_inode(lower_path->dentry));
+	if (IS_ERR(inode)) {
+		path_put(lower_path);
+		return ERR_CAST(inode);
+	}
+
+	dentry = d_find_any_alias(inode);
+	if (dentry) {
+		iput(inode);
+	} else {
+		dentry = d_obtain_alias(inode);
+		if (IS_ERR(dentry)) {
+			path_put(lower_path);
+			return dentry;
+		}
+	}
+
+	/*
+	 * d_obtain_alias新分配的匿名dentry一放进dcache，并发的解码（上面的
+	 * d_find_any_alias）和lookup（d_splice_alias）就能拿到它，那时可能
+	 * 还没有私有数据。拿到它的每个地方都先接上lower路径再用。
+	 */
+	err = jzpfs_d_attach_lower(dentry, lower_path);
+	if (err) {
+		dput(dentry);
+		return ERR_PTR(err);
+	}
+	return dentry;
+}
+
+/*
+ * 只接受接在jzpfs的lower根目录下、又不在元数据目录里的lower dentry。
+ * disconnected的只在export_flat时接受，不能是元数据文件；否则exportfs
+ * 会用句柄里的父目录把它接回树上再来问。
+ */
+static int jzpfs_acceptable(void *context, struct dentry *lower_dentry)
+{
+	struct super_block *sb = context;
+	struct dentry *meta = JZPFS_SB(sb)->meta_path.dentry;
+	struct path lower_root;
+	int ok;
+
+	if (lower_dentry->d_flags & DCACHE_DISCONNECTED)
+		return JZPFS_SB(sb)->export_flat && !d_is_dir(lower_dentry) &&
+		       !(meta && jzpfs_meta_marked(lower_dentry));
+	jzpfs_get_lower_path(sb->s_root, &lower_root);
+	ok = is_subdir(lower_dentry, lower_root.dentry) &&
+	     !(meta && is_subdir(lower_dentry, meta));
+	jzpfs_put_lower_path(sb->s_root, &lower_root);
+	return ok;
+}
+
+static struct dentry *jzpfs_fh_to_dentry(struct super_block *sb,
+					 struct fid *fid, int fh_len,
+					 int fh_type)
+{
+	printk(KERN_ALERT "jzpfs_fh_to_dentry");
+	struct path lower_root, lower_path;
+	struct dentry *lower_dentry;
+
+	if (!jzpfs_fh_valid(fid, fh_len, fh_type))
+		return NULL;
+
+	jzpfs_get_lower_path(sb->s_root, &lower_root);
+	lower_dentry = exportfs_decode_fh(lower_root.mnt,
+					  jzpfs_fh_lower_fid(fid),
+					  fh_len - JZPFS_FH_HDR_LEN,
+					  jzpfs_fh_lower_type(fid),
+					  jzpfs_acceptable, sb);
+	if (IS_ERR_OR_NULL(lower_dentry)) {
+		jzpfs_put_lower_path(sb->s_root, &lower_root);
+		return ERR_CAST(lower_dentry);
+	}
+
+	lower_path.dentry = lower_dentry;
+	lower_path.mnt = mntget(lower_root.mnt);
+	jzpfs_put_lower_path(sb->s_root, &lower_root);
+
+	return jzpfs_obtain_alias(sb, &lower_path);
+}
+
+static struct dentry *jzpfs_fh_to_parent(struct super_block *sb,
+					 struct fid *fid, int fh_len,
+					 int fh_type)
+{
+	printk(KERN_ALERT "jzpfs_fh_to_parent");
+	struct super_block *lower_sb = jzpfs_lower_super(sb);
+	struct path lower_root, lower_path;
+	struct dentry *lower_dentry;
+
+	if (fh_type != JZPFS_FILEID_PARENT ||
+	    !jzpfs_fh_valid(fid, fh_len, fh_type))
+		return NULL;
+	if (!lower_sb->s_export_op->fh_to_parent)
+		return NULL;
+
+	lower_dentry = lower_sb->s_export_op->fh_to_parent(lower_sb,
+					jzpfs_fh_lower_fid(fid),
+					fh_len - JZPFS_FH_HDR_LEN,
+					jzpfs_fh_lower_type(fid));
+	if (IS_ERR_OR_NULL(lower_dentry))
+		return ERR_CAST(lower_dentry);
+	/* 这里没经过exportfs，自己检查 */
+	if (!jzpfs_acceptable(sb, lower_dentry)) {
+		dput(lower_dentry);
+		return ERR_PTR(-ESTALE);
+	}
+
+	jzpfs_get_lower_path(sb->s_root, &lower_root);
+	lower_path.dentry = lower_dentry;
+	lower_path.mnt = mntget(lower_root.mnt);
+	jzpfs_put_lower_path(sb->s_root, &lower_root);
+
+	return jzpfs_obtain_alias(sb, &lower_path);
+}
+
+static struct dentry *jzpfs_get_parent(struct dentry *child)
+{
+	printk(KERN_ALERT "jzpfs_get_parent");
+	struct path lower_path, lower_parent_path;
+
+	jzpfs_get_lower_path(child, &lower_path);
+	lower_parent_path.dentry = dget_parent(lower_path.dentry);
+	lower_parent_path.mnt = mntget(lower_path.mnt);
+	jzpfs_put_lower_path(child, &lower_path);
+
+	return jzpfs_obtain_alias(child->d_sb, &lower_parent_path);
+}
+
+const struct export_operations jzpfs_export_ops = {
+	.encode_fh	= jzpfs_encode_fh,
+	.fh_to_dentry	= jzpfs_fh_to_dentry,
+	.fh_to_parent	= jzpfs_fh_to_parent,
+	.get_parent	= jzpfs_get_parent,
+};
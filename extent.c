@@ -0,0 +1,370 @@
+/*
+ * 按extent组织的文件
+ *
+ * 压缩（compress.c）和去重（dedup.c）的文件都把逻辑内容切成
+ * JZPFS_EXT_SIZE（64KiB）的extent，lower文件开头是一个4KiB的文件头：
+ *
+ *   魔数、版本、算法、extent大小、逻辑文件大小
+ *
+ * 文件头之后怎么存放每个extent由各自的jzpfs_ext_ops决定。这里是两者
+ * 共用的部分：读写循环（不满一个extent的写做读改写）、截断、文件头的
+ * 创建和识别。inode上的i_size是逻辑大小。
+ */
+
+#include "jzpfs.h"
+#include <linux/vmalloc.h>
+
+#define JZPFS_EXT_VERSION	1
+
+struct jzpfs_ext_hdr {
+	char magic[JZPFS_HDR_SIZE];
+	u8 version;
+	u8 algo;
+	u8 ext_shift;
+	__le16 reserved;
+	__le64 size;		/* logical file size */
+};
+
+/* 按魔数找格式 */
+static const struct jzpfs_ext_ops *jzpfs_ext_formats[] = {
+	&jzpfs_z_ops,
+	&jzpfs_dedup_ops,
+};
+
+/* lower可能是只写打开的（读改写），读用__vfs_read */
+ssize_t jzpfs_ext_pread(struct file *file, void *buf, size_t len, loff_t pos)
+{
+	mm_segment_t old_fs;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = __vfs_read(file, (char __user *)buf, len, &pos);
+	set_fs(old_fs);
+	return ret;
+}
+
+int jzpfs_ext_pwrite(struct file *file, const void *buf, size_t len,
+		     loff_t pos)
+{
+	mm_segment_t old_fs;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = vfs_write(file, (const char __user *)buf, len, &pos);
+	set_fs(old_fs);
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EIO;
+}
+
+/* 一个extent的逻辑数据和ops用的临时数据各需要一块缓冲区 */
+static u8 *jzpfs_ext_alloc(void)
+{
+	u8 *buf;
+
+	buf = kmalloc(2 * JZPFS_EXT_SIZE,
+		      GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY);
+	if (!buf)
+		buf = vmalloc(2 * JZPFS_EXT_SIZE);
+	return buf;
+}
+
+/* 更新文件头里的逻辑大小 */
+static int jzpfs_ext_set_size(struct inode *inode, struct file *lower_file,
+			      loff_t size)
+{
+	__le64 raw = cpu_to_le64(size);
+	loff_t off = offsetof(struct jzpfs_ext_hdr, size);
+	int err;
+
+	err = jzpfs_ext_pwrite(lower_file, &raw, sizeof(raw), off);
+	if (!err && jzpfs_inode_csum(inode))
+		jzpfs_csum_written(inode, lower_file, off, off + sizeof(raw));
+	return err;
+}
+
+ssize_t jzpfs_ext_read(struct file *file, struct iov_iter *iter, loff_t *ppos)
+{
+	struct inode *inode = file_inode(file);
+	const struct jzpfs_ext_ops *ops = jzpfs_inode_ext_ops(inode);
+	struct file *lower_file = jzpfs_lower_file(file);
+	loff_t pos = *ppos, size;
+	ssize_t done = 0;
+	size_t off, n;
+	u8 *buf;
+	int err = 0;
+
+	buf = jzpfs_ext_alloc();
+	if (!buf)
+		return -ENOMEM;
+
+	inode_lock_shared(inode);
+	size = i_size_read(inode);
+	while (iov_iter_count(iter) && pos < size) {
+		off = pos & (JZPFS_EXT_SIZE - 1);
+		n = min_t(loff_t, JZPFS_EXT_SIZE - off, size - pos);
+		n = min_t(size_t, n, iov_iter_count(iter));
+		err = ops->read_extent(inode, lower_file,
+				       pos >> JZPFS_EXT_SHIFT, buf,
+				       buf + JZPFS_EXT_SIZE);
+		if (err)
+			break;
+		if (copy_to_iter(buf + off, n, iter) != n) {
+			err = -EFAULT;
+			break;
+		}
+		pos += n;
+		done += n;
+	}
+	inode_unlock_shared(inode);
+	kvfree(buf);
+
+	jzpfs_stat_add(inode->i_sb, JZPFS_STAT_EXT_READ, done);
+	if (!done)
+		return err;
+	*ppos = pos;
+	return done;
+}
+
+ssize_t jzpfs_ext_write(struct file *file, struct iov_iter *iter, loff_t *ppos)
+{
+	struct inode *inode = file_inode(file);
+	const struct jzpfs_ext_ops *ops = jzpfs_inode_ext_ops(inode);
+	struct file *lower_file = jzpfs_lower_file(file);
+	loff_t pos, size, start;
+	ssize_t done = 0;
+	size_t off, n;
+	u8 *buf;
+	int err = 0;
+
+	buf = jzpfs_ext_alloc();
+	if (!buf)
+		return -ENOMEM;
+
+	inode_lock(inode);
+	size = i_size_read(inode);
+	pos = (file->f_flags & O_APPEND) ? size : *ppos;
+	while (iov_iter_count(iter)) {
+		off = pos & (JZPFS_EXT_SIZE - 1);
+		start = pos - off;
+		n = min_t(size_t, JZPFS_EXT_SIZE - off, iov_iter_count(iter));
+
+		/* 整个extent都被覆盖时不用读旧数据 */
+		if (start < size && n < JZPFS_EXT_SIZE)
+			err = ops->read_extent(inode, lower_file,
+					       pos >> JZPFS_EXT_SHIFT,
+					       buf, buf + JZPFS_EXT_SIZE);
+		else
+			memset(buf, 0, JZPFS_EXT_SIZE);
+		if (err)
+			break;
+
+		n = copy_from_iter(buf + off, n, iter);
+		if (!n) {
+			err = -EFAULT;
+			break;
+		}
+		err = ops->write_extent(inode, lower_file,
+				pos >> JZPFS_EXT_SHIFT, buf,
+				min_t(loff_t, JZPFS_EXT_SIZE,
+				      max_t(loff_t, size, pos + n) - start),
+				buf + JZPFS_EXT_SIZE);
+		if (err)
+			break;
+		pos += n;
+		done += n;
+		size = max_t(loff_t, size, pos);
+	}
+
+	if (size != i_size_read(inode)) {
+		if (!jzpfs_ext_set_size(inode, lower_file, size))
+			i_size_write(inode, size);
+	}
+	inode_unlock(inode);
+	kvfree(buf);
+
+	jzpfs_stat_add(inode->i_sb, JZPFS_STAT_EXT_WRITE, done);
+	if (!done)
+		return err;
+	*ppos = pos;
+	return done;
+}
+
+/*
+ * 截断到size后lower文件应有的大小
+ */
+loff_t jzpfs_ext_lower_size(struct inode *inode, loff_t size)
+{
+	return jzpfs_inode_ext_ops(inode)->lower_size(
+			DIV_ROUND_UP(size, JZPFS_EXT_SIZE));
+}
+
+/*
+ * setattr已经把lower截到jzpfs_ext_lower_size(newsize)，这里重写被截断的
+ * 最后一个extent，让ops清掉后面还留在lower上的记录，最后更新逻辑大小。
+ * 调用者持有inode锁。
+ */
+int jzpfs_ext_truncate(struct inode *inode, struct file *lower_file,
+		       loff_t oldsize, loff_t newsize)
+{
+	const struct jzpfs_ext_ops *ops = jzpfs_inode_ext_ops(inode);
+	u64 ext = newsize >> JZPFS_EXT_SHIFT;
+	size_t off = newsize & (JZPFS_EXT_SIZE - 1);
+	u8 *buf;
+	int err = 0;
+
+	if (newsize < oldsize) {
+		buf = jzpfs_ext_alloc();
+		if (!buf)
+			return -ENOMEM;
+		if (off) {
+			err = ops->read_extent(inode, lower_file, ext, buf,
+					       buf + JZPFS_EXT_SIZE);
+			if (!err)
+				err = ops->write_extent(inode, lower_file,
+						ext, buf, off,
+						buf + JZPFS_EXT_SIZE);
+			ext++;
+		}
+		if (!err && ops->drop_extents)
+			err = ops->drop_extents(inode, lower_file, ext, buf);
+		kvfree(buf);
+		if (err)
+			return err;
+	}
+
+	err = jzpfs_ext_set_size(inode, lower_file, newsize);
+	if (!err && jzpfs_inode_csum(inode))
+		err = jzpfs_csum_truncate(inode, lower_file,
+					  i_size_read(file_inode(lower_file)));
+	return err;
+}
+
+/*
+ * 读文件头，认出extent文件后把逻辑大小设到inode上
+ */
+static int jzpfs_ext_load(struct inode *inode, struct file *lower_file)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	const struct jzpfs_ext_ops *ops = NULL;
+	struct jzpfs_ext_hdr hdr;
+	ssize_t ret;
+	int i;
+
+	ret = jzpfs_ext_pread(lower_file, &hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(hdr))
+		return 0;
+	for (i = 0; i < ARRAY_SIZE(jzpfs_ext_formats); i++)
+		if (!memcmp(hdr.magic, jzpfs_ext_formats[i]->magic,
+			    JZPFS_HDR_SIZE))
+			ops = jzpfs_ext_formats[i];
+	if (!ops)
+		return 0;
+
+	if (hdr.version != JZPFS_EXT_VERSION ||
+	    hdr.ext_shift != JZPFS_EXT_SHIFT ||
+	    !ops->algo_ok(inode->i_sb, hdr.algo)) {
+		printk_ratelimited(KERN_ERR
+		       "jzpfs: ino %lu: unsupported %s file "
+		       "(version %u, algo %u, extent shift %u)\n",
+		       inode->i_ino, ops->name, hdr.version, hdr.algo,
+		       hdr.ext_shift);
+		return -EOPNOTSUPP;
+	}
+	info->ext_algo = hdr.algo;
+	i_size_write(inode, le64_to_cpu(hdr.size));
+	smp_store_release(&info->ext_ops, ops);
+	return 0;
+}
+
+/*
+ * 打开时调用：认出已有的extent文件。不是的话什么也不做。
+ */
+int jzpfs_ext_setup(struct inode *inode, struct file *lower_file)
+{
+	int err = 0;
+
+	inode_lock(inode);
+	if (!jzpfs_inode_ext_ops(inode))
+		err = jzpfs_ext_load(inode, lower_file);
+	if (!err)
+		set_bit(JZPFS_INODE_PROBED, &JZPFS_I(inode)->flags);
+	inode_unlock(inode);
+	return err;
+}
+
+/* 魔数是不是某种extent文件 */
+bool jzpfs_ext_magic(const char *magic)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(jzpfs_ext_formats); i++)
+		if (!memcmp(magic, jzpfs_ext_formats[i]->magic,
+			    JZPFS_HDR_SIZE))
+			return true;
+	return false;
+}
+
+/*
+ * 新建的空文件写入ops格式的文件头
+ */
+int jzpfs_ext_create(struct inode *inode, struct file *lower_file,
+		     const struct jzpfs_ext_ops *ops, u8 algo)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct jzpfs_ext_hdr *hdr;
+	int err;
+
+	hdr = kzalloc(JZPFS_EXT_HDR_SIZE, GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+	memcpy(hdr->magic, ops->magic, JZPFS_HDR_SIZE);
+	hdr->version = JZPFS_EXT_VERSION;
+	hdr->algo = algo;
+	hdr->ext_shift = JZPFS_EXT_SHIFT;
+
+	inode_lock(inode);
+	err = jzpfs_ext_pwrite(lower_file, hdr, JZPFS_EXT_HDR_SIZE, 0);
+	if (!err) {
+		info->ext_algo = algo;
+		i_size_write(inode, 0);
+		smp_store_release(&info->ext_ops, ops);
+		set_bit(JZPFS_INODE_PROBED, &info->flags);
+		if (jzpfs_inode_csum(inode))
+			jzpfs_csum_written(inode, lower_file, 0,
+					   JZPFS_EXT_HDR_SIZE);
+	}
+	inode_unlock(inode);
+	kfree(hdr);
+	return err;
+}
+
+/*
+ * stat一个还没打开过的文件时看一眼文件头，让st_size是逻辑大小
+ */
+void jzpfs_ext_probe(struct inode *inode, struct path *lower_path)
+{
+	const struct cred *old_cred;
+	struct file *lower_file;
+
+	if (!S_ISREG(inode->i_mode) ||
+	    test_bit(JZPFS_INODE_PROBED, &JZPFS_I(inode)->flags))
+		return;
+	if (i_size_read(d_inode(lower_path->dentry)) < JZPFS_EXT_HDR_SIZE) {
+		set_bit(JZPFS_INODE_PROBED, &JZPFS_I(inode)->flags);
+		return;
+	}
+
+	old_cred = override_creds(JZPFS_SB(inode->i_sb)->mounter_cred);
+	lower_file = dentry_open(lower_path, O_RDONLY | O_LARGEFILE,
+				 current_cred());
+	revert_creds(old_cred);
+	if (IS_ERR(lower_file))
+		return;
+	jzpfs_ext_setup(inode, lower_file);
+	fput(lower_file);
+}
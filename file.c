@@ -4,39 +4,407 @@
 
 #include "jzpfs.h"
 
+/* 影响lower上I/O的打开标志，这些相同的open才共享lower文件 */
+#define JZPFS_LOWER_SHARE_FLAGS	(O_ACCMODE | O_APPEND | O_DIRECT | O_DSYNC | \
+				 __O_SYNC | O_NONBLOCK | O_NOATIME | \
+				 O_LARGEFILE)
+
+/*
+ * 两个cred对lower来说是不是同一个身份。fork出来的进程cred内容相同但
+ * 不是同一个对象，所以比较内容。
+ */
+static bool jzpfs_cred_same(const struct cred *a, const struct cred *b)
+{
+	if (a == b)
+		return true;
+	return uid_eq(a->fsuid, b->fsuid) && gid_eq(a->fsgid, b->fsgid) &&
+	       a->group_info == b->group_info && a->user_ns == b->user_ns &&
+	       cap_issubset(a->cap_effective, b->cap_effective) &&
+	       cap_issubset(b->cap_effective, a->cap_effective);
+}
+
+/*
+ * 打开lower文件用的标志。上层以noatime挂载时lower也不更新atime：
+ * atime由lower维护，上层在getattr时才拷过来。
+ */
+static unsigned int jzpfs_lower_flags(struct file *file)
+{
+	unsigned int flags = file->f_flags & ~(O_CREAT | O_EXCL | O_TRUNC |
+					       O_NOCTTY | __O_TMPFILE);
+
+	if (file->f_path.mnt->mnt_flags & MNT_NOATIME)
+		flags |= O_NOATIME;
+	return flags;
+}
+
+/*
+ * 取得普通文件的lower文件。同一个inode上打开标志和cred都相同的open
+ * 共享一个lower文件（带引用计数，挂在inode上），几千个进程打开同一个
+ * 文件时lower只打开一次。读写都显式传位置，lower文件自己的f_pos不用，
+ * 每个上层文件的位置互不影响。
+ */
+static struct jzpfs_lower_ref *jzpfs_lower_get(struct file *file)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(file_inode(file));
+	unsigned int open_flags = jzpfs_lower_flags(file);
+	unsigned int flags = open_flags & JZPFS_LOWER_SHARE_FLAGS;
+	struct jzpfs_lower_ref *ref;
+	struct file *lower_file;
+	struct path lower_path;
+
+	/* 一次只有一个open去打开lower，并发的open等它然后共享 */
+	mutex_lock(&info->lower_mutex);
+	list_for_each_entry(ref, &info->lower_files, list) {
+		if (ref->flags == flags &&
+		    jzpfs_cred_same(ref->file->f_cred, file->f_cred)) {
+			ref->count++;
+			mutex_unlock(&info->lower_mutex);
+			jzpfs_stat_inc(file_inode(file)->i_sb,
+				       JZPFS_STAT_OPEN_LOWER_SHARED);
+			return ref;
+		}
+	}
+
+	ref = kmalloc(sizeof(*ref), GFP_KERNEL);
+	if (!ref) {
+		mutex_unlock(&info->lower_mutex);
+		return ERR_PTR(-ENOMEM);
+	}
+	jzpfs_get_lower_path(file->f_path.dentry, &lower_path);
+	lower_file = dentry_open(&lower_path, open_flags, file->f_cred);
+	path_put(&lower_path);
+	if (IS_ERR(lower_file)) {
+		mutex_unlock(&info->lower_mutex);
+		kfree(ref);
+		return ERR_CAST(lower_file);
+	}
+	ref->file = lower_file;
+	ref->flags = flags;
+	ref->count = 1;
+	list_add(&ref->list, &info->lower_files);
+	mutex_unlock(&info->lower_mutex);
+	return ref;
+}
+
+static void jzpfs_lower_put(struct inode *inode, struct jzpfs_lower_ref *ref)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	bool last;
+
+	mutex_lock(&info->lower_mutex);
+	last = !--ref->count;
+	if (last)
+		list_del(&ref->list);
+	mutex_unlock(&info->lower_mutex);
+	if (last) {
+		fput(ref->file);
+		kfree(ref);
+	}
+}
+
+/* 关闭时放掉上层文件持有的lower文件 */
+static void jzpfs_lower_release(struct file *file)
+{
+	struct jzpfs_file_info *fi = JZPFS_F(file);
+
+	if (fi->lower_ref)
+		jzpfs_lower_put(file_inode(file), fi->lower_ref);
+	else if (fi->lower_file)
+		fput(fi->lower_file); /* fput calls dput for lower_dentry */
+	fi->lower_ref = NULL;
+	fi->lower_file = NULL;
+}
+
+/*
+ * 上层文件上的fadvise(SEQUENTIAL/RANDOM/NORMAL)只改了上层的f_ra和
+ * FMODE_RANDOM，真正做预读的是lower，每次取lower文件时带过去。共享
+ * lower文件的几个open以最后一次I/O的为准。
+ */
+static void jzpfs_lower_ra_sync(struct file *file, struct file *lower_file)
+{
+	fmode_t random = file->f_mode & FMODE_RANDOM;
+
+	if (likely(lower_file->f_ra.ra_pages == file->f_ra.ra_pages &&
+		   (lower_file->f_mode & FMODE_RANDOM) == random))
+		return;
+	spin_lock(&lower_file->f_lock);
+	lower_file->f_ra.ra_pages = file->f_ra.ra_pages;
+	lower_file->f_mode = (lower_file->f_mode & ~FMODE_RANDOM) | random;
+	spin_unlock(&lower_file->f_lock);
+}
+
+/*
+ * 取得lower文件，还没打开就现在打开。文件头已经识别过的普通文件，
+ * jzpfs_open不打开lower，推迟到第一次读写、mmap、ioctl或fsync：只open
+ * 之后fstat、fchmod就close的（rsync、tar常这么做）不碰lower。用open时
+ * 的cred打开，和当初在jzpfs_open里打开一样。
+ */
+struct file *jzpfs_open_lower(struct file *file)
+{
+	struct jzpfs_lower_ref *ref;
+	struct file *lower_file;
+
+	lower_file = jzpfs_lower_file(file);
+	if (lower_file) {
+		if (S_ISREG(file_inode(file)->i_mode))
+			jzpfs_lower_ra_sync(file, lower_file);
+		return lower_file;
+	}
+
+	ref = jzpfs_lower_get(file);
+	if (IS_ERR(ref))
+		return ERR_CAST(ref);
+	jzpfs_stat_inc(file_inode(file)->i_sb, JZPFS_STAT_OPEN_LOWER_LAZY);
+
+	/* 同一个file上并发的第一次I/O只留一个 */
+	lower_file = cmpxchg(&JZPFS_F(file)->lower_file, NULL, ref->file);
+	if (lower_file) {
+		jzpfs_lower_put(file_inode(file), ref);
+		return lower_file;
+	}
+	JZPFS_F(file)->lower_ref = ref;
+	jzpfs_lower_ra_sync(file, ref->file);
+	return ref->file;
+}
+
+/* 中转缓冲区，优先一次处理JZPFS_BOUNCE_SIZE，分配不到就用一页 */
+static u8 *jzpfs_alloc_bounce(size_t *size)
+{
+	u8 *buf;
+
+	buf = kmalloc(JZPFS_BOUNCE_SIZE,
+		      GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY);
+	if (buf) {
+		*size = JZPFS_BOUNCE_SIZE;
+		return buf;
+	}
+	*size = PAGE_SIZE;
+	return kmalloc(PAGE_SIZE, GFP_KERNEL);
+}
+
+/*
+ * 经过内核缓冲区的读：变换过的文件要先反变换，打开了校验和的文件要按
+ * 整块读出来先校验，都不能像直接透传那样把lower数据读进用户缓冲区。
+ */
+static ssize_t jzpfs_bounce_read(struct file *file, struct iov_iter *iter,
+				 loff_t *ppos)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = jzpfs_lower_file(file);
+	bool csum = jzpfs_inode_csum(inode);
+	struct jzpfs_range range;
+	loff_t pos = *ppos, start, rpos;
+	size_t size, skip, want, n;
+	ssize_t ret = 0, done = 0;
+	mm_segment_t old_fs;
+	u8 *buf;
+	int err;
+
+	buf = jzpfs_alloc_bounce(&size);
+	if (!buf)
+		return -ENOMEM;
+
+	/* 写数据和更新校验和之间不能让读看到 */
+	if (csum) {
+		inode_lock_shared(inode);
+		jzpfs_range_lock(inode, &range, pos,
+				 pos + iov_iter_count(iter), false);
+	}
+	while (iov_iter_count(iter)) {
+		start = csum ? round_down(pos, JZPFS_CSUM_BLOCK) : pos;
+		skip = pos - start;
+		want = min_t(size_t, iov_iter_count(iter) + skip, size);
+		if (csum)
+			want = min_t(size_t, round_up(want, JZPFS_CSUM_BLOCK),
+				     size);
+		rpos = start;
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = vfs_read(lower_file, (char __user *)buf, want, &rpos);
+		set_fs(old_fs);
+		if (ret <= (ssize_t)skip) {
+			if (ret > 0)
+				ret = 0;
+			break;
+		}
+		if (csum) {
+			err = jzpfs_csum_verify(inode, buf, start, ret);
+			if (err) {
+				ret = err;
+				break;
+			}
+		}
+		n = min_t(size_t, ret - skip, iov_iter_count(iter));
+		err = jzpfs_decode(file, buf + skip, n, pos);
+		if (err) {
+			ret = err;
+			break;
+		}
+		if (copy_to_iter(buf + skip, n, iter) != n) {
+			ret = -EFAULT;
+			break;
+		}
+		pos += n;
+		done += n;
+		if ((size_t)ret < want)
+			break;
+	}
+	if (csum) {
+		jzpfs_range_unlock(inode, &range);
+		inode_unlock_shared(inode);
+	}
+	kfree(buf);
+
+	if (done) {
+		*ppos = pos;
+		ret = done;
+	}
+	return ret;
+}
+
+/*
+ * 把lower文件[from, to)这段空洞填成加密后的0。CTR模式下lower上的空洞
+ * 读出来解密后不是0，所以越过文件尾写和截断扩大文件时都要先填上。
+ */
+int jzpfs_crypt_zero_range(struct inode *inode, struct file *lower_file,
+			   loff_t from, loff_t to)
+{
+	mm_segment_t old_fs;
+	size_t chunk;
+	ssize_t ret;
+	char *page;
+	int err = 0;
+
+	page = (char *)__get_free_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	while (from < to) {
+		chunk = min_t(loff_t, to - from, PAGE_SIZE);
+		memset(page, 0, chunk);
+		err = jzpfs_crypt(inode, page, chunk, from);
+		if (err)
+			break;
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = vfs_write(lower_file, (char __user *)page, chunk, &from);
+		set_fs(old_fs);
+		if (ret != chunk) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+	}
+	free_page((unsigned long)page);
+	return err;
+}
+
+/*
+ * 变换过的文件的写：数据拷进内核页变换后写到lower。写之前锁住写的范围
+ * （见rangelock.c），O_APPEND时先确定写入位置再按位置加密，不重叠的写
+ * 可以同时进行。
+ */
+static ssize_t jzpfs_transform_write(struct file *file, struct iov_iter *iter,
+				 loff_t *ppos)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = jzpfs_lower_file(file);
+	struct inode *lower_inode = file_inode(lower_file);
+	struct jzpfs_range range;
+	mm_segment_t old_fs;
+	ssize_t ret = 0, done = 0;
+	size_t chunk;
+	loff_t pos, start, size;
+	char *page;
+	int err;
+
+	page = (char *)__get_free_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	pos = jzpfs_write_lock(inode, lower_file, &range, *ppos,
+			       iov_iter_count(iter), file->f_flags & O_APPEND);
+	size = i_size_read(lower_inode);
+	start = pos;
+	jzpfs_hdr_written(inode, pos);
+	if (pos > size && jzpfs_inode_encrypted(inode)) {
+		err = jzpfs_crypt_zero_range(inode, lower_file, size, pos);
+		if (err) {
+			ret = err;
+			goto out;
+		}
+	}
+
+	while (iov_iter_count(iter)) {
+		chunk = min_t(size_t, iov_iter_count(iter), PAGE_SIZE);
+		if (copy_from_iter(page, chunk, iter) != chunk) {
+			ret = -EFAULT;
+			break;
+		}
+		err = jzpfs_encode(file, page, chunk, pos);
+		if (err) {
+			ret = err;
+			break;
+		}
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = vfs_write(lower_file, (char __user *)page, chunk, &pos);
+		set_fs(old_fs);
+		if (ret <= 0)
+			break;
+		done += ret;
+		if (ret < chunk)
+			break;
+	}
+	if (done) {
+		*ppos = pos;
+		ret = done;
+		if (jzpfs_inode_csum(inode))
+			jzpfs_csum_written(inode, lower_file,
+					   min(size, start), pos);
+	}
+	if (ret >= 0)
+		jzpfs_sync_size(inode, lower_inode);
+out:
+	jzpfs_write_unlock(inode, &range);
+	free_page((unsigned long)page);
+	return ret;
+}
+
 /*
  *读文件
  */
-static ssize_t jzpfs_read(struct file *file, char __user *buf,
-			   size_t count, loff_t *ppos)
+static ssize_t jzpfs_do_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos)
 {	
 	printk(KERN_ALERT "jzpfs_read");
 	int err;
-	size_t i=0;
 
 	struct file *lower_file;
 	struct dentry *dentry = file->f_path.dentry;
 
-	lower_file = jzpfs_lower_file(file);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	if (jzpfs_inode_ext_ops(d_inode(dentry)) ||
+	    jzpfs_inode_encrypted(d_inode(dentry)) ||
+	    jzpfs_inode_csum(d_inode(dentry)) ||
+	    jzpfs_file_transformed(file)) {
+		struct iovec iov;
+		struct iov_iter iter;
+
+		err = import_single_range(READ, buf, count, &iov, &iter);
+		if (err)
+			return err;
+		if (jzpfs_inode_ext_ops(d_inode(dentry)))
+			return jzpfs_ext_read(file, &iter, ppos);
+		return jzpfs_bounce_read(file, &iter, ppos);
+	}
+
 //	printk(KERN_ALERT "read-f_flags:%d\n", lower_file->f_flags);
 	
 	
 	err = vfs_read(lower_file, buf, count, ppos);
-	
-	//将字母都小写
-	if(lower_file->f_flags == 00000615){
-		printk(KERN_ALERT "解密");
-		while(count != 4096 && i<=count){
-			if(buf[i]>='A' && buf[i]<='Z')
-				buf[i] += 32;
-				i++;
-		}
-	}	
-	
-	/* update our inode atime upon a successful lower read */
-	if (err >= 0)
-		fsstack_copy_attr_atime(d_inode(dentry),
-					file_inode(lower_file));
 
 	return err;
 }
@@ -44,63 +412,130 @@ static ssize_t jzpfs_read(struct file *file, char __user *buf,
 /*
  * 写文件
  */
-static ssize_t jzpfs_write(struct file *file, char __user *buf,
-			    size_t count, loff_t *ppos)
+static ssize_t jzpfs_do_write(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
 {	
 	printk(KERN_ALERT "jzpfs_write");
 	int err;
-	size_t i=0;
+	bool csum;
+	loff_t size = 0;
+	struct jzpfs_range range;
 
 	struct file *lower_file;
 	struct dentry *dentry = file->f_path.dentry;
 
-	lower_file = jzpfs_lower_file(file);
-//	printk(KERN_ALERT "write-f_flags:%d\n", lower_file->f_flags);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 
-	//将字母都大写
-	if(lower_file->f_flags == 00000615){
-		printk(KERN_ALERT "加密");
-		while(count != 4096 && i<=count){
-			if(buf[i]>='a' && buf[i]<='z')
-				buf[i] -= 32;
-				i++;
-		}
+	if (jzpfs_inode_ext_ops(d_inode(dentry)) ||
+	    jzpfs_inode_encrypted(d_inode(dentry)) ||
+	    jzpfs_file_transformed(file)) {
+		struct iovec iov;
+		struct iov_iter iter;
+
+		err = import_single_range(WRITE, buf, count, &iov, &iter);
+		if (err)
+			return err;
+		if (jzpfs_inode_ext_ops(d_inode(dentry)))
+			return jzpfs_ext_write(file, &iter, ppos);
+		return jzpfs_transform_write(file, &iter, ppos);
 	}
-	
+
+//	printk(KERN_ALERT "write-f_flags:%d\n", lower_file->f_flags);
+	jzpfs_hdr_written(d_inode(dentry),
+			  (lower_file->f_flags & O_APPEND) ?
+			  i_size_read(file_inode(lower_file)) : *ppos);
+
 //	printk(KERN_ALERT "0flags:%d\n", file->f_flags);
 //	printk(KERN_ALERT "1buf:%s\n", buf);
 //	printk(KERN_ALERT "2count:%d\n", count);
 //	printk(KERN_ALERT "3ppos:%d\n", *ppos);
 
 	
-	err = vfs_write(lower_file, buf, count, ppos);
-	/* update our inode times+sizes upon a successful lower write */
-	if (err >= 0) {
-		fsstack_copy_inode_size(d_inode(dentry),
-					file_inode(lower_file));
-		fsstack_copy_attr_times(d_inode(dentry),
-					file_inode(lower_file));
+	/* 打开校验和时写数据和更新校验和要一起完成，不能被读插进来 */
+	csum = jzpfs_inode_csum(d_inode(dentry));
+	if (csum) {
+		jzpfs_write_lock(d_inode(dentry), lower_file, &range, *ppos,
+				 count, lower_file->f_flags & O_APPEND);
+		size = i_size_read(file_inode(lower_file));
 	}
+	err = vfs_write(lower_file, buf, count, ppos);
+	if (csum && err > 0)
+		jzpfs_csum_written(d_inode(dentry), lower_file,
+				   min(size, *ppos - err), *ppos);
+	if (csum)
+		jzpfs_write_unlock(d_inode(dentry), &range);
+	/* 时间戳在getattr时才同步，见jzpfs_sync_size */
+	if (err >= 0)
+		jzpfs_sync_size(d_inode(dentry), file_inode(lower_file));
 
 	return err;
 }
 
 /*
  * 读文件目录
+ *
+ * 用iterate_shared：VFS只拿目录i_rwsem的共享锁，同一个目录的readdir
+ * 之间、readdir和lookup之间可以并行。lower的目录文件每个上层文件私有，
+ * 它的位置由上层文件的f_pos_lock保护；lower自己不支持iterate_shared时
+ * iterate_dir会在lower上拿独占锁。
  */
+struct jzpfs_readdir_ctx {
+	struct dir_context ctx;
+	struct dir_context *caller;
+	struct dentry *dentry;
+	bool meta;			/* hide the metadata directory */
+	struct jzpfs_prefetch *pf;	/* names for readdir_prefetch */
+};
+
+/*
+ * 跳过根目录下的元数据目录，其余的交给调用者；打开了readdir_prefetch
+ * 时交出去的名字再排队预取（见prefetch.c）
+ */
+static int jzpfs_filldir(struct dir_context *ctx, const char *name, int len,
+			 loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct jzpfs_readdir_ctx *buf =
+		container_of(ctx, struct jzpfs_readdir_ctx, ctx);
+
+	if (buf->meta && jzpfs_is_meta_name(buf->dentry, name, len))
+		return 0;
+	buf->caller->pos = buf->ctx.pos;
+	if (!dir_emit(buf->caller, name, len, ino, d_type))
+		return 1;
+	if (JZPFS_SB(buf->dentry->d_sb)->prefetch)
+		jzpfs_prefetch_add(&buf->pf, buf->dentry, name, len);
+	return 0;
+}
+
 static int jzpfs_readdir(struct file *file, struct dir_context *ctx)
 {	
 	printk(KERN_ALERT "jzpfs_readdir");
 	int err;
+	bool meta;
 	struct file *lower_file = NULL;
 	struct dentry *dentry = file->f_path.dentry;
 
 	lower_file = jzpfs_lower_file(file);
-	err = iterate_dir(lower_file, ctx);
+	meta = jzpfs_is_meta_name(dentry, JZPFS_META_DIR,
+				  sizeof(JZPFS_META_DIR) - 1);
+	if (meta || JZPFS_SB(dentry->d_sb)->prefetch) {
+		struct jzpfs_readdir_ctx buf = {
+			.ctx.actor = jzpfs_filldir,
+			.ctx.pos = ctx->pos,
+			.caller = ctx,
+			.dentry = dentry,
+			.meta = meta,
+		};
+
+		err = iterate_dir(lower_file, &buf.ctx);
+		ctx->pos = buf.ctx.pos;
+		jzpfs_prefetch_submit(&buf.pf);
+	} else {
+		err = iterate_dir(lower_file, ctx);
+	}
 	file->f_pos = lower_file->f_pos;
-	if (err >= 0)		/* copy the atime */
-		fsstack_copy_attr_atime(d_inode(dentry),
-					file_inode(lower_file));
 	return err;
 }
 
@@ -111,10 +546,12 @@ static long jzpfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 	long err = -ENOTTY;
 	struct file *lower_file;
 
-	lower_file = jzpfs_lower_file(file);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 
 	/* XXX: use vfs_ioctl if/when VFS exports it */
-	if (!lower_file || !lower_file->f_op)
+	if (!lower_file->f_op)
 		goto out;
 	if (lower_file->f_op->unlocked_ioctl)
 		err = lower_file->f_op->unlocked_ioctl(lower_file, cmd, arg);
@@ -135,10 +572,12 @@ static long jzpfs_compat_ioctl(struct file *file, unsigned int cmd,
 	long err = -ENOTTY;
 	struct file *lower_file;
 
-	lower_file = jzpfs_lower_file(file);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 
 	/* XXX: use vfs_ioctl if/when VFS exports it */
-	if (!lower_file || !lower_file->f_op)
+	if (!lower_file->f_op)
 		goto out;
 	if (lower_file->f_op->compat_ioctl)
 		err = lower_file->f_op->compat_ioctl(lower_file, cmd, arg);
@@ -159,13 +598,24 @@ static int jzpfs_mmap(struct file *file, struct vm_area_struct *vma)
 	struct file *lower_file;
 	const struct vm_operations_struct *saved_vm_ops = NULL;
 
+	/* lower的页缓存里是密文或压缩、去重后的数据，不能直接映射给用户 */
+	if (jzpfs_inode_encrypted(file_inode(file)) ||
+	    jzpfs_inode_ext_ops(file_inode(file))) {
+		err = -ENODEV;
+		goto out;
+	}
+
 	/* 这可能推迟到mmap的写页面 */
 	willwrite = ((vma->vm_flags | VM_SHARED | VM_WRITE) == vma->vm_flags);
 
 	/*
 	 * F检查较低文件系统是否支持 - > writepage
 	 */
-	lower_file = jzpfs_lower_file(file);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
 	if (willwrite && !lower_file->f_mapping->a_ops->writepage) {
 		err = -EINVAL;
 		printk(KERN_ERR "jzpfs: lower file system does not "
@@ -173,6 +623,16 @@ static int jzpfs_mmap(struct file *file, struct vm_area_struct *vma)
 		goto out;
 	}
 
+	/* 通过共享映射的修改不经过jzpfs，文件头可能被改掉 */
+	if (willwrite)
+		jzpfs_hdr_written(file_inode(file), 0);
+	/* 也没法维护校验和 */
+	if (willwrite && jzpfs_inode_csum(file_inode(file))) {
+		err = jzpfs_csum_invalidate(file_inode(file));
+		if (err)
+			goto out;
+	}
+
 	
 	if (!JZPFS_F(file)->lower_vm_ops) {
 		err = lower_file->f_op->mmap(lower_file, vma);
@@ -195,21 +655,39 @@ out:
 	return err;
 }
 
+/* 可能是刚建出来的文件：O_CREAT，或者O_TMPFILE建的匿名文件 */
+static inline bool jzpfs_open_creating(struct file *file)
+{
+	return file->f_flags & (O_CREAT | __O_TMPFILE);
+}
+
+/*
+ * open时能不能不打开lower：文件头识别过（格式记在inode上），也不是要写
+ * 文件头的新文件。目录总是马上打开。
+ */
+static bool jzpfs_open_deferrable(struct inode *inode, struct file *file)
+{
+	if (!S_ISREG(inode->i_mode) ||
+	    !test_bit(JZPFS_INODE_HDR_KNOWN, &JZPFS_I(inode)->flags))
+		return false;
+	return !(jzpfs_open_creating(file) &&
+		 i_size_read(jzpfs_lower_inode(inode)) == 0);
+}
+
 /*
  * 打开一个文件
  */
 static int jzpfs_open(struct inode *inode, struct file *file) //163842
 {	
 	printk(KERN_ALERT "jzpfs_open");
-	int err = 0, errr=0;
-	char buff[3];
-	char buf[3]={'J','F','S'};
-	loff_t pos;
+	int err = 0;
+	ssize_t errr;
+	u8 buff[JZPFS_HDR_SIZE];
 	struct file *lower_file = NULL;
 	struct path lower_path;
 
-	/* don't open unhashed/deleted files */
-	if (d_unhashed(file->f_path.dentry)) {
+	/* don't open unhashed/deleted files (O_TMPFILE ones never are hashed) */
+	if (d_unhashed(file->f_path.dentry) && !(file->f_flags & __O_TMPFILE)) {
 		err = -ENOENT;
 		goto out_err;
 	}
@@ -221,7 +699,37 @@ static int jzpfs_open(struct inode *inode, struct file *file) //163842
 		goto out_err;
 	}	
 
+	if (jzpfs_open_deferrable(inode, file)) {
+		fsstack_copy_attr_all(inode, jzpfs_lower_inode(inode));
+		if (test_bit(JZPFS_INODE_LEGACY, &JZPFS_I(inode)->flags)) {
+			file->f_pos = JZPFS_HDR_SIZE;
+			/* 没有主密钥的加密文件还是在open时报错 */
+			jzpfs_get_lower_path(file->f_path.dentry, &lower_path);
+			err = jzpfs_crypto_setup(inode, lower_path.dentry);
+			path_put(&lower_path);
+			if (err) {
+				kfree(JZPFS_F(file));
+				goto out_err;
+			}
+		}
+		jzpfs_stat_inc(inode->i_sb, JZPFS_STAT_OPEN_DEFERRED);
+		goto out_err;
+	}
+
 	/* open lower object and link jzpfs's file struct to lower's */
+	if (S_ISREG(inode->i_mode)) {
+		/* 普通文件共享lower文件，见jzpfs_lower_get */
+		struct jzpfs_lower_ref *ref = jzpfs_lower_get(file);
+
+		if (IS_ERR(ref)) {
+			err = PTR_ERR(ref);
+		} else {
+			JZPFS_F(file)->lower_ref = ref;
+			lower_file = ref->file;
+			jzpfs_set_lower_file(file, lower_file);
+		}
+		goto opened;
+	}
 	jzpfs_get_lower_path(file->f_path.dentry, &lower_path);
 	lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
 	path_put(&lower_path);
@@ -235,11 +743,17 @@ static int jzpfs_open(struct inode *inode, struct file *file) //163842
 	} else {
 		jzpfs_set_lower_file(file, lower_file);
 	}
+opened:
 
-	if (err)
+	if (err) {
 		kfree(JZPFS_F(file));
-	else
-		fsstack_copy_attr_all(inode, jzpfs_lower_inode(inode));
+		goto out_err;
+	}
+	fsstack_copy_attr_all(inode, jzpfs_lower_inode(inode));
+
+	/* 只有普通文件有文件头 */
+	if (!S_ISREG(inode->i_mode))
+		goto out_err;
 	
 /*	if(lower_file->f_pos == 0){
 		printk(KERN_ALERT "open-f_pos1:%lld\n", lower_file->f_pos);
@@ -263,45 +777,63 @@ static int jzpfs_open(struct inode *inode, struct file *file) //163842
 		}
 	}
 */		
-	if(file->f_flags & O_CREAT){
-//		printk(KERN_ALERT "open-f_flags:%d\n", file->f_flags);
-//		printk(KERN_ALERT "open-o_creat:%s\n", O_CREAT);
-//		printk(KERN_ALERT "create--------");
-		pos = lower_file->f_pos;
-		mm_segment_t old_fs;
-		old_fs = get_fs();
-		set_fs(KERNEL_DS);
-		printk(KERN_ALERT "open-f_pos1:%lld\n", pos);
-		errr = vfs_write(lower_file, buf, 3, &pos);
-		printk(KERN_ALERT "open-f_pos2:%lld\n", pos);
-		set_fs(old_fs);
-		lower_file->f_pos = pos;
-		file->f_pos = pos;
-		printk(KERN_ALERT "open-errr:%d\n", errr);
-		if (errr >= 0)
-		fsstack_copy_attr_atime(d_inode(lower_file->f_path.dentry),
-					file_inode(lower_file));
-		lower_file->f_flags = 00000615;
-//		printk(KERN_ALERT "open-f_flags:%d\n", file->f_flags);			
-		goto out_err;
+	/* 只给空文件写文件头，已有文件带O_CREAT打开（如>>）走下面的识别 */
+	/* compress、dedup挂载下新建的文件写extent文件头，不用旧的变换 */
+	if (jzpfs_open_creating(file) &&
+	    (JZPFS_SB(inode->i_sb)->compress || JZPFS_SB(inode->i_sb)->dedup) &&
+	    (lower_file->f_mode & FMODE_WRITE) &&
+	    i_size_read(file_inode(lower_file)) == 0) {
+		if (JZPFS_SB(inode->i_sb)->dedup)
+			err = jzpfs_dedup_create(inode, lower_file);
+		else
+			err = jzpfs_ext_create(inode, lower_file, &jzpfs_z_ops,
+					       JZPFS_SB(inode->i_sb)->compress);
+		if (!err)
+			set_bit(JZPFS_INODE_HDR_KNOWN, &JZPFS_I(inode)->flags);
+		goto out_fput;
+	}
+
+	if(jzpfs_open_creating(file) &&
+	   i_size_read(file_inode(lower_file)) == 0){
+		errr = jzpfs_hdr_write(lower_file);
+		file->f_pos = errr > 0 ? errr : 0;
+		if (errr == JZPFS_HDR_SIZE)
+			set_bit(JZPFS_INODE_LEGACY, &JZPFS_I(inode)->flags);
+		/* 新建的文件在挂载了主密钥时成为加密文件 */
+		err = jzpfs_crypto_create(inode, lower_file->f_path.dentry);
+		if (!err && errr > 0 && jzpfs_inode_csum(inode))
+			jzpfs_csum_written(inode, lower_file, 0, errr);
+		if (!err && errr == JZPFS_HDR_SIZE)
+			set_bit(JZPFS_INODE_HDR_KNOWN, &JZPFS_I(inode)->flags);
+		goto out_fput;
 	}	
 
-	mm_segment_t old_fs;
-	old_fs = get_fs();
-	errr = vfs_read(lower_file, buff, 3, 0);
-	set_fs(old_fs);
-	if (errr >= 0)
-		fsstack_copy_attr_atime(d_inode(lower_file->f_path.dentry),
-					file_inode(lower_file));
-
-	if(buff[3]=='J' && buff[4]=='F' && buff[5]=='S'){
-		lower_file->f_flags = 00000615;
-		file->f_pos=3;
-//		printk(KERN_ALERT "buf open-f_flags:%d\n", file->f_flags);		
+	errr = jzpfs_hdr_read(lower_file, buff);
+	switch (jzpfs_hdr_type(buff, errr)) {
+	case JZPFS_HDR_LEGACY:
+		set_bit(JZPFS_INODE_LEGACY, &JZPFS_I(inode)->flags);
+		file->f_pos = JZPFS_HDR_SIZE;
+		err = jzpfs_crypto_setup(inode, lower_file->f_path.dentry);
+		break;
+	case JZPFS_HDR_EXTENT:
+		err = jzpfs_ext_setup(inode, lower_file);
+		break;
+	default:
+		clear_bit(JZPFS_INODE_LEGACY, &JZPFS_I(inode)->flags);
+		set_bit(JZPFS_INODE_PROBED, &JZPFS_I(inode)->flags);
+		break;
+	}
+	if (!err && errr >= 0)
+		set_bit(JZPFS_INODE_HDR_KNOWN, &JZPFS_I(inode)->flags);
+
+out_fput:
+	if (err) {
+		jzpfs_lower_release(file);
+		kfree(JZPFS_F(file));
 	}
-	
-	
 out_err:
+	if (!err && S_ISREG(inode->i_mode))
+		jzpfs_trace(inode, JZPFS_TR_OPEN, 0, 0, file->f_flags);
 	return err;
 }
 
@@ -324,14 +856,10 @@ static int jzpfs_flush(struct file *file, fl_owner_t id)
 static int jzpfs_file_release(struct inode *inode, struct file *file)
 {
 	printk(KERN_ALERT "jzpfs_file_release");
-	struct file *lower_file;
-
-	lower_file = jzpfs_lower_file(file);
-	if (lower_file) {
-		jzpfs_set_lower_file(file, NULL);
-		fput(lower_file);
-	}
 
+	if (S_ISREG(inode->i_mode))
+		jzpfs_trace(inode, JZPFS_TR_RELEASE, 0, 0, 0);
+	jzpfs_lower_release(file);
 	kfree(JZPFS_F(file));
 	return 0;
 }
@@ -348,12 +876,26 @@ static int jzpfs_fsync(struct file *file, loff_t start, loff_t end,
 	struct path lower_path;
 	struct dentry *dentry = file->f_path.dentry;
 
+	jzpfs_trace(file_inode(file), JZPFS_TR_FSYNC, start,
+		    (u64)end - start + 1, datasync);
+	jzpfs_qos_throttle(file_inode(file)->i_sb, 0);
+	err = jzpfs_inject(JZPFS_INJECT_FSYNC);
+	if (err)
+		goto out;
 	err = __generic_file_fsync(file, start, end, datasync);
 	if (err)
 		goto out;
-	lower_file = jzpfs_lower_file(file);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
 	jzpfs_get_lower_path(dentry, &lower_path);
-	err = vfs_fsync_range(lower_file, start, end, datasync);
+	if (JZPFS_SB(file_inode(file)->i_sb)->group_commit)
+		err = jzpfs_commit_fsync(lower_file, file_inode(file)->i_sb,
+					 start, end);
+	else
+		err = vfs_fsync_range(lower_file, start, end, datasync);
 	jzpfs_put_lower_path(dentry, &lower_path);
 out:
 	return err;
@@ -365,7 +907,9 @@ static int jzpfs_fasync(int fd, struct file *file, int flag)
 	int err = 0;
 	struct file *lower_file = NULL;
 
-	lower_file = jzpfs_lower_file(file);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 	if (lower_file->f_op && lower_file->f_op->fasync)
 		err = lower_file->f_op->fasync(fd, lower_file, flag);
 
@@ -395,13 +939,23 @@ out:
 /*
  * jzpfs read_iter, redirect modified iocb to lower read_iter
  */
-ssize_t jzpfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+static ssize_t jzpfs_do_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
 	printk(KERN_ALERT "jzpfs_read_iter");
 	int err;
 	struct file *file = iocb->ki_filp, *lower_file;
 
-	lower_file = jzpfs_lower_file(file);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	if (jzpfs_inode_ext_ops(file_inode(file)))
+		return jzpfs_ext_read(file, iter, &iocb->ki_pos);
+	if (jzpfs_inode_encrypted(file_inode(file)) ||
+	    jzpfs_inode_csum(file_inode(file)) ||
+	    jzpfs_file_transformed(file))
+		return jzpfs_bounce_read(file, iter, &iocb->ki_pos);
+
 	if (!lower_file->f_op->read_iter) {
 		err = -EINVAL;
 		goto out;
@@ -412,10 +966,6 @@ ssize_t jzpfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 	err = lower_file->f_op->read_iter(iocb, iter);
 	iocb->ki_filp = file;
 	fput(lower_file);
-	/* update upper inode atime as needed */
-	if (err >= 0 || err == -EIOCBQUEUED)
-		fsstack_copy_attr_atime(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
 out:
 	return err;
 }
@@ -423,34 +973,133 @@ out:
 /*
  * jzpfs write_iter, redirect modified iocb to lower write_iter
  */
-ssize_t jzpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
+static ssize_t jzpfs_do_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 {	
 	printk(KERN_ALERT "jzpfs_write_iter");
 	int err;
 	struct file *file = iocb->ki_filp, *lower_file;
+	struct inode *inode = file_inode(file);
+	struct jzpfs_range range;
+	loff_t size = 0;
+	bool csum;
 
-	lower_file = jzpfs_lower_file(file);
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	if (jzpfs_inode_ext_ops(inode))
+		return jzpfs_ext_write(file, iter, &iocb->ki_pos);
+	if (jzpfs_inode_encrypted(inode) || jzpfs_file_transformed(file))
+		return jzpfs_transform_write(file, iter, &iocb->ki_pos);
+
+	jzpfs_hdr_written(inode, (iocb->ki_flags & IOCB_APPEND) ?
+			  i_size_read(file_inode(lower_file)) : iocb->ki_pos);
 	if (!lower_file->f_op->write_iter) {
 		err = -EINVAL;
 		goto out;
 	}
 
+	csum = jzpfs_inode_csum(inode);
+	if (csum) {
+		jzpfs_write_lock(inode, lower_file, &range, iocb->ki_pos,
+				 iov_iter_count(iter),
+				 iocb->ki_flags & IOCB_APPEND);
+		size = i_size_read(file_inode(lower_file));
+	}
 	get_file(lower_file); /* prevent lower_file from being released */
 	iocb->ki_filp = lower_file;
 	err = lower_file->f_op->write_iter(iocb, iter);
 	iocb->ki_filp = file;
+	/* 异步写还没完成，没法重算，只能丢掉校验和 */
+	if (csum && err == -EIOCBQUEUED)
+		jzpfs_csum_invalidate(inode);
+	else if (csum && err > 0)
+		jzpfs_csum_written(inode, lower_file,
+				   min(size, iocb->ki_pos - err), iocb->ki_pos);
+	if (csum)
+		jzpfs_write_unlock(inode, &range);
 	fput(lower_file);
-	/* update upper inode times/sizes as needed */
-	if (err >= 0 || err == -EIOCBQUEUED) {
-		fsstack_copy_inode_size(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
-		fsstack_copy_attr_times(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
-	}
+	if (err >= 0 || err == -EIOCBQUEUED)
+		jzpfs_sync_size(inode, file_inode(lower_file));
 out:
 	return err;
 }
 
+/*
+ * 读写之前记跟踪（见trace.c）、按uid限速（见qos.c）、做故障注入（见
+ * inject.c），成功后记到inode的访问热度上（见heat.c）
+ */
+static ssize_t jzpfs_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	jzpfs_trace(file_inode(file), JZPFS_TR_READ, *ppos, count,
+		    file->f_flags);
+	jzpfs_qos_throttle(file_inode(file)->i_sb, count);
+	ret = jzpfs_inject(JZPFS_INJECT_READ);
+	if (!ret)
+		ret = jzpfs_do_read(file, buf, count, ppos);
+
+	if (ret > 0)
+		jzpfs_heat_add(file_inode(file), false, ret);
+	return ret;
+}
+
+static ssize_t jzpfs_write(struct file *file, char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	jzpfs_trace(file_inode(file), JZPFS_TR_WRITE, *ppos, count,
+		    file->f_flags);
+	jzpfs_qos_throttle(file_inode(file)->i_sb, count);
+	ret = jzpfs_inject(JZPFS_INJECT_WRITE);
+	if (!ret)
+		ret = jzpfs_do_write(file, buf, count, ppos);
+
+	if (ret > 0)
+		jzpfs_heat_add(file_inode(file), true, ret);
+	return ret;
+}
+
+ssize_t jzpfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	size_t count = iov_iter_count(iter);
+	ssize_t ret;
+
+	jzpfs_trace(file_inode(iocb->ki_filp), JZPFS_TR_READ, iocb->ki_pos,
+		    count, iocb->ki_filp->f_flags);
+	jzpfs_qos_throttle(file_inode(iocb->ki_filp)->i_sb, count);
+	ret = jzpfs_inject(JZPFS_INJECT_READ);
+	if (!ret)
+		ret = jzpfs_do_read_iter(iocb, iter);
+
+	/* 异步的还没完成，按请求的长度算 */
+	if (ret > 0 || ret == -EIOCBQUEUED)
+		jzpfs_heat_add(file_inode(iocb->ki_filp), false,
+			       ret > 0 ? ret : count);
+	return ret;
+}
+
+ssize_t jzpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	size_t count = iov_iter_count(iter);
+	ssize_t ret;
+
+	jzpfs_trace(file_inode(iocb->ki_filp), JZPFS_TR_WRITE, iocb->ki_pos,
+		    count, iocb->ki_filp->f_flags);
+	jzpfs_qos_throttle(file_inode(iocb->ki_filp)->i_sb, count);
+	ret = jzpfs_inject(JZPFS_INJECT_WRITE);
+	if (!ret)
+		ret = jzpfs_do_write_iter(iocb, iter);
+
+	if (ret > 0 || ret == -EIOCBQUEUED)
+		jzpfs_heat_add(file_inode(iocb->ki_filp), true,
+			       ret > 0 ? ret : count);
+	return ret;
+}
+
 const struct file_operations jzpfs_main_fops = {
 	.llseek		= generic_file_llseek,
 	.read			= jzpfs_read,
@@ -472,7 +1121,7 @@ const struct file_operations jzpfs_main_fops = {
 const struct file_operations jzpfs_dir_fops = {
 	.llseek		= jzpfs_file_llseek,
 	.read			= generic_read_dir,
-	.iterate		= jzpfs_readdir,
+	.iterate_shared	= jzpfs_readdir,
 	.unlocked_ioctl	= jzpfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= jzpfs_compat_ioctl,
@@ -0,0 +1,138 @@
+/*
+ * 每个inode的访问热度
+ *
+ * 读写（read、write、read_iter、write_iter）和mmap缺页时更新inode上的
+ * 计数：次数、字节数、最后访问时间，以及一个随时间衰减的热度分数，每过
+ * JZPFS_HEAT_HALFLIFE减半。更新不拿锁，并发更新可能丢掉个别增量，对
+ * 判断冷热没有影响。
+ *
+ * /sys/kernel/debug/jzpfs/<major:minor>/heat 列出当前最热的
+ * JZPFS_HEAT_TOP个inode，供分层存储、预取和缓存大小的决策使用。
+ */
+
+#include "jzpfs.h"
+
+#define JZPFS_HEAT_HALFLIFE	(60 * HZ)
+#define JZPFS_HEAT_TOP		32
+
+/* score衰减到now，返回衰减后的值（不写回） */
+static unsigned long jzpfs_heat_decay(struct jzpfs_heat *h, unsigned long now,
+				      unsigned long *stamp)
+{
+	unsigned long score = READ_ONCE(h->score);
+	unsigned long periods;
+
+	*stamp = READ_ONCE(h->stamp);
+	periods = (now - *stamp) / JZPFS_HEAT_HALFLIFE;
+	if (!periods)
+		return score;
+	*stamp += periods * JZPFS_HEAT_HALFLIFE;
+	return periods >= BITS_PER_LONG ? 0 : score >> periods;
+}
+
+/* 一次访问：每次算1分，每4K数据再算1分 */
+void jzpfs_heat_add(struct inode *inode, bool write, size_t bytes)
+{
+	struct jzpfs_heat *h = &JZPFS_I(inode)->heat;
+	unsigned long now = jiffies, stamp, score;
+
+	if (write) {
+		atomic64_inc(&h->writes);
+		atomic64_add(bytes, &h->write_bytes);
+	} else {
+		atomic64_inc(&h->reads);
+		atomic64_add(bytes, &h->read_bytes);
+	}
+	score = jzpfs_heat_decay(h, now, &stamp);
+	WRITE_ONCE(h->stamp, stamp);
+	WRITE_ONCE(h->score, score + 1 + (bytes >> PAGE_SHIFT));
+	WRITE_ONCE(h->atime, now);
+}
+
+/* 新inode从现在开始计时 */
+void jzpfs_heat_init(struct inode *inode)
+{
+	struct jzpfs_heat *h = &JZPFS_I(inode)->heat;
+
+	h->stamp = h->atime = jiffies;
+}
+
+/* debugfs输出的一行，扫描时拷出来，不持有inode */
+struct jzpfs_heat_entry {
+	unsigned long ino;
+	unsigned long score;
+	u64 reads, writes, read_bytes, write_bytes;
+	unsigned long atime;
+};
+
+/* top按score从大到小，n个有效；放不下的挤掉最冷的 */
+static void jzpfs_heat_insert(struct jzpfs_heat_entry *top, int *n,
+			      const struct jzpfs_heat_entry *e)
+{
+	int i = *n;
+
+	if (i == JZPFS_HEAT_TOP) {
+		if (e->score <= top[i - 1].score)
+			return;
+		i--;
+	} else {
+		(*n)++;
+	}
+	for (; i > 0 && top[i - 1].score < e->score; i--)
+		top[i] = top[i - 1];
+	top[i] = *e;
+}
+
+static int jzpfs_heat_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct jzpfs_heat_entry *top, e;
+	unsigned long now = jiffies, stamp;
+	struct inode *inode;
+	struct jzpfs_heat *h;
+	int i, n = 0;
+
+	top = kmalloc_array(JZPFS_HEAT_TOP, sizeof(*top), GFP_KERNEL);
+	if (!top)
+		return -ENOMEM;
+
+	spin_lock(&sb->s_inode_list_lock);
+	list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+		h = &JZPFS_I(inode)->heat;
+		e.score = jzpfs_heat_decay(h, now, &stamp);
+		if (!e.score)
+			continue;
+		e.ino = inode->i_ino;
+		e.reads = atomic64_read(&h->reads);
+		e.writes = atomic64_read(&h->writes);
+		e.read_bytes = atomic64_read(&h->read_bytes);
+		e.write_bytes = atomic64_read(&h->write_bytes);
+		e.atime = READ_ONCE(h->atime);
+		jzpfs_heat_insert(top, &n, &e);
+	}
+	spin_unlock(&sb->s_inode_list_lock);
+
+	seq_printf(m, "%-12s %10s %10s %10s %14s %14s %10s\n", "ino", "score",
+		   "reads", "writes", "read_bytes", "write_bytes", "idle_ms");
+	for (i = 0; i < n; i++)
+		seq_printf(m, "%-12lu %10lu %10llu %10llu %14llu %14llu %10u\n",
+			   top[i].ino, top[i].score, top[i].reads,
+			   top[i].writes, top[i].read_bytes,
+			   top[i].write_bytes,
+			   jiffies_to_msecs(now - top[i].atime));
+	kfree(top);
+	return 0;
+}
+
+static int jzpfs_heat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, jzpfs_heat_show, inode->i_private);
+}
+
+const struct file_operations jzpfs_heat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= jzpfs_heat_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
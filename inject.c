@@ -0,0 +1,100 @@
+/*
+ * 故障和延迟注入，用来在本地模拟lower变慢、出错、卡住
+ *
+ * 默认不编译，make INJECT=1才有。每种操作一个debugfs目录：
+ *
+ *   /sys/kernel/debug/jzpfs/inject/<op>/
+ *     delay_us      命中延迟时睡多少微秒
+ *     delay_ratio   每10000次里有多少次延迟
+ *     error_ratio   每10000次里有多少次返回错误
+ *     errno         返回的错误（正数，默认EIO）
+ *     stall         非0时这种操作全部卡住，直到改回0或进程被kill
+ *     delayed、failed、stalled   累计命中次数
+ *
+ * op为lookup、read、write、fsync、getattr，在转给lower之前检查。所有
+ * 挂载点共用一套设置。
+ */
+
+#include "jzpfs.h"
+#include <linux/delay.h>
+#include <linux/random.h>
+
+struct jzpfs_inject {
+	u32 delay_us;
+	u32 delay_ratio;
+	u32 error_ratio;
+	u32 err;	/* positive errno */
+	u32 stall;
+	atomic_t delayed, failed, stalled;
+};
+
+static const char * const jzpfs_inject_names[JZPFS_INJECT_NR_OPS] = {
+	[JZPFS_INJECT_LOOKUP]	= "lookup",
+	[JZPFS_INJECT_READ]	= "read",
+	[JZPFS_INJECT_WRITE]	= "write",
+	[JZPFS_INJECT_FSYNC]	= "fsync",
+	[JZPFS_INJECT_GETATTR]	= "getattr",
+};
+
+static struct jzpfs_inject jzpfs_inject_ops[JZPFS_INJECT_NR_OPS];
+
+#define JZPFS_INJECT_SCALE	10000
+
+static bool jzpfs_inject_hit(u32 ratio)
+{
+	return ratio && prandom_u32_max(JZPFS_INJECT_SCALE) < ratio;
+}
+
+/* 在操作转给lower之前调用，返回0或要注入的错误 */
+int jzpfs_inject(enum jzpfs_inject_op op)
+{
+	struct jzpfs_inject *in = &jzpfs_inject_ops[op];
+	u32 err;
+
+	if (READ_ONCE(in->stall)) {
+		atomic_inc(&in->stalled);
+		while (READ_ONCE(in->stall) && !fatal_signal_pending(current))
+			msleep_interruptible(10);
+	}
+	if (jzpfs_inject_hit(READ_ONCE(in->delay_ratio))) {
+		atomic_inc(&in->delayed);
+		usleep_range(READ_ONCE(in->delay_us),
+			     READ_ONCE(in->delay_us) + 1);
+	}
+	if (jzpfs_inject_hit(READ_ONCE(in->error_ratio))) {
+		atomic_inc(&in->failed);
+		err = READ_ONCE(in->err);
+		return -(err && err < MAX_ERRNO ? err : EIO);
+	}
+	return 0;
+}
+
+void jzpfs_inject_init_debugfs(struct dentry *root)
+{
+	struct jzpfs_inject *in;
+	struct dentry *dir, *d;
+	int i;
+
+	dir = debugfs_create_dir("inject", root);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+	for (i = 0; i < JZPFS_INJECT_NR_OPS; i++) {
+		in = &jzpfs_inject_ops[i];
+		in->err = EIO;
+		d = debugfs_create_dir(jzpfs_inject_names[i], dir);
+		if (IS_ERR_OR_NULL(d))
+			continue;
+		debugfs_create_u32("delay_us", S_IRUSR | S_IWUSR, d,
+				   &in->delay_us);
+		debugfs_create_u32("delay_ratio", S_IRUSR | S_IWUSR, d,
+				   &in->delay_ratio);
+		debugfs_create_u32("error_ratio", S_IRUSR | S_IWUSR, d,
+				   &in->error_ratio);
+		debugfs_create_u32("errno", S_IRUSR | S_IWUSR, d, &in->err);
+		debugfs_create_u32("stall", S_IRUSR | S_IWUSR, d, &in->stall);
+		debugfs_create_atomic_t("delayed", S_IRUSR, d, &in->delayed);
+		debugfs_create_atomic_t("failed", S_IRUSR, d, &in->failed);
+		debugfs_create_atomic_t("stalled", S_IRUSR, d, &in->stalled);
+	}
+	pr_warn("jzpfs: fault injection compiled in\n");
+}
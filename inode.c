@@ -3,6 +3,7 @@
  */
 
 #include "jzpfs.h"
+#include <linux/vmalloc.h>
 
 /*
  *创建inode
@@ -109,6 +110,10 @@ static int jzpfs_unlink(struct inode *dir, struct dentry *dentry)
 	fsstack_copy_inode_size(dir, lower_dir_inode);
 	set_nlink(d_inode(dentry),
 		  jzpfs_lower_inode(d_inode(dentry))->i_nlink);
+	/* 最后一个链接没了，校验和也不再需要 */
+	if (jzpfs_inode_csum(d_inode(dentry)) && !d_inode(dentry)->i_nlink)
+		jzpfs_csum_unlink(dir->i_sb,
+				  jzpfs_lower_inode(d_inode(dentry)));
 	d_inode(dentry)->i_ctime = dir->i_ctime;
 	d_drop(dentry); 
 out:
@@ -247,11 +252,74 @@ out:
 	return err;
 }
 
+/*
+ * O_TMPFILE：在lower目录里建一个没有名字的文件，上层dentry和它一样不
+ * 进hash。之后linkat给它名字走jzpfs_link，lower的vfs_link要求lower
+ * inode带I_LINKABLE；上层的vfs_link已经按O_EXCL检查过上层inode，这里
+ * 直接给lower inode设上。4.9没有导出vfs_tmpfile，直接调lower的
+ * ->tmpfile。
+ */
+static int jzpfs_tmpfile(struct inode *dir, struct dentry *dentry,
+			 umode_t mode)
+{
+	printk(KERN_ALERT "jzpfs_tmpfile");
+	static const struct qstr name = QSTR_INIT("/", 1);
+	struct inode *lower_dir = jzpfs_lower_inode(dir);
+	struct inode *inode, *lower_inode;
+	struct dentry *lower_dentry;
+	struct path lower_dir_path, lower_path;
+	int err;
+
+	if (!lower_dir->i_op->tmpfile)
+		return -EOPNOTSUPP;
+	/* freed by d_release if we fail */
+	err = new_dentry_private_data(dentry);
+	if (err)
+		return err;
+
+	jzpfs_get_lower_path(dentry->d_parent, &lower_dir_path);
+	lower_dentry = d_alloc(lower_dir_path.dentry, &name);
+	if (!lower_dentry) {
+		err = -ENOMEM;
+		goto out;
+	}
+	err = lower_dir->i_op->tmpfile(lower_dir, lower_dentry, mode);
+	if (err) {
+		dput(lower_dentry);
+		goto out;
+	}
+	lower_inode = d_inode(lower_dentry);
+	spin_lock(&lower_inode->i_lock);
+	lower_inode->i_state |= I_LINKABLE;
+	spin_unlock(&lower_inode->i_lock);
+
+	lower_path.dentry = lower_dentry;
+	lower_path.mnt = mntget(lower_dir_path.mnt);
+	jzpfs_set_lower_path(dentry, &lower_path);
+	inode = jzpfs_iget(dir->i_sb, lower_inode);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		jzpfs_put_reset_lower_path(dentry);
+		goto out;
+	}
+	d_instantiate(dentry, inode);
+	fsstack_copy_attr_times(dir, lower_dir);
+
+out:
+	jzpfs_put_lower_path(dentry->d_parent, &lower_dir_path);
+	return err;
+}
+
 /*
  * 文件重命名
+ *
+ * flags（RENAME_NOREPLACE、RENAME_EXCHANGE、RENAME_WHITEOUT）原样交给
+ * lower，lower不支持的由vfs_rename返回-EINVAL。交换时lower和上层各自
+ * d_exchange，每个上层dentry还是对着原来的lower dentry。
  */
 static int jzpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
-			 struct inode *new_dir, struct dentry *new_dentry)
+			 struct inode *new_dir, struct dentry *new_dentry,
+			 unsigned int flags)
 {
 	printk(KERN_ALERT "jzpfs_rename");
 	int err = 0;
@@ -260,6 +328,7 @@ static int jzpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct dentry *lower_old_dir_dentry = NULL;
 	struct dentry *lower_new_dir_dentry = NULL;
 	struct dentry *trap = NULL;
+	struct inode *target = NULL;
 	struct path lower_old_path, lower_new_path;
 
 	jzpfs_get_lower_path(old_dentry, &lower_old_path);
@@ -277,16 +346,21 @@ static int jzpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	}
 	/* target should not be ancestor of source */
 	if (trap == lower_new_dentry) {
-		err = -ENOTEMPTY;
+		err = (flags & RENAME_EXCHANGE) ? -EINVAL : -ENOTEMPTY;
 		goto out;
 	}
 
 	err = vfs_rename(d_inode(lower_old_dir_dentry), lower_old_dentry,
 			 d_inode(lower_new_dir_dentry), lower_new_dentry,
-			 NULL, 0);
+			 NULL, flags);
 	if (err)
 		goto out;
 
+	/* 被覆盖的目标和unlink一样处理，RENAME_EXCHANGE时它还在 */
+	if (d_really_is_positive(new_dentry) && !(flags & RENAME_EXCHANGE)) {
+		target = d_inode(new_dentry);
+		set_nlink(target, jzpfs_lower_inode(target)->i_nlink);
+	}
 	fsstack_copy_attr_all(new_dir, d_inode(lower_new_dir_dentry));
 	fsstack_copy_inode_size(new_dir, d_inode(lower_new_dir_dentry));
 	if (new_dir != old_dir) {
@@ -298,6 +372,9 @@ static int jzpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 
 out:
 	unlock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
+	/* 最后一个链接没了，校验和也不再需要；csum目录的锁不套在rename锁里 */
+	if (target && jzpfs_inode_csum(target) && !target->i_nlink)
+		jzpfs_csum_unlink(new_dir->i_sb, jzpfs_lower_inode(target));
 	dput(lower_old_dir_dentry);
 	dput(lower_new_dir_dentry);
 	jzpfs_put_lower_path(old_dentry, &lower_old_path);
@@ -312,6 +389,10 @@ static int jzpfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 	struct dentry *lower_dentry;
 	struct path lower_path;
 
+	/* 目标已经缓存了，见jzpfs_get_link */
+	if (d_inode(dentry)->i_link)
+		return generic_readlink(dentry, buf, bufsiz);
+
 	jzpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!d_inode(lower_dentry)->i_op ||
@@ -385,6 +466,8 @@ static int jzpfs_setattr(struct dentry *dentry, struct iattr *ia)
 	struct inode *lower_inode;
 	struct path lower_path;
 	struct iattr lower_ia;
+	struct file *lower_file;
+	loff_t oldsize, zoldsize;
 
 	inode = d_inode(dentry);
 
@@ -403,12 +486,27 @@ static int jzpfs_setattr(struct dentry *dentry, struct iattr *ia)
 	memcpy(&lower_ia, ia, sizeof(lower_ia));
 	if (ia->ia_valid & ATTR_FILE)
 		lower_ia.ia_file = jzpfs_lower_file(ia->ia_file);
+	/* lower文件还没打开（见jzpfs_open_lower），按路径改 */
+	if (!lower_ia.ia_file)
+		lower_ia.ia_valid &= ~ATTR_FILE;
 
 	
+	zoldsize = i_size_read(inode);
 	if (ia->ia_valid & ATTR_SIZE) {
 		err = inode_newsize_ok(inode, ia->ia_size);
 		if (err)
 			goto out;
+		jzpfs_trace(inode, JZPFS_TR_TRUNCATE, ia->ia_size, 0, 0);
+		jzpfs_hdr_written(inode, ia->ia_size);
+		/* 压缩、去重文件的lower大小不是逻辑大小，变大时lower不用动 */
+		if (jzpfs_inode_ext_ops(inode)) {
+			if (ia->ia_size < zoldsize)
+				lower_ia.ia_size = min(jzpfs_ext_lower_size(inode,
+								ia->ia_size),
+						       i_size_read(lower_inode));
+			else
+				lower_ia.ia_valid &= ~ATTR_SIZE;
+		}
 		truncate_setsize(inode, ia->ia_size);
 	}
 
@@ -419,6 +517,7 @@ static int jzpfs_setattr(struct dentry *dentry, struct iattr *ia)
 		lower_ia.ia_valid &= ~ATTR_MODE;
 
 	
+	oldsize = i_size_read(lower_inode);
 	inode_lock(d_inode(lower_dentry));
 	err = notify_change(lower_dentry, &lower_ia, 
 			    NULL);
@@ -426,6 +525,44 @@ static int jzpfs_setattr(struct dentry *dentry, struct iattr *ia)
 	if (err)
 		goto out;
 
+	/*
+	 * 加密文件截断变大时，新增的部分要填成加密的0；
+	 * 打开校验和时要重算截断后的最后一块
+	 */
+	if ((ia->ia_valid & ATTR_SIZE) &&
+	    ((jzpfs_inode_encrypted(inode) && ia->ia_size > oldsize) ||
+	     jzpfs_inode_ext_ops(inode) || jzpfs_inode_csum(inode))) {
+		lower_file = dentry_open(&lower_path, O_WRONLY | O_LARGEFILE,
+					 current_cred());
+		if (IS_ERR(lower_file)) {
+			err = PTR_ERR(lower_file);
+			goto out;
+		}
+		/* extent文件自己维护校验和 */
+		if (jzpfs_inode_ext_ops(inode))
+			err = jzpfs_ext_truncate(inode, lower_file, zoldsize,
+					       ia->ia_size);
+		else if (jzpfs_inode_encrypted(inode) && ia->ia_size > oldsize)
+			err = jzpfs_crypt_zero_range(inode, lower_file,
+						     max_t(loff_t, oldsize,
+							   JZPFS_HDR_SIZE),
+						     ia->ia_size);
+		if (!err && !jzpfs_inode_ext_ops(inode) &&
+		    jzpfs_inode_csum(inode)) {
+			err = jzpfs_csum_truncate(inode, lower_file,
+						  ia->ia_size);
+			/* 原来的最后一块变长了；明文的空洞不需要校验 */
+			if (!err && ia->ia_size > oldsize)
+				err = jzpfs_csum_update(inode, lower_file,
+					oldsize, jzpfs_inode_encrypted(inode) ?
+					ia->ia_size :
+					round_up(oldsize, JZPFS_CSUM_BLOCK));
+		}
+		fput(lower_file);
+		if (err)
+			goto out;
+	}
+
 	
 	fsstack_copy_attr_all(inode, lower_inode);
 	
@@ -447,10 +584,15 @@ static int jzpfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 	struct kstat lower_stat;
 	struct path lower_path;
 
+	err = jzpfs_inject(JZPFS_INJECT_GETATTR);
+	if (err)
+		return err;
 	jzpfs_get_lower_path(dentry, &lower_path);
 	err = vfs_getattr(&lower_path, &lower_stat);
 	if (err)
 		goto out;
+	/* 压缩、去重文件报告逻辑大小，st_blocks仍是lower实际占用的 */
+	jzpfs_ext_probe(d_inode(dentry), &lower_path);
 	fsstack_copy_attr_all(d_inode(dentry),
 			      d_inode(lower_path.dentry));
 	generic_fillattr(d_inode(dentry), stat);
@@ -460,57 +602,11 @@ out:
 	return err;
 }
 
-static int jzpfs_setxattr(struct dentry *dentry, const char *name, const void *value,
-		size_t size, int flags)
-{
-	printk(KERN_ALERT "jzpfs_setxattr");
-	int err; struct dentry *lower_dentry;
-	struct path lower_path;
-
-	jzpfs_get_lower_path(dentry, &lower_path);
-	lower_dentry = lower_path.dentry;
-	if (!(d_inode(lower_dentry)->i_opflags & IOP_XATTR)) {
-		err = -EOPNOTSUPP;
-		goto out;
-	}
-	err = vfs_setxattr(lower_dentry, name, value, size, flags);
-	if (err)
-		goto out;
-	fsstack_copy_attr_all(d_inode(dentry),
-			      d_inode(lower_path.dentry));
-out:
-	jzpfs_put_lower_path(dentry, &lower_path);
-	return err;
-}
-
-static ssize_t jzpfs_getxattr(struct dentry *dentry, const char *name, void *buffer,
-		size_t size)
-{
-	printk(KERN_ALERT "jzpfs_getxattr");
-	int err;
-	struct dentry *lower_dentry;
-	struct path lower_path;
-
-	jzpfs_get_lower_path(dentry, &lower_path);
-	lower_dentry = lower_path.dentry;
-	if (!(d_inode(lower_dentry)->i_opflags & IOP_XATTR)) {
-		err = -EOPNOTSUPP;
-		goto out;
-	}
-	err = vfs_getxattr(lower_dentry, name, buffer, size);
-	if (err)
-		goto out;
-	fsstack_copy_attr_atime(d_inode(dentry),
-				d_inode(lower_path.dentry));
-out:
-	jzpfs_put_lower_path(dentry, &lower_path);
-	return err;
-}
-
 static ssize_t jzpfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 {
 	printk(KERN_ALERT "jzpfs_listxattr");
 	int err;
+	char *list;
 	struct dentry *lower_dentry;
 	struct path lower_path;
 
@@ -520,7 +616,30 @@ static ssize_t jzpfs_listxattr(struct dentry *dentry, char *buffer, size_t buffe
 		err = -EOPNOTSUPP;
 		goto out;
 	}
-	err = vfs_listxattr(lower_dentry, buffer, buffer_size);
+	if (buffer_size) {
+		err = vfs_listxattr(lower_dentry, buffer, buffer_size);
+		if (err > 0)
+			err = jzpfs_xattr_list_filter(buffer, err);
+	} else {
+		/* 只问长度也要去掉user.jzpfs.*，先读到临时缓冲区里 */
+		err = vfs_listxattr(lower_dentry, NULL, 0);
+		if (err > 0) {
+			list = kmalloc(err, GFP_KERNEL | __GFP_NOWARN);
+			if (!list)
+				list = vmalloc(err);
+			if (!list) {
+				err = -ENOMEM;
+				goto out;
+			}
+			err = vfs_listxattr(lower_dentry, list, err);
+			/* 中间变长了就按原样报，调用者会再来一次 */
+			if (err > 0)
+				err = jzpfs_xattr_list_filter(list, err);
+			else if (err == -ERANGE)
+				err = vfs_listxattr(lower_dentry, NULL, 0);
+			kvfree(list);
+		}
+	}
 	if (err)
 		goto out;
 	fsstack_copy_attr_atime(d_inode(dentry),
@@ -530,58 +649,60 @@ out:
 	return err;
 }
 
-static int jzpfs_removexattr(struct dentry *dentry, struct inode *inode, const char *name)
-{
-	printk(KERN_ALERT "jzpfs_removexattr");
-	int err;
-	struct dentry *lower_dentry;
-	struct inode *lower_inode;
-	struct path lower_path;
-
-	jzpfs_get_lower_path(dentry, &lower_path);
-	lower_dentry = lower_path.dentry;
-	lower_inode = jzpfs_lower_inode(inode);
-	if (!(lower_inode->i_opflags & IOP_XATTR)) {
-		err = -EOPNOTSUPP;
-		goto out;
-	}
-	err = vfs_removexattr(lower_dentry, name);
-	if (err)
-		goto out;
-	fsstack_copy_attr_all(d_inode(dentry), lower_inode);
-out:
-	jzpfs_put_lower_path(dentry, &lower_path);
-	return err;
-}
-
+/*
+ * 符号链接的目标读一次就缓存在inode->i_link上：lower的符号链接目标不会
+ * 变，lower上换成别的链接（rename、删了重建）是另一个lower inode，对应
+ * 另一个jzpfs inode。有了i_link，VFS解析链接直接用它，不再调get_link，
+ * RCU路径查找也不用退回ref-walk。i_link随inode在RCU宽限期后释放。
+ *
+ * lower需要revalidate（NFS之类）时目标可能在别处被改掉，不缓存，每次
+ * 都去lower读。
+ */
 static const char *jzpfs_get_link(struct dentry *dentry, struct inode *inode,
 				   struct delayed_call *done)
 {
 	printk(KERN_ALERT "jzpfs_get_link");
-	char *buf;
+	char *buf, *link;
 	int len = PAGE_SIZE, err;
 	mm_segment_t old_fs;
+	struct path lower_path;
+	bool cache;
 
+	/* 还没缓存，RCU walk里不能睡眠去读lower */
 	if (!dentry)
 		return ERR_PTR(-ECHILD);
 
-	
 	buf = kmalloc(len, GFP_KERNEL);
 	if (!buf) {
 		buf = ERR_PTR(-ENOMEM);
 		return buf;
 	}
 
-	
 	old_fs = get_fs();
 	set_fs(KERNEL_DS);
 	err = jzpfs_readlink(dentry, buf, len);
 	set_fs(old_fs);
 	if (err < 0) {
 		kfree(buf);
-		buf = ERR_PTR(err);
-	} else {
-		buf[err] = '\0';
+		return ERR_PTR(err);
+	}
+	buf[err] = '\0';
+
+	jzpfs_get_lower_path(dentry, &lower_path);
+	cache = !(lower_path.dentry->d_flags &
+		  (DCACHE_OP_REVALIDATE | DCACHE_OP_WEAK_REVALIDATE));
+	jzpfs_put_lower_path(dentry, &lower_path);
+	if (cache)
+		link = kmemdup(buf, err + 1, GFP_KERNEL);
+	else
+		link = NULL;
+	if (link) {
+		kfree(buf);
+		/* 并发的第一次解析只留一份 */
+		if (cmpxchg(&inode->i_link, NULL, link))
+			kfree(link);
+		jzpfs_stat_inc(inode->i_sb, JZPFS_STAT_LINK_CACHED);
+		return inode->i_link;
 	}
 	set_delayed_call(done, kfree_link, buf);
 	return buf;
@@ -606,6 +727,7 @@ const struct inode_operations jzpfs_dir_iops = {
 	.rmdir		= jzpfs_rmdir,
 	.mknod		= jzpfs_mknod,
 	.rename		= jzpfs_rename,
+	.tmpfile	= jzpfs_tmpfile,
 	.permission	= jzpfs_permission,
 	.setattr	= jzpfs_setattr,
 	.getattr	= jzpfs_getattr,
@@ -19,6 +19,11 @@
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/xattr.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/backing-dev.h>
 
 /* 文件系统名 */
 #define JZPFS_NAME "jzpfs"
@@ -26,6 +31,54 @@
 /* jzpfs root inode number */
 #define JZPFS_ROOT_INO     1
 
+/* 变换文件的文件头，位于lower文件开头，不参与数据变换 */
+#define JZPFS_HDR_MAGIC		"JFS"
+#define JZPFS_HDR_SIZE		3
+
+enum jzpfs_hdr_type {
+	JZPFS_HDR_NONE,		/* no header, passthrough */
+	JZPFS_HDR_LEGACY,	/* "JFS": case transform or encryption */
+	JZPFS_HDR_EXTENT,	/* extent file, see extent.c */
+};
+
+/* 文件加密：nonce保存在lower的xattr里，主密钥是logon类型的key */
+#define JZPFS_XATTR_PREFIX	XATTR_USER_PREFIX "jzpfs."
+#define JZPFS_XATTR_NONCE	JZPFS_XATTR_PREFIX "nonce"
+/* 元数据目录和其中的文件，见meta.c */
+#define JZPFS_XATTR_META	JZPFS_XATTR_PREFIX "meta"
+#define JZPFS_NONCE_SIZE	16
+#define JZPFS_MASTER_KEY_MIN	16
+#define JZPFS_MASTER_KEY_MAX	64
+
+/* lower根目录下的隐藏元数据目录，见meta.c */
+#define JZPFS_META_DIR		".jzpfs"
+
+/* 数据块校验和，见csum.c */
+#define JZPFS_CSUM_SHIFT	12
+#define JZPFS_CSUM_BLOCK	(1 << JZPFS_CSUM_SHIFT)
+#define JZPFS_CSUM_BATCH	16	/* blocks per lower read/csum write */
+#define JZPFS_BOUNCE_SIZE	(JZPFS_CSUM_BATCH << JZPFS_CSUM_SHIFT)
+
+/* 按extent组织的文件（压缩、去重），见extent.c */
+#define JZPFS_EXT_HDR_SIZE	4096
+#define JZPFS_EXT_SHIFT		16
+#define JZPFS_EXT_SIZE		(1 << JZPFS_EXT_SHIFT)
+#define JZPFS_Z_MAGIC		"JFZ"
+#define JZPFS_DEDUP_MAGIC	"JFD"
+
+enum {
+	JZPFS_Z_NONE,
+	JZPFS_Z_LZ4,
+	JZPFS_Z_ZSTD,
+	JZPFS_Z_DEFLATE,
+	JZPFS_Z_LZO,
+	JZPFS_Z_NR_ALGOS,
+};
+
+/* nfs文件句柄类型，包装了lower的句柄，见export.c */
+#define JZPFS_FILEID		0xf1
+#define JZPFS_FILEID_PARENT	0xf2
+
 /* DEBUG信息 */
 #define UDBG printk(KERN_DEFAULT "DBG:%s:%s:%d\n", __FILE__, __func__, __LINE__)
 
@@ -39,6 +92,7 @@ extern const struct super_operations jzpfs_sops;
 extern const struct dentry_operations jzpfs_dops;
 extern const struct address_space_operations jzpfs_aops, jzpfs_dummy_aops;
 extern const struct vm_operations_struct jzpfs_vm_ops;
+extern const struct export_operations jzpfs_export_ops;
 
 extern int jzpfs_init_inode_cache(void);
 extern void jzpfs_destroy_inode_cache(void);
@@ -46,6 +100,10 @@ extern int jzpfs_init_dentry_cache(void);
 extern void jzpfs_destroy_dentry_cache(void);
 extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
+extern int jzpfs_d_attach_lower(struct dentry *dentry,
+				struct path *lower_path);
+//lower文件
+extern struct file *jzpfs_open_lower(struct file *file);
 //查找路径
 extern struct dentry *jzpfs_lookup(struct inode *dir, struct dentry *dentry,
 				    unsigned int flags);
@@ -54,28 +112,361 @@ extern struct inode *jzpfs_iget(struct super_block *sb,
 				 struct inode *lower_inode);
 extern int jzpfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
+//统计信息和debugfs
+extern int jzpfs_init_debugfs(void);
+extern void jzpfs_exit_debugfs(void);
+extern int jzpfs_sb_stats_init(struct super_block *sb);
+extern void jzpfs_sb_stats_exit(struct super_block *sb);
+//文件加密
+extern int jzpfs_crypto_init_sb(struct super_block *sb);
+extern void jzpfs_crypto_exit_sb(struct super_block *sb);
+extern int jzpfs_crypto_create(struct inode *inode, struct dentry *lower_dentry);
+extern int jzpfs_crypto_setup(struct inode *inode, struct dentry *lower_dentry);
+extern void jzpfs_crypto_drop(struct inode *inode);
+extern int jzpfs_crypt(struct inode *inode, u8 *buf, size_t len, loff_t pos);
+extern int jzpfs_crypt_zero_range(struct inode *inode, struct file *lower_file,
+				  loff_t from, loff_t to);
+//数据变换和文件头
+extern void jzpfs_case_encode(u8 *buf, size_t len, loff_t pos);
+extern void jzpfs_case_decode(u8 *buf, size_t len, loff_t pos);
+extern int jzpfs_encode(struct file *file, u8 *buf, size_t len, loff_t pos);
+extern int jzpfs_decode(struct file *file, u8 *buf, size_t len, loff_t pos);
+extern enum jzpfs_hdr_type jzpfs_hdr_type(const u8 *buf, ssize_t len);
+extern ssize_t jzpfs_hdr_read(struct file *lower_file, u8 *buf);
+extern ssize_t jzpfs_hdr_write(struct file *lower_file);
+//范围锁
+struct jzpfs_range;
+extern void jzpfs_range_lock(struct inode *inode, struct jzpfs_range *r,
+			     loff_t start, loff_t end, bool write);
+extern void jzpfs_range_unlock(struct inode *inode, struct jzpfs_range *r);
+extern loff_t jzpfs_write_lock(struct inode *inode, struct file *lower_file,
+			       struct jzpfs_range *r, loff_t pos, size_t count,
+			       bool append);
+extern void jzpfs_write_unlock(struct inode *inode, struct jzpfs_range *r);
+//元数据目录
+extern int jzpfs_meta_init(struct super_block *sb, struct path *lower_root);
+extern void jzpfs_meta_exit(struct super_block *sb);
+extern bool jzpfs_meta_marked(struct dentry *lower_dentry);
+extern struct dentry *jzpfs_meta_subdir(struct super_block *sb,
+					const char *name);
+extern struct file *jzpfs_meta_open(struct super_block *sb, struct dentry *dir,
+				    const char *name, bool create);
+extern int jzpfs_meta_unlink(struct super_block *sb, struct dentry *dir,
+			     const char *name);
+extern int jzpfs_meta_truncate(struct super_block *sb, struct file *file,
+			       loff_t length);
+extern bool jzpfs_is_meta_name(struct dentry *parent, const char *name,
+			       int len);
+//数据块校验和
+extern int jzpfs_csum_verify(struct inode *inode, const u8 *data, loff_t pos,
+			     size_t len);
+extern int jzpfs_csum_update(struct inode *inode, struct file *lower_file,
+			     loff_t from, loff_t to);
+extern void jzpfs_csum_written(struct inode *inode, struct file *lower_file,
+			       loff_t from, loff_t to);
+extern int jzpfs_csum_invalidate(struct inode *inode);
+extern int jzpfs_csum_truncate(struct inode *inode, struct file *lower_file,
+			       loff_t newsize);
+extern void jzpfs_csum_unlink(struct super_block *sb,
+			      struct inode *lower_inode);
+extern void jzpfs_csum_release(struct inode *inode);
+//按extent组织的文件
+struct jzpfs_ext_ops;
+extern const struct jzpfs_ext_ops jzpfs_z_ops, jzpfs_dedup_ops;
+extern ssize_t jzpfs_ext_pread(struct file *file, void *buf, size_t len,
+			       loff_t pos);
+extern int jzpfs_ext_pwrite(struct file *file, const void *buf, size_t len,
+			    loff_t pos);
+extern ssize_t jzpfs_ext_read(struct file *file, struct iov_iter *iter,
+			      loff_t *ppos);
+extern ssize_t jzpfs_ext_write(struct file *file, struct iov_iter *iter,
+			       loff_t *ppos);
+extern loff_t jzpfs_ext_lower_size(struct inode *inode, loff_t size);
+extern int jzpfs_ext_truncate(struct inode *inode, struct file *lower_file,
+			      loff_t oldsize, loff_t newsize);
+extern bool jzpfs_ext_magic(const char *magic);
+extern int jzpfs_ext_setup(struct inode *inode, struct file *lower_file);
+extern int jzpfs_ext_create(struct inode *inode, struct file *lower_file,
+			    const struct jzpfs_ext_ops *ops, u8 algo);
+extern void jzpfs_ext_probe(struct inode *inode, struct path *lower_path);
+//压缩
+extern int jzpfs_z_algo(const char *name);
+extern const char *jzpfs_z_algo_name(int algo);
+extern void jzpfs_z_drop(struct inode *inode);
+//去重
+extern int jzpfs_dedup_create(struct inode *inode, struct file *lower_file);
+extern int jzpfs_dedup_init_sb(struct super_block *sb);
+extern void jzpfs_dedup_exit_sb(struct super_block *sb);
+//fsync组提交
+extern void jzpfs_commit_init_sb(struct super_block *sb);
+extern int jzpfs_commit_fsync(struct file *lower_file, struct super_block *sb,
+			      loff_t start, loff_t end);
+//访问热度
+extern void jzpfs_heat_add(struct inode *inode, bool write, size_t bytes);
+extern void jzpfs_heat_init(struct inode *inode);
+extern const struct file_operations jzpfs_heat_fops;
+//限速
+extern int jzpfs_init_sysfs(void);
+extern void jzpfs_exit_sysfs(void);
+extern void jzpfs_qos_init_sb(struct super_block *sb);
+extern void jzpfs_qos_exit_sb(struct super_block *sb);
+extern void jzpfs_qos_throttle(struct super_block *sb, size_t bytes);
+//故障注入（make INJECT=1）
+enum jzpfs_inject_op {
+	JZPFS_INJECT_LOOKUP,
+	JZPFS_INJECT_READ,
+	JZPFS_INJECT_WRITE,
+	JZPFS_INJECT_FSYNC,
+	JZPFS_INJECT_GETATTR,
+	JZPFS_INJECT_NR_OPS,
+};
+#ifdef JZPFS_INJECT
+extern int jzpfs_inject(enum jzpfs_inject_op op);
+extern void jzpfs_inject_init_debugfs(struct dentry *root);
+#else
+static inline int jzpfs_inject(enum jzpfs_inject_op op) { return 0; }
+static inline void jzpfs_inject_init_debugfs(struct dentry *root) { }
+#endif
+//加载时自检（make SELFTEST=1）
+#ifdef JZPFS_SELFTEST
+extern int jzpfs_selftest(void);
+#else
+static inline int jzpfs_selftest(void) { return 0; }
+#endif
+//readdir预取
+struct jzpfs_prefetch;
+extern void jzpfs_prefetch_add(struct jzpfs_prefetch **ppf, struct dentry *dir,
+			       const char *name, int len);
+extern void jzpfs_prefetch_submit(struct jzpfs_prefetch **ppf);
+extern int jzpfs_prefetch_init_sb(struct super_block *sb);
+extern void jzpfs_prefetch_exit_sb(struct super_block *sb);
+//I/O跟踪
+extern void __jzpfs_trace(struct inode *inode, u16 op, u64 off, u64 len,
+			  u32 flags);
+extern void jzpfs_trace_init_sb(struct super_block *sb);
+extern void jzpfs_trace_exit_sb(struct super_block *sb);
+extern const struct file_operations jzpfs_trace_fops, jzpfs_trace_ctl_fops;
+//扩展属性
+extern const struct xattr_handler *jzpfs_xattr_handlers[];
+extern void jzpfs_xattr_invalidate(struct inode *inode, const char *name);
+extern void jzpfs_xattr_drop(struct inode *inode);
+extern ssize_t jzpfs_xattr_list_filter(char *list, ssize_t len);
+
+/*
+ * 按extent组织的文件格式。每个extent JZPFS_EXT_SIZE字节，读写循环、
+ * 读改写和文件头在extent.c里，这里是各格式怎么存一个extent。
+ */
+struct jzpfs_ext_ops {
+	const char *name;
+	const char *magic;	/* JZPFS_HDR_SIZE bytes */
+	/* can this mount read files written with algo? */
+	bool (*algo_ok)(struct super_block *sb, u8 algo);
+	/* fill buf (JZPFS_EXT_SIZE bytes) with extent ext, zero-padded */
+	int (*read_extent)(struct inode *inode, struct file *lower_file,
+			   u64 ext, u8 *buf, u8 *scratch);
+	/* store the first len bytes of buf as extent ext */
+	int (*write_extent)(struct inode *inode, struct file *lower_file,
+			    u64 ext, u8 *buf, size_t len, u8 *scratch);
+	/* lower file size holding nr extents */
+	loff_t (*lower_size)(u64 nr);
+	/* forget extents >= first after a truncate (optional) */
+	int (*drop_extents)(struct inode *inode, struct file *lower_file,
+			    u64 first, u8 *scratch);
+};
+
+/* 普通文件的lower文件，打开标志和cred相同的open共享，见file.c */
+struct jzpfs_lower_ref {
+	struct list_head list;	/* on jzpfs_inode_info.lower_files */
+	struct file *file;
+	unsigned int flags;	/* JZPFS_LOWER_SHARE_FLAGS of the opener */
+	int count;		/* protected by lower_mutex */
+};
 
 /* file private data */
 struct jzpfs_file_info {
 	struct file *lower_file;
+	struct jzpfs_lower_ref *lower_ref;	/* NULL for directories */
 	const struct vm_operations_struct *lower_vm_ops;
 };
 
+/* jzpfs_inode_info.flags */
+#define JZPFS_INODE_ENCRYPTED	0	/* data encrypted with a per-file key */
+#define JZPFS_INODE_CSUM_NONE	1	/* no checksum file, don't look again */
+#define JZPFS_INODE_PROBED	2	/* lower header already inspected */
+#define JZPFS_INODE_HDR_KNOWN	3	/* open classified the header, see below */
+#define JZPFS_INODE_LEGACY	4	/* "JFS" header: case transform/encryption */
+
+/* 访问热度，无锁更新，见heat.c */
+struct jzpfs_heat {
+	atomic64_t reads, writes;
+	atomic64_t read_bytes, write_bytes;
+	unsigned long score;	/* decayed access score */
+	unsigned long stamp;	/* jiffies score was last decayed to */
+	unsigned long atime;	/* jiffies of the last access */
+};
+
 /* jzpfs inode data in memory */
 struct jzpfs_inode_info {
 	struct inode *lower_inode;
+	unsigned long flags;
+	/* per-file key, derived once and kept until eviction/revocation */
+	struct rw_semaphore key_sem;
+	struct crypto_skcipher *key_tfm;
+	struct crypto_cipher *key_block;	/* unaligned heads */
+	struct key *key;
+	/* per-block checksums, opened on first use */
+	struct mutex csum_mutex;
+	struct file *csum_file;
+	/* extent file format, set once when the header is recognised */
+	const struct jzpfs_ext_ops *ext_ops;
+	u8 ext_algo;
+	/* compressor, allocated on first use; z_mutex serialises its use */
+	struct mutex z_mutex;
+	struct crypto_comp *z_tfm;
+	/* byte ranges held by writers and checksummed readers, see rangelock.c */
+	spinlock_t range_lock;
+	struct rb_root ranges;
+	wait_queue_head_t range_wait;
+	/* lower files shared by upper opens, see jzpfs_lower_get() */
+	struct mutex lower_mutex;
+	struct list_head lower_files;
+	/* hot xattr values, see xattr.c */
+	spinlock_t xattr_lock;
+	struct list_head xattrs;
+	int nr_xattrs;
+	unsigned int xattr_gen;		/* bumped by jzpfs_xattr_invalidate */
+	struct jzpfs_heat heat;
 	struct inode vfs_inode;
 };
 
+/* 一个持有的范围锁，放在调用者的栈上 */
+struct jzpfs_range {
+	struct rb_node rb;
+	loff_t start, last;	/* inclusive, JZPFS_CSUM_BLOCK aligned */
+	loff_t subtree_last;
+	bool write;
+};
+
 /* jzpfs dentry data in memory */
 struct jzpfs_dentry_info {
 	spinlock_t lock;	/* protects lower_path */
 	struct path lower_path;
 };
 
+/* per-mount counters, summed over all cpus when dumped */
+enum jzpfs_stat_item {
+	JZPFS_STAT_IGET_HIT,		/* jzpfs_iget found a cached inode */
+	JZPFS_STAT_IGET_MISS,		/* jzpfs_iget had to build a new inode */
+	JZPFS_STAT_IGET_REFRESH,	/* cached inode resynced from lower */
+	JZPFS_STAT_INODE_EVICT,		/* inodes torn down by evict_inode */
+	JZPFS_STAT_DENTRY_STALE,	/* dentries invalidated by revalidate */
+	JZPFS_STAT_CSUM_VERIFIED,	/* data blocks checked against crc32c */
+	JZPFS_STAT_CSUM_FAILED,		/* checksum mismatches (-EIO) */
+	JZPFS_STAT_CSUM_UPDATED,	/* checksums recomputed after writes */
+	JZPFS_STAT_EXT_READ,		/* bytes returned by extent-file reads */
+	JZPFS_STAT_EXT_READ_LOWER,	/* bytes those reads took from lower */
+	JZPFS_STAT_EXT_WRITE,		/* bytes accepted by extent-file writes */
+	JZPFS_STAT_EXT_WRITE_LOWER,	/* bytes those writes put on lower */
+	JZPFS_STAT_DEDUP_HIT,		/* chunks already in the chunk store */
+	JZPFS_STAT_DEDUP_NEW,		/* chunks added to the chunk store */
+	JZPFS_STAT_CHUNK_CACHE_HIT,	/* chunk reads served from memory */
+	JZPFS_STAT_CHUNK_CACHE_MISS,	/* chunk reads that went to lower */
+	JZPFS_STAT_RANGE_WAIT,		/* range locks that had to wait */
+	JZPFS_STAT_OPEN_DEFERRED,	/* opens that did not open the lower file */
+	JZPFS_STAT_OPEN_LOWER_LAZY,	/* deferred lower opens done on first use */
+	JZPFS_STAT_OPEN_LOWER_SHARED,	/* opens that reused a shared lower file */
+	JZPFS_STAT_LINK_CACHED,		/* symlink targets cached in i_link */
+	JZPFS_STAT_XATTR_HIT,		/* xattr reads served from the cache */
+	JZPFS_STAT_XATTR_MISS,		/* cacheable xattr reads that went to lower */
+	JZPFS_STAT_COMMIT_BATCH,	/* lower commits run for grouped fsyncs */
+	JZPFS_STAT_COMMIT_JOINED,	/* fsyncs that waited for another's commit */
+	JZPFS_STAT_QOS_DELAYED,		/* requests delayed by a qos rule */
+	JZPFS_STAT_QOS_DELAY_US,	/* total time those requests slept */
+	JZPFS_STAT_PREFETCH,		/* inodes looked up ahead by readdir */
+	JZPFS_STAT_PREFETCH_DROPPED,	/* names skipped, prefetch queue full */
+	JZPFS_STAT_READAHEAD,		/* pages of lower readahead started */
+	JZPFS_NR_STATS,
+};
+
+struct jzpfs_stats {
+	u64 count[JZPFS_NR_STATS];
+};
+
+/*
+ * I/O跟踪记录，从debugfs的trace文件原样读出，用户态的定义在
+ * tools/libjzpfs.h，两边要一起改
+ */
+enum jzpfs_trace_op {
+	JZPFS_TR_OPEN,		/* flags = f_flags */
+	JZPFS_TR_RELEASE,
+	JZPFS_TR_READ,		/* off, len = request, flags = f_flags */
+	JZPFS_TR_WRITE,
+	JZPFS_TR_FSYNC,		/* off, len = range, flags = datasync */
+	JZPFS_TR_TRUNCATE,	/* off = new size */
+};
+
+struct jzpfs_trace_rec {
+	__u64 ts;		/* ktime_get_ns() when issued */
+	__u64 ino;
+	__u64 off;
+	__u32 len;
+	__u32 flags;
+	__u32 pid;
+	__u16 op;
+	__u16 pad;
+};
+
 /* jzpfs super-block data in memory */
 struct jzpfs_sb_info {
 	struct super_block *lower_sb;
+	struct jzpfs_stats __percpu *stats;
+	struct dentry *debugfs_dir;
+	/* key=挂载选项，主密钥的描述 */
+	char *key_desc;
+	struct mutex key_mutex;	/* protects master_key */
+	struct key *master_key;
+	/* csum挂载选项：数据块校验和 */
+	bool csum;
+	/* compress=挂载选项：新建文件使用的压缩算法，JZPFS_Z_NONE为不压缩 */
+	u8 compress;
+	/* dedup挂载选项：块仓库、摘要tfm和块缓存 */
+	bool dedup;
+	struct dentry *chunk_dir;
+	struct crypto_shash *chunk_tfm;
+	struct jzpfs_chunk_cache *chunk_cache;
+	/* 元数据目录和其中的子目录，以挂载者的身份访问 */
+	const struct cred *mounter_cred;
+	struct path meta_path;
+	struct dentry *csum_dir;
+	bool meta_marked;	/* files carry JZPFS_XATTR_META */
+	/* nfs句柄不带父目录，disconnected的文件直接接受，见export.c */
+	bool export_flat;
+	/* freeze_fs froze lower_sb, unfreeze_fs must thaw it */
+	bool lower_frozen;
+	/* group_commit挂载选项：合并fsync的lower提交，见commit.c */
+	bool group_commit;
+	unsigned int commit_delay;	/* usecs the leader waits for others */
+	spinlock_t commit_lock;
+	wait_queue_head_t commit_wait;
+	u64 commit_started, commit_done;
+	bool commit_busy;
+	int commit_err;			/* result of commit commit_done */
+	/* /sys/fs/jzpfs/<dev>/下的限速规则，见qos.c */
+	struct kobject kobj;
+	struct completion kobj_unregister;
+	bool kobj_added;
+	spinlock_t qos_lock;		/* serialises rule updates */
+	struct hlist_head qos_rules;	/* RCU */
+	int qos_nr_rules;
+	/* debugfs的trace_ctl打开的I/O跟踪，见trace.c */
+	struct mutex trace_mutex;	/* start/stop/read/free */
+	struct jzpfs_trace __rcu *trace;
+	/* readdir_prefetch挂载选项，见prefetch.c */
+	bool prefetch;
+	struct workqueue_struct *prefetch_wq;
+	atomic_t prefetch_queued;	/* batches not yet done */
+	/* 自己的bdi，fadvise和readahead(2)才会转给lower，见jzpfs_readpages */
+	struct backing_dev_info bdi;
 };
 
 /*
@@ -95,13 +486,64 @@ static inline struct jzpfs_inode_info *JZPFS_I(const struct inode *inode)
 /* superblock to private data */
 #define JZPFS_SB(super) ((struct jzpfs_sb_info *)(super)->s_fs_info)
 
+/* 统计计数，热路径上只做一次percpu自增 */
+static inline void jzpfs_stat_add(struct super_block *sb,
+				  enum jzpfs_stat_item item, u64 val)
+{
+	this_cpu_add(JZPFS_SB(sb)->stats->count[item], val);
+}
+
+static inline void jzpfs_stat_inc(struct super_block *sb,
+				  enum jzpfs_stat_item item)
+{
+	jzpfs_stat_add(sb, item, 1);
+}
+
+/*
+ * 读写之后只同步大小，而且只在变了时才写：很多线程读写同一个文件时
+ * 不去弄脏共享的inode缓存行。时间戳由lower按它自己的noatime、relatime、
+ * lazytime维护，上层不在每次I/O时拷，getattr时才拷过来（见jzpfs_getattr）。
+ */
+static inline void jzpfs_sync_size(struct inode *inode,
+				   struct inode *lower_inode)
+{
+	if (i_size_read(inode) != i_size_read(lower_inode))
+		fsstack_copy_inode_size(inode, lower_inode);
+}
+
+/* 没在跟踪时只读一次指针 */
+static inline void jzpfs_trace(struct inode *inode, u16 op, u64 off, u64 len,
+			       u32 flags)
+{
+	if (unlikely(rcu_access_pointer(JZPFS_SB(inode->i_sb)->trace)))
+		__jzpfs_trace(inode, op, off, len, flags);
+}
+
+static inline bool jzpfs_inode_encrypted(const struct inode *inode)
+{
+	return test_bit(JZPFS_INODE_ENCRYPTED, &JZPFS_I(inode)->flags);
+}
+
+/* 压缩或去重的文件返回格式，i_size是逻辑大小；普通文件返回NULL */
+static inline const struct jzpfs_ext_ops *jzpfs_inode_ext_ops(
+	const struct inode *inode)
+{
+	return smp_load_acquire(&JZPFS_I(inode)->ext_ops);
+}
+
+/* 是否校验数据块 */
+static inline bool jzpfs_inode_csum(const struct inode *inode)
+{
+	return S_ISREG(inode->i_mode) && JZPFS_SB(inode->i_sb)->csum;
+}
+
 /* file to private Data */
 #define JZPFS_F(file) ((struct jzpfs_file_info *)((file)->private_data))
 
-/* file to lower file */
+/* file to lower file, NULL until jzpfs_open_lower() for regular files */
 static inline struct file *jzpfs_lower_file(const struct file *f)
 {
-	return JZPFS_F(f)->lower_file;
+	return READ_ONCE(JZPFS_F(f)->lower_file);
 }
 
 static inline void jzpfs_set_lower_file(struct file *f, struct file *val)
@@ -110,6 +552,22 @@ static inline void jzpfs_set_lower_file(struct file *f, struct file *val)
 }
 
 /* inode to lower inode. */
+/* 旧格式的大小写变换文件 */
+static inline bool jzpfs_file_transformed(const struct file *f)
+{
+	return test_bit(JZPFS_INODE_LEGACY, &JZPFS_I(file_inode(f))->flags);
+}
+
+/*
+ * open识别过文件头之后，文件格式记在inode上，之后的open不用再打开lower
+ * 读文件头。写到了文件头所在的位置就要重新识别。
+ */
+static inline void jzpfs_hdr_written(struct inode *inode, loff_t pos)
+{
+	if (pos < JZPFS_HDR_SIZE)
+		clear_bit(JZPFS_INODE_HDR_KNOWN, &JZPFS_I(inode)->flags);
+}
+
 static inline struct inode *jzpfs_lower_inode(const struct inode *i)
 {
 	return JZPFS_I(i)->lower_inode;
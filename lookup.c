@@ -51,6 +51,40 @@ int new_dentry_private_data(struct dentry *dentry)
 	return 0;
 }
 
+/*
+ * 给别人也可能拿到的dentry（nfs解码出来的匿名dentry）接上私有数据和
+ * lower路径。并发的解码和lookup可能同时拿到同一个dentry，在d_lock下
+ * 谁先接上算谁的，晚到的放掉自己的lower_path。消耗对lower_path的引用。
+ */
+int jzpfs_d_attach_lower(struct dentry *dentry, struct path *lower_path)
+{
+	struct jzpfs_dentry_info *info;
+
+	if (READ_ONCE(dentry->d_fsdata)) {
+		path_put(lower_path);
+		return 0;
+	}
+	info = kmem_cache_zalloc(jzpfs_dentry_cachep, GFP_KERNEL);
+	if (!info) {
+		path_put(lower_path);
+		return -ENOMEM;
+	}
+	spin_lock_init(&info->lock);
+	pathcpy(&info->lower_path, lower_path);
+
+	spin_lock(&dentry->d_lock);
+	if (!dentry->d_fsdata) {
+		smp_store_release(&dentry->d_fsdata, info);
+		info = NULL;
+	}
+	spin_unlock(&dentry->d_lock);
+	if (info) {
+		path_put(lower_path);
+		kmem_cache_free(jzpfs_dentry_cachep, info);
+	}
+	return 0;
+}
+
 static int jzpfs_inode_test(struct inode *inode, void *candidate_lower_inode)
 {
 	printk(KERN_ALERT "jzpfs_inode_test");
@@ -68,6 +102,26 @@ static int jzpfs_inode_set(struct inode *inode, void *lower_inode)
 	return 0;
 }
 
+/*
+ * 缓存中的inode在上次使用后，lower inode可能被直接修改过（绕过jzpfs），
+ * 命中缓存时如果发现时间戳或大小不一致就重新同步属性。
+ */
+static void jzpfs_refresh_inode(struct inode *inode, struct inode *lower_inode)
+{
+	/* 压缩、去重文件的大小是逻辑大小，和lower的不一样 */
+	bool logical = jzpfs_inode_ext_ops(inode);
+
+	if (timespec_equal(&inode->i_ctime, &lower_inode->i_ctime) &&
+	    timespec_equal(&inode->i_mtime, &lower_inode->i_mtime) &&
+	    (logical || i_size_read(inode) == i_size_read(lower_inode)))
+		return;
+
+	jzpfs_stat_inc(inode->i_sb, JZPFS_STAT_IGET_REFRESH);
+	fsstack_copy_attr_all(inode, lower_inode);
+	if (!logical)
+		fsstack_copy_inode_size(inode, lower_inode);
+}
+
 /*
  * 分配我们新的inode
  */
@@ -94,8 +148,12 @@ struct inode *jzpfs_iget(struct super_block *sb, struct inode *lower_inode)
 		return ERR_PTR(err);
 	}
 	/* if found a cached inode, then just return it */
-	if (!(inode->i_state & I_NEW))
+	if (!(inode->i_state & I_NEW)) {
+		jzpfs_stat_inc(sb, JZPFS_STAT_IGET_HIT);
+		jzpfs_refresh_inode(inode, lower_inode);
 		return inode;
+	}
+	jzpfs_stat_inc(sb, JZPFS_STAT_IGET_MISS);
 
 	/* initialize new inode */
 	info = JZPFS_I(inode);
@@ -184,6 +242,42 @@ out:
 	return err;
 }
 
+/*
+ * lookup专用的interpose：用d_splice_alias代替d_add。nfs句柄解码出来的
+ * 目录可能已经有一个匿名（disconnected）的dentry，这里把它接回树上，
+ * 而不是给同一个目录inode再建一个别名。
+ */
+static struct dentry *jzpfs_lookup_interpose(struct dentry *dentry,
+					     struct path *lower_path)
+{
+	struct inode *inode;
+	struct inode *lower_inode = d_inode(lower_path->dentry);
+	struct dentry *alias;
+	struct path alias_path;
+	int err;
+
+	/* 检查lower的文件系统是否没有穿过安装点 */
+	if (lower_inode->i_sb != jzpfs_lower_super(dentry->d_sb))
+		return ERR_PTR(-EXDEV);
+
+	inode = jzpfs_iget(dentry->d_sb, lower_inode);
+	if (IS_ERR(inode))
+		return ERR_CAST(inode);
+
+	alias = d_splice_alias(inode, dentry);
+	if (IS_ERR_OR_NULL(alias))
+		return alias;
+	/* 接回来的匿名dentry可能还在等解码的人接上lower路径 */
+	pathcpy(&alias_path, lower_path);
+	path_get(&alias_path);
+	err = jzpfs_d_attach_lower(alias, &alias_path);
+	if (err) {
+		dput(alias);
+		return ERR_PTR(err);
+	}
+	return alias;
+}
+
 /*
  * 查找路径
  */
@@ -197,10 +291,9 @@ static struct dentry *__jzpfs_lookup(struct dentry *dentry,
 	struct dentry *lower_dentry;
 	const char *name;
 	struct path lower_path;
-	struct qstr this;
+	struct dentry *ret;
 
-	/* must initialize dentry operations */
-	d_set_d_op(dentry, &jzpfs_dops);
+	/* dentry operations come from sb->s_d_op, set by d_alloc */
 
 	if (IS_ROOT(dentry))
 		goto out;
@@ -216,13 +309,8 @@ static struct dentry *__jzpfs_lookup(struct dentry *dentry,
 			      &lower_path);
 
 	/* no error: handle positive dentries */
-	if (!err) {
-		jzpfs_set_lower_path(dentry, &lower_path);
-		err = jzpfs_interpose(dentry, dentry->d_sb, &lower_path);
-		if (err) /* path_put underlying path on error */
-			jzpfs_put_reset_lower_path(dentry);
-		goto out;
-	}
+	if (!err)
+		goto positive;
 
 	/*
 	 * We don't consider ENOENT an error, and we want to return a
@@ -231,24 +319,22 @@ static struct dentry *__jzpfs_lookup(struct dentry *dentry,
 	if (err && err != -ENOENT)
 		goto out;
 
-	/* instatiate a new negative dentry */
-	this.name = name;
-	this.len = strlen(name);
-	this.hash = full_name_hash(lower_dir_dentry, this.name, this.len);
-	lower_dentry = d_lookup(lower_dir_dentry, &this);
-	if (lower_dentry)
-		goto setup_lower;
-
-	lower_dentry = d_alloc(lower_dir_dentry, &this);
-	if (!lower_dentry) {
-		err = -ENOMEM;
+	/*
+	 * 负的lower dentry也交给lower查：上层的lookup只拿着目录的共享锁，
+	 * 同名的查找可能并行，自己d_alloc、d_add会在lower上加出两个同名
+	 * 的dentry。lookup_one_len_unlocked自己拿lower目录的锁。
+	 */
+	lower_dentry = lookup_one_len_unlocked(name, lower_dir_dentry,
+					       strlen(name));
+	if (IS_ERR(lower_dentry)) {
+		err = PTR_ERR(lower_dentry);
 		goto out;
 	}
-	d_add(lower_dentry, NULL); /* instantiate and hash */
-
-setup_lower:
 	lower_path.dentry = lower_dentry;
 	lower_path.mnt = mntget(lower_dir_mnt);
+	/* 刚好被并发创建出来了，按正的处理 */
+	if (d_really_is_positive(lower_dentry))
+		goto positive;
 	jzpfs_set_lower_path(dentry, &lower_path);
 
 	/*
@@ -261,6 +347,13 @@ setup_lower:
 
 out:
 	return ERR_PTR(err);
+
+positive:
+	jzpfs_set_lower_path(dentry, &lower_path);
+	ret = jzpfs_lookup_interpose(dentry, &lower_path);
+	if (IS_ERR(ret)) /* path_put underlying path on error */
+		jzpfs_put_reset_lower_path(dentry);
+	return ret;
 }
 
 
@@ -279,23 +372,31 @@ struct dentry *jzpfs_lookup(struct inode *dir, struct dentry *dentry,
 
 	jzpfs_get_lower_path(parent, &lower_parent_path);
 
-	/* allocate dentry private data.  We free it in ->d_release */
+	/*
+	 * allocate dentry private data.  We free it in ->d_release.
+	 * 失败返回的dentry也会经过d_release，先分配再做下面的检查。
+	 */
 	err = new_dentry_private_data(dentry);
 	if (err) {
 		ret = ERR_PTR(err);
 		goto out;
 	}
+	/* 元数据目录对用户不可见 */
+	if (jzpfs_is_meta_name(parent, dentry->d_name.name,
+			       dentry->d_name.len)) {
+		ret = ERR_PTR(-ENOENT);
+		goto out;
+	}
+	/* 注入的错误也要在分配之后返回 */
+	err = jzpfs_inject(JZPFS_INJECT_LOOKUP);
+	if (err) {
+		ret = ERR_PTR(err);
+		goto out;
+	}
 	ret = __jzpfs_lookup(dentry, flags, &lower_parent_path);
 	if (IS_ERR(ret))
 		goto out;
-	if (ret)
-		dentry = ret;
-	if (d_inode(dentry))
-		fsstack_copy_attr_times(d_inode(dentry),
-					jzpfs_lower_inode(d_inode(dentry)));
-	/* update parent directory's atime */
-	fsstack_copy_attr_atime(d_inode(parent),
-				jzpfs_lower_inode(d_inode(parent)));
+	/* 时间戳在getattr时才同步，见jzpfs_sync_size */
 
 out:
 	jzpfs_put_lower_path(parent, &lower_parent_path);
@@ -4,6 +4,112 @@
 
 #include "jzpfs.h"
 #include <linux/module.h>
+#include <linux/parser.h>
+
+/* mount传给read_super的数据：下层路径和挂载选项 */
+struct jzpfs_mount_data {
+	const char *dev_name;
+	char *options;
+};
+
+enum {
+	jzpfs_opt_key,
+	jzpfs_opt_csum,
+	jzpfs_opt_compress,
+	jzpfs_opt_dedup,
+	jzpfs_opt_group_commit_delay,
+	jzpfs_opt_group_commit,
+	jzpfs_opt_readdir_prefetch,
+	jzpfs_opt_err,
+};
+
+static const match_table_t jzpfs_tokens = {
+	{jzpfs_opt_key, "key=%s"},
+	{jzpfs_opt_csum, "csum"},
+	{jzpfs_opt_compress, "compress=%s"},
+	{jzpfs_opt_dedup, "dedup"},
+	{jzpfs_opt_group_commit_delay, "group_commit=%u"},
+	{jzpfs_opt_group_commit, "group_commit"},
+	{jzpfs_opt_readdir_prefetch, "readdir_prefetch"},
+	{jzpfs_opt_err, NULL},
+};
+
+/*
+ * 解析挂载选项
+ */
+static int jzpfs_parse_options(struct super_block *sb, char *options)
+{
+	printk(KERN_ALERT "jzpfs_parse_options");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	char *p, *name;
+	int algo, delay;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, jzpfs_tokens, args)) {
+		case jzpfs_opt_key:
+			kfree(sbi->key_desc);
+			sbi->key_desc = match_strdup(&args[0]);
+			if (!sbi->key_desc)
+				return -ENOMEM;
+			break;
+		case jzpfs_opt_csum:
+			sbi->csum = true;
+			break;
+		case jzpfs_opt_compress:
+			name = match_strdup(&args[0]);
+			if (!name)
+				return -ENOMEM;
+			algo = jzpfs_z_algo(name);
+			if (algo < 0)
+				printk(KERN_ERR "jzpfs: compression '%s' is "
+				       "not available\n", name);
+			kfree(name);
+			if (algo < 0)
+				return -EINVAL;
+			sbi->compress = algo;
+			break;
+		case jzpfs_opt_dedup:
+			sbi->dedup = true;
+			break;
+		case jzpfs_opt_group_commit_delay:
+			/* 领头的fsync提交前等多少微秒 */
+			if (match_int(&args[0], &delay) || delay < 0 ||
+			    delay > USEC_PER_SEC)
+				return -EINVAL;
+			sbi->commit_delay = delay;
+			/* fall through */
+		case jzpfs_opt_group_commit:
+			sbi->group_commit = true;
+			break;
+		case jzpfs_opt_readdir_prefetch:
+			sbi->prefetch = true;
+			break;
+		default:
+			printk(KERN_ERR
+			       "jzpfs: unrecognized mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+
+	/* 压缩、去重文件的数据不经过加密，两者也不能叠加 */
+	if ((sbi->compress || sbi->dedup) && sbi->key_desc) {
+		printk(KERN_ERR "jzpfs: compress=/dedup and key= cannot be "
+		       "combined\n");
+		return -EINVAL;
+	}
+	if (sbi->compress && sbi->dedup) {
+		printk(KERN_ERR "jzpfs: compress= and dedup cannot be "
+		       "combined\n");
+		return -EINVAL;
+	}
+	return 0;
+}
 
 /*
  * 读超级块信息
@@ -14,7 +120,8 @@ static int jzpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *) raw_data;
+	struct jzpfs_mount_data *md = raw_data;
+	char *dev_name = (char *) md->dev_name;
 	struct inode *inode;
 
 	if (!dev_name) {
@@ -41,6 +148,29 @@ static int jzpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		goto out_free;
 	}
 
+	/* 元数据目录里的文件以挂载者的身份创建 */
+	JZPFS_SB(sb)->mounter_cred = prepare_creds();
+	if (!JZPFS_SB(sb)->mounter_cred) {
+		err = -ENOMEM;
+		goto out_freesbi;
+	}
+
+	/* 统计计数器要在第一次jzpfs_iget之前准备好 */
+	jzpfs_trace_init_sb(sb);
+	err = jzpfs_sb_stats_init(sb);
+	if (err)
+		goto out_freesbi;
+	jzpfs_qos_init_sb(sb);
+
+	jzpfs_commit_init_sb(sb);
+	err = jzpfs_parse_options(sb, md->options);
+	if (!err)
+		err = jzpfs_crypto_init_sb(sb);
+	if (!err)
+		err = jzpfs_prefetch_init_sb(sb);
+	if (err)
+		goto out_freestats;
+
 	/* 把上层的超级块信息赋给下层数据块 */
 	lower_sb = lower_path.dentry->d_sb;
 	atomic_inc(&lower_sb->s_active);
@@ -49,12 +179,65 @@ static int jzpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	/* 从下层文件系统继承maxbytes */
 	sb->s_maxbytes = lower_sb->s_maxbytes;
 
+	/*
+	 * 默认的noop bdi上fadvise什么都不做、readahead(2)不预读，有了自己
+	 * 的bdi它们才会调到jzpfs_readpages。上层没有脏页，不参与回写。
+	 */
+	err = bdi_setup_and_register(&JZPFS_SB(sb)->bdi, JZPFS_NAME);
+	if (err)
+		goto out_sput;
+	JZPFS_SB(sb)->bdi.ra_pages = lower_sb->s_bdi->ra_pages;
+	JZPFS_SB(sb)->bdi.capabilities = BDI_CAP_NO_ACCT_AND_WRITEBACK;
+	sb->s_bdi = &JZPFS_SB(sb)->bdi;
+
 	/*
 	 * 时间粒度为1
 	 */
 	sb->s_time_gran = 1;
 
 	sb->s_op = &jzpfs_sops;
+	/* nfs解码出来的匿名dentry也要用我们的dentry操作 */
+	sb->s_d_op = &jzpfs_dops;
+	/* 所有xattr都转给lower，见xattr.c */
+	sb->s_xattr = jzpfs_xattr_handlers;
+
+	/* lower能导出时才支持nfs再导出 */
+	if (lower_sb->s_export_op && lower_sb->s_export_op->fh_to_dentry)
+		sb->s_export_op = &jzpfs_export_ops;
+
+	/* 组提交靠lower的sync_fs提交日志 */
+	if (JZPFS_SB(sb)->group_commit && !lower_sb->s_op->sync_fs) {
+		printk(KERN_ERR "jzpfs: group_commit needs a lower filesystem "
+		       "with sync_fs\n");
+		err = -EINVAL;
+		goto out_sput;
+	}
+
+	/* 需要的话在lower根目录下建立隐藏的元数据目录 */
+	if (JZPFS_SB(sb)->csum || JZPFS_SB(sb)->dedup) {
+		err = jzpfs_meta_init(sb, &lower_path);
+		if (err)
+			goto out_sput;
+	}
+	if (JZPFS_SB(sb)->csum) {
+		JZPFS_SB(sb)->csum_dir = jzpfs_meta_subdir(sb, "csum");
+		if (IS_ERR(JZPFS_SB(sb)->csum_dir)) {
+			err = PTR_ERR(JZPFS_SB(sb)->csum_dir);
+			JZPFS_SB(sb)->csum_dir = NULL;
+			goto out_sput;
+		}
+	}
+	if (JZPFS_SB(sb)->dedup) {
+		err = jzpfs_dedup_init_sb(sb);
+		if (err)
+			goto out_sput;
+	}
+	/*
+	 * 整个lower文件系统都在jzpfs下，元数据文件又能靠标记认出来时，
+	 * nfs句柄不用带父目录，见export.c
+	 */
+	JZPFS_SB(sb)->export_flat = lower_path.dentry == lower_sb->s_root &&
+		(!JZPFS_SB(sb)->meta_path.dentry || JZPFS_SB(sb)->meta_marked);
 
 	/* 的到一个新的inode，分配我们自己的根目录项 */
 	inode = jzpfs_iget(sb, d_inode(lower_path.dentry));
@@ -67,7 +250,6 @@ static int jzpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		err = -ENOMEM;
 		goto out_iput;
 	}
-	d_set_d_op(sb->s_root, &jzpfs_dops);
 
 	/* 连接上下的dentry */
 	sb->s_root->d_fsdata = NULL;
@@ -93,8 +275,23 @@ out_freeroot:
 out_iput:
 	iput(inode);
 out_sput:
-	
+	if (sb->s_bdi == &JZPFS_SB(sb)->bdi) {
+		bdi_destroy(&JZPFS_SB(sb)->bdi);
+		sb->s_bdi = &noop_backing_dev_info;
+	}
+	dput(JZPFS_SB(sb)->csum_dir);
+	jzpfs_dedup_exit_sb(sb);
+	jzpfs_meta_exit(sb);
 	atomic_dec(&lower_sb->s_active);
+out_freestats:
+	jzpfs_prefetch_exit_sb(sb);
+	jzpfs_crypto_exit_sb(sb);
+	jzpfs_qos_exit_sb(sb);
+	jzpfs_sb_stats_exit(sb);
+	jzpfs_trace_exit_sb(sb);
+out_freesbi:
+	if (JZPFS_SB(sb)->mounter_cred)
+		put_cred(JZPFS_SB(sb)->mounter_cred);
 	kfree(JZPFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -111,17 +308,30 @@ struct dentry *jzpfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
 	printk(KERN_ALERT "jzpfs_mount");
-	void *lower_path_name = (void *) dev_name;
+	struct jzpfs_mount_data md = {
+		.dev_name	= dev_name,
+		.options	= raw_data,
+	};
 
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   jzpfs_read_super);
+	return mount_nodev(fs_type, flags, &md, jzpfs_read_super);
+}
+
+/*
+ * 后台预取持有dentry的引用，要在generic_shutdown_super拆dcache之前
+ * 做完
+ */
+static void jzpfs_kill_sb(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_kill_sb");
+	jzpfs_prefetch_exit_sb(sb);
+	generic_shutdown_super(sb);
 }
 
 static struct file_system_type jzpfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name			= JZPFS_NAME,
 	.mount		= jzpfs_mount,
-	.kill_sb		= generic_shutdown_super,
+	.kill_sb		= jzpfs_kill_sb,
 	.fs_flags		= 0,
 };
 MODULE_ALIAS_FS(JZPFS_NAME);
@@ -132,10 +342,19 @@ static int __init init_jzpfs_fs(void)
 
 	pr_info("Registering jzpfs " JZPFS_VERSION "\n");
 
+	err = jzpfs_selftest();
+	if (err)
+		return err;
 	err = jzpfs_init_inode_cache();
 	if (err)
 		goto out;
 	err = jzpfs_init_dentry_cache();
+	if (err)
+		goto out;
+	err = jzpfs_init_debugfs();
+	if (err)
+		goto out;
+	err = jzpfs_init_sysfs();
 	if (err)
 		goto out;
 	err = register_filesystem(&jzpfs_fs_type);
@@ -143,6 +362,8 @@ out:
 	if (err) {
 		jzpfs_destroy_inode_cache();
 		jzpfs_destroy_dentry_cache();
+		jzpfs_exit_sysfs();
+		jzpfs_exit_debugfs();
 	}
 	return err;
 }
@@ -152,6 +373,8 @@ static void __exit exit_jzpfs_fs(void)
 	jzpfs_destroy_inode_cache();
 	jzpfs_destroy_dentry_cache();
 	unregister_filesystem(&jzpfs_fs_type);
+	jzpfs_exit_sysfs();
+	jzpfs_exit_debugfs();
 	pr_info("Completed jzpfs module unload\n");
 }
 
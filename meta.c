@@ -0,0 +1,235 @@
+/*
+ * lower根目录下的隐藏元数据目录
+ *
+ * 校验和等jzpfs自己的数据保存在lower根目录的JZPFS_META_DIR下，这个目录
+ * 在jzpfs里不可见（lookup和readdir都会跳过）。里面的文件以挂载者的身份
+ * 创建和访问，和当前进程的权限无关。
+ *
+ * 新建的元数据目录和其中的每个文件都带JZPFS_XATTR_META标记，nfs解码出
+ * 一个disconnected的文件时不用找它的父目录就能认出元数据文件（见
+ * export.c）。新建文件和打标记之间崩溃的话，下次打开这个文件时补上。
+ * 旧版本建的元数据目录没有标记，里面的文件也不打。
+ */
+
+#include "jzpfs.h"
+#include <linux/cred.h>
+
+bool jzpfs_meta_marked(struct dentry *lower_dentry)
+{
+	return __vfs_getxattr(lower_dentry, d_inode(lower_dentry),
+			      JZPFS_XATTR_META, NULL, 0) >= 0;
+}
+
+static int jzpfs_meta_mark(struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	int err;
+
+	inode_lock(inode);
+	err = __vfs_setxattr_noperm(dentry, JZPFS_XATTR_META, "1", 1, 0);
+	inode_unlock(inode);
+	return err;
+}
+
+/*
+ * 在parent下查找name，不存在就按mode创建（目录或普通文件）。mark时
+ * 给新建的目录和没有标记的普通文件打上元数据标记。
+ * 返回带引用的dentry。
+ */
+static struct dentry *jzpfs_meta_lookup_create(struct vfsmount *mnt,
+					       struct dentry *parent,
+					       const char *name, umode_t mode,
+					       bool create, bool mark)
+{
+	struct inode *dir = d_inode(parent);
+	struct dentry *dentry;
+	int err = 0;
+
+	if (create) {
+		err = mnt_want_write(mnt);
+		if (err)
+			return ERR_PTR(err);
+	}
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, parent, strlen(name));
+	if (IS_ERR(dentry))
+		goto out;
+
+	if (d_really_is_negative(dentry)) {
+		if (!create)
+			err = -ENOENT;
+		else if (S_ISDIR(mode))
+			err = vfs_mkdir(dir, dentry, mode);
+		else
+			err = vfs_create(dir, dentry, mode, true);
+		/* some filesystems leave the new dentry unhashed/negative */
+		if (!err && d_really_is_negative(dentry))
+			err = -ENOENT;
+		if (!err && mark) {
+			err = jzpfs_meta_mark(dentry);
+			/* 不支持xattr的lower上目录就不打标记 */
+			if (err == -EOPNOTSUPP && S_ISDIR(mode))
+				err = 0;
+		}
+	} else if ((d_inode(dentry)->i_mode ^ mode) & S_IFMT) {
+		err = -EEXIST;
+	} else if (mark && S_ISREG(mode) && !jzpfs_meta_marked(dentry)) {
+		err = jzpfs_meta_mark(dentry);
+	}
+	if (err) {
+		dput(dentry);
+		dentry = ERR_PTR(err);
+	}
+out:
+	inode_unlock(dir);
+	if (create)
+		mnt_drop_write(mnt);
+	return dentry;
+}
+
+/*
+ * 打开（或创建）元数据目录dir下的文件
+ */
+struct file *jzpfs_meta_open(struct super_block *sb, struct dentry *dir,
+			     const char *name, bool create)
+{
+	printk(KERN_ALERT "jzpfs_meta_open");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	const struct cred *old_cred;
+	struct path path;
+	struct file *file;
+
+	old_cred = override_creds(sbi->mounter_cred);
+	path.dentry = jzpfs_meta_lookup_create(sbi->meta_path.mnt, dir, name,
+					       S_IFREG | 0600, create,
+					       sbi->meta_marked);
+	if (IS_ERR(path.dentry)) {
+		file = ERR_CAST(path.dentry);
+		goto out;
+	}
+	path.mnt = sbi->meta_path.mnt;
+	file = dentry_open(&path, O_RDWR | O_LARGEFILE, current_cred());
+	dput(path.dentry);
+out:
+	revert_creds(old_cred);
+	return file;
+}
+
+/*
+ * 删除元数据目录dir下的文件，不存在不算错误
+ */
+int jzpfs_meta_unlink(struct super_block *sb, struct dentry *dir,
+		      const char *name)
+{
+	printk(KERN_ALERT "jzpfs_meta_unlink");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	const struct cred *old_cred;
+	struct dentry *dentry;
+	int err;
+
+	old_cred = override_creds(sbi->mounter_cred);
+	err = mnt_want_write(sbi->meta_path.mnt);
+	if (err)
+		goto out;
+
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir, strlen(name));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+	} else {
+		if (d_really_is_positive(dentry))
+			err = vfs_unlink(d_inode(dir), dentry, NULL);
+		dput(dentry);
+	}
+	inode_unlock(d_inode(dir));
+	mnt_drop_write(sbi->meta_path.mnt);
+out:
+	revert_creds(old_cred);
+	return err;
+}
+
+/*
+ * 以挂载者身份截断元数据文件
+ */
+int jzpfs_meta_truncate(struct super_block *sb, struct file *file,
+			loff_t length)
+{
+	const struct cred *old_cred;
+	int err;
+
+	old_cred = override_creds(JZPFS_SB(sb)->mounter_cred);
+	err = vfs_truncate(&file->f_path, length);
+	revert_creds(old_cred);
+	return err;
+}
+
+/*
+ * 取得（或创建）元数据目录下的子目录
+ */
+struct dentry *jzpfs_meta_subdir(struct super_block *sb, const char *name)
+{
+	printk(KERN_ALERT "jzpfs_meta_subdir");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	const struct cred *old_cred;
+	struct dentry *dentry;
+
+	old_cred = override_creds(sbi->mounter_cred);
+	dentry = jzpfs_meta_lookup_create(sbi->meta_path.mnt,
+					  sbi->meta_path.dentry, name,
+					  S_IFDIR | 0700, true, false);
+	revert_creds(old_cred);
+	return dentry;
+}
+
+/*
+ * 挂载时建立lower根目录下的元数据目录
+ */
+int jzpfs_meta_init(struct super_block *sb, struct path *lower_root)
+{
+	printk(KERN_ALERT "jzpfs_meta_init");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	const struct cred *old_cred;
+	struct dentry *dentry;
+
+	old_cred = override_creds(sbi->mounter_cred);
+	dentry = jzpfs_meta_lookup_create(lower_root->mnt, lower_root->dentry,
+					  JZPFS_META_DIR, S_IFDIR | 0700,
+					  true, true);
+	revert_creds(old_cred);
+	if (IS_ERR(dentry)) {
+		printk(KERN_ERR "jzpfs: cannot create %s in lower root: %ld\n",
+		       JZPFS_META_DIR, PTR_ERR(dentry));
+		return PTR_ERR(dentry);
+	}
+
+	sbi->meta_path.dentry = dentry;
+	sbi->meta_path.mnt = mntget(lower_root->mnt);
+	/* lower不支持xattr时没有标记，nfs句柄只能带父目录 */
+	sbi->meta_marked = jzpfs_meta_marked(dentry);
+	return 0;
+}
+
+void jzpfs_meta_exit(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_meta_exit");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+
+	if (sbi->meta_path.dentry)
+		path_put(&sbi->meta_path);
+	sbi->meta_path.dentry = NULL;
+	sbi->meta_path.mnt = NULL;
+}
+
+/*
+ * 元数据目录只在jzpfs根目录下隐藏
+ */
+bool jzpfs_is_meta_name(struct dentry *parent, const char *name, int len)
+{
+	if (!JZPFS_SB(parent->d_sb)->meta_path.dentry)
+		return false;
+	if (parent != parent->d_sb->s_root)
+		return false;
+	return len == sizeof(JZPFS_META_DIR) - 1 &&
+	       !memcmp(name, JZPFS_META_DIR, len);
+}
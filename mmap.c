@@ -30,6 +30,8 @@ static int jzpfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	 */
 	lower_vma.vm_file = lower_file;
 	err = lower_vm_ops->fault(&lower_vma, vmf);
+	if (!(err & VM_FAULT_ERROR))
+		jzpfs_heat_add(file_inode(file), false, PAGE_SIZE);
 	return err;
 }
 
@@ -63,6 +65,8 @@ static int jzpfs_page_mkwrite(struct vm_area_struct *vma,
 	 */
 	lower_vma.vm_file = lower_file;
 	err = lower_vm_ops->page_mkwrite(&lower_vma, vmf);
+	if (!(err & VM_FAULT_ERROR))
+		jzpfs_heat_add(file_inode(file), true, PAGE_SIZE);
 out:
 	return err;
 }
@@ -79,7 +83,59 @@ static ssize_t jzpfs_direct_IO(struct kiocb *iocb,
 	return -EINVAL;
 }
 
+/*
+ * fadvise(WILLNEED)和readahead(2)在上层mapping上预读，最后调到这里。
+ * 上层不缓存数据（读写都经过lower），这些页不填，read_pages会放掉；
+ * 把对应的范围换算成lower的偏移，让lower去预读，之后的读就命中lower
+ * 的页缓存。旧格式和加密文件上下偏移相同；压缩、去重文件按extent换算，
+ * 去重文件只预读映射，块仓库里的块读的时候才取。
+ */
+static int jzpfs_readpages(struct file *file, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	const struct jzpfs_ext_ops *ops;
+	struct file_ra_state ra = { };
+	struct file *lower_file;
+	pgoff_t first = ULONG_MAX, last = 0;
+	loff_t start, end;
+	struct page *page;
+
+	if (!file || !S_ISREG(inode->i_mode))
+		return 0;
+	list_for_each_entry(page, pages, lru) {
+		first = min(first, page->index);
+		last = max(last, page->index);
+	}
+	if (first > last)
+		return 0;
+
+	lower_file = jzpfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return 0;
+
+	start = (loff_t)first << PAGE_SHIFT;
+	end = (loff_t)(last + 1) << PAGE_SHIFT;
+	ops = jzpfs_inode_ext_ops(inode);
+	if (ops) {
+		start = ops->lower_size(start >> JZPFS_EXT_SHIFT);
+		end = ops->lower_size(DIV_ROUND_UP(end, JZPFS_EXT_SIZE));
+	}
+	end = min(end, i_size_read(file_inode(lower_file)));
+	if (end <= start)
+		return 0;
+
+	first = start >> PAGE_SHIFT;
+	ra.ra_pages = DIV_ROUND_UP(end, PAGE_SIZE) - first;
+	ra.prev_pos = -1;
+	page_cache_sync_readahead(lower_file->f_mapping, &ra, lower_file,
+				  first, ra.ra_pages);
+	jzpfs_stat_add(inode->i_sb, JZPFS_STAT_READAHEAD, ra.ra_pages);
+	return 0;
+}
+
 const struct address_space_operations jzpfs_aops = {
+	.readpages = jzpfs_readpages,
 	.direct_IO = jzpfs_direct_IO,
 };
 
@@ -0,0 +1,164 @@
+/*
+ * readdir之后的后台预取（readdir_prefetch挂载选项）
+ *
+ * ls -l和构建系统扫描目录时，readdir之后紧跟着对每一项的stat，每一项
+ * 都要走一遍jzpfs_lookup、lower的lookup、jzpfs_iget和lower的getattr，
+ * 一个接一个。打开预取后，readdir把返回给调用者的名字按批交给这个挂载
+ * 点的工作队列，工作线程以readdir调用者的身份提前做lookup，建立jzpfs
+ * 的dentry和inode，并对lower做一次getattr（lower是网络文件系统时会
+ * 刷新它的属性缓存），调用者的stat多半直接命中dcache。
+ *
+ * 队列有上限：排队的批次超过JZPFS_PREFETCH_MAX_BATCHES时，这次readdir
+ * 剩下的名字不再预取，只计入prefetch_dropped。预取只是提前做了调用者
+ * 接下来自己会做的事，失败了不影响任何结果。
+ */
+
+#include "jzpfs.h"
+
+#define JZPFS_PREFETCH_BUF		2048	/* bytes of names per batch */
+#define JZPFS_PREFETCH_MAX_BATCHES	64	/* queued per mount */
+
+/* 一批名字，每个名字前面一个字节的长度 */
+struct jzpfs_prefetch {
+	struct work_struct work;
+	struct dentry *dir;
+	const struct cred *cred;
+	size_t used;
+	u8 names[JZPFS_PREFETCH_BUF];
+};
+
+/* 已经在dcache里的就不用再查了 */
+static void jzpfs_prefetch_one(struct dentry *dir, const char *name, int len)
+{
+	struct qstr this = QSTR_INIT(name, len);
+	struct dentry *dentry;
+	struct path lower_path;
+	struct kstat stat;
+
+	dentry = d_hash_and_lookup(dir, &this);
+	if (dentry) {
+		dput(dentry);
+		return;
+	}
+	dentry = lookup_one_len_unlocked(name, dir, len);
+	if (IS_ERR(dentry))
+		return;
+	if (d_really_is_positive(dentry)) {
+		jzpfs_get_lower_path(dentry, &lower_path);
+		if (!vfs_getattr(&lower_path, &stat))
+			fsstack_copy_attr_all(d_inode(dentry),
+					      d_inode(lower_path.dentry));
+		jzpfs_put_lower_path(dentry, &lower_path);
+		jzpfs_stat_inc(dir->d_sb, JZPFS_STAT_PREFETCH);
+	}
+	dput(dentry);
+}
+
+static void jzpfs_prefetch_work(struct work_struct *work)
+{
+	struct jzpfs_prefetch *pf = container_of(work, struct jzpfs_prefetch,
+						 work);
+	struct super_block *sb = pf->dir->d_sb;
+	const struct cred *old_cred;
+	size_t pos = 0;
+	int len;
+
+	old_cred = override_creds(pf->cred);
+	while (pos < pf->used) {
+		len = pf->names[pos++];
+		jzpfs_prefetch_one(pf->dir, (const char *)&pf->names[pos], len);
+		pos += len;
+		cond_resched();
+	}
+	revert_creds(old_cred);
+
+	put_cred(pf->cred);
+	dput(pf->dir);
+	kfree(pf);
+	atomic_dec(&JZPFS_SB(sb)->prefetch_queued);
+}
+
+/* 把收集好的一批交给工作队列 */
+void jzpfs_prefetch_submit(struct jzpfs_prefetch **ppf)
+{
+	struct jzpfs_prefetch *pf = *ppf;
+
+	*ppf = NULL;
+	if (IS_ERR_OR_NULL(pf))
+		return;
+	INIT_WORK(&pf->work, jzpfs_prefetch_work);
+	queue_work(JZPFS_SB(pf->dir->d_sb)->prefetch_wq, &pf->work);
+}
+
+/*
+ * readdir每返回一个名字调用一次。*ppf是正在收集的一批，满了就提交再
+ * 开一批；队列满了置成ERR_PTR，这次readdir剩下的名字都不再预取。
+ */
+void jzpfs_prefetch_add(struct jzpfs_prefetch **ppf, struct dentry *dir,
+			const char *name, int len)
+{
+	struct jzpfs_sb_info *sbi = JZPFS_SB(dir->d_sb);
+	struct jzpfs_prefetch *pf = *ppf;
+
+	if (name[0] == '.' &&
+	    (len == 1 || (len == 2 && name[1] == '.')))
+		return;
+	if (IS_ERR(pf) || len > U8_MAX)
+		goto dropped;
+	if (pf && pf->used + 1 + len > JZPFS_PREFETCH_BUF) {
+		jzpfs_prefetch_submit(ppf);
+		pf = NULL;
+	}
+	if (!pf) {
+		if (atomic_inc_return(&sbi->prefetch_queued) >
+		    JZPFS_PREFETCH_MAX_BATCHES) {
+			atomic_dec(&sbi->prefetch_queued);
+			*ppf = ERR_PTR(-EBUSY);
+			goto dropped;
+		}
+		pf = kmalloc(sizeof(*pf), GFP_KERNEL | __GFP_NOWARN);
+		if (!pf) {
+			atomic_dec(&sbi->prefetch_queued);
+			*ppf = ERR_PTR(-ENOMEM);
+			goto dropped;
+		}
+		pf->dir = dget(dir);
+		pf->cred = get_current_cred();
+		pf->used = 0;
+		*ppf = pf;
+	}
+	pf->names[pf->used++] = len;
+	memcpy(&pf->names[pf->used], name, len);
+	pf->used += len;
+	return;
+
+dropped:
+	jzpfs_stat_inc(dir->d_sb, JZPFS_STAT_PREFETCH_DROPPED);
+}
+
+int jzpfs_prefetch_init_sb(struct super_block *sb)
+{
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+
+	atomic_set(&sbi->prefetch_queued, 0);
+	if (!sbi->prefetch)
+		return 0;
+	sbi->prefetch_wq = alloc_workqueue("jzpfs-prefetch", WQ_UNBOUND, 0);
+	if (!sbi->prefetch_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * 排队的批次持有目录dentry的引用，要在拆dcache（generic_shutdown_super）
+ * 之前做完
+ */
+void jzpfs_prefetch_exit_sb(struct super_block *sb)
+{
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+
+	if (!sbi || !sbi->prefetch_wq)
+		return;
+	destroy_workqueue(sbi->prefetch_wq);
+	sbi->prefetch_wq = NULL;
+}
@@ -0,0 +1,275 @@
+/*
+ * 按uid限制带宽和IOPS
+ *
+ * 每个挂载点一组规则，通过sysfs配置：
+ *
+ *   /sys/fs/jzpfs/<major:minor>/qos
+ *
+ * 写入"<uid> <字节每秒> <IOPS>"增加或修改一条规则，0表示这一项不限；
+ * 两项都是0删除规则。读出当前的规则和每条规则累计推迟的毫秒数。
+ *
+ * 每条规则两个令牌桶（字节和次数），读、写在做I/O之前按请求的长度扣
+ * 令牌，fsync算一次I/O。令牌不够时不报错，而是欠着，调用者睡到欠账还清
+ * 为止，超额的请求只是被推迟。桶最多攒100ms的量，空闲一阵之后的突发
+ * 也不会压垮lower。没有规则时只多一次读指针。
+ *
+ * 扣的是上层请求的字节数：旧格式和加密文件变换前后长度相同；压缩、去重
+ * 文件在lower上的实际字节数要I/O之后才知道，不按它算。
+ */
+
+#include "jzpfs.h"
+#include <linux/hrtimer.h>
+
+#define JZPFS_QOS_BURST_DIV	10		/* bucket holds 1/10 s */
+#define JZPFS_QOS_MAX_RATE	(16ULL << 30)	/* keeps rate * NSEC in u64 */
+#define JZPFS_QOS_MAX_RULES	1024
+
+struct jzpfs_bucket {
+	u64 rate;		/* per second, 0 = unlimited */
+	s64 tokens;		/* negative: debt to sleep off */
+	u64 last;		/* ktime_get_ns() of the last refill */
+};
+
+struct jzpfs_qos_rule {
+	struct hlist_node node;	/* on jzpfs_sb_info.qos_rules, RCU */
+	kuid_t uid;
+	spinlock_t lock;	/* protects the buckets */
+	struct jzpfs_bucket bytes, ios;
+	atomic64_t delayed_ns;
+	struct rcu_head rcu;
+};
+
+/* /sys/fs/jzpfs */
+static struct kset *jzpfs_kset;
+
+static void jzpfs_bucket_reset(struct jzpfs_bucket *b, u64 rate, u64 now)
+{
+	b->rate = rate;
+	b->tokens = max_t(u64, rate / JZPFS_QOS_BURST_DIV, 1);
+	b->last = now;
+}
+
+/* 先补令牌再扣，返回要睡多少纳秒才能还清欠账 */
+static u64 jzpfs_bucket_charge(struct jzpfs_bucket *b, u64 amount, u64 now)
+{
+	s64 burst = max_t(u64, b->rate / JZPFS_QOS_BURST_DIV, 1);
+	u64 elapsed;
+
+	if (!b->rate)
+		return 0;
+	elapsed = min_t(u64, now - b->last, NSEC_PER_SEC);
+	b->last = now;
+	b->tokens = min_t(s64, b->tokens +
+			  div64_u64(elapsed * b->rate, NSEC_PER_SEC), burst);
+	b->tokens -= amount;
+	if (b->tokens >= 0)
+		return 0;
+	return div64_u64((u64)-b->tokens * NSEC_PER_SEC, b->rate);
+}
+
+static struct jzpfs_qos_rule *jzpfs_qos_find(struct jzpfs_sb_info *sbi,
+					    kuid_t uid)
+{
+	struct jzpfs_qos_rule *r;
+
+	hlist_for_each_entry_rcu(r, &sbi->qos_rules, node)
+		if (uid_eq(r->uid, uid))
+			return r;
+	return NULL;
+}
+
+/*
+ * 读写之前调用，bytes为0的是fsync这类只算次数的操作
+ */
+void jzpfs_qos_throttle(struct super_block *sb, size_t bytes)
+{
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct jzpfs_qos_rule *r;
+	u64 now, delay = 0;
+	ktime_t kt;
+
+	if (hlist_empty(&sbi->qos_rules))
+		return;
+
+	rcu_read_lock();
+	r = jzpfs_qos_find(sbi, current_fsuid());
+	if (r) {
+		now = ktime_get_ns();
+		spin_lock(&r->lock);
+		delay = max(jzpfs_bucket_charge(&r->bytes, bytes, now),
+			    jzpfs_bucket_charge(&r->ios, 1, now));
+		spin_unlock(&r->lock);
+		if (delay)
+			atomic64_add(delay, &r->delayed_ns);
+	}
+	rcu_read_unlock();
+	if (!delay)
+		return;
+
+	jzpfs_stat_inc(sb, JZPFS_STAT_QOS_DELAYED);
+	jzpfs_stat_add(sb, JZPFS_STAT_QOS_DELAY_US, div_u64(delay, NSEC_PER_USEC));
+	/* 被kill了就不等了，让进程尽快退出 */
+	kt = ns_to_ktime(delay);
+	set_current_state(TASK_KILLABLE);
+	schedule_hrtimeout(&kt, HRTIMER_MODE_REL);
+}
+
+static ssize_t jzpfs_qos_show(struct kobject *kobj,
+			      struct kobj_attribute *attr, char *buf)
+{
+	struct jzpfs_sb_info *sbi = container_of(kobj, struct jzpfs_sb_info,
+						 kobj);
+	struct jzpfs_qos_rule *r;
+	ssize_t len = 0;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(r, &sbi->qos_rules, node)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%u %llu %llu %llu\n",
+				 from_kuid_munged(current_user_ns(), r->uid),
+				 r->bytes.rate, r->ios.rate,
+				 div_u64(atomic64_read(&r->delayed_ns),
+					 NSEC_PER_MSEC));
+	rcu_read_unlock();
+	return len;
+}
+
+static ssize_t jzpfs_qos_store(struct kobject *kobj,
+			       struct kobj_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct jzpfs_sb_info *sbi = container_of(kobj, struct jzpfs_sb_info,
+						 kobj);
+	struct jzpfs_qos_rule *r, *new = NULL;
+	unsigned long long bps, iops;
+	u64 now = ktime_get_ns();
+	unsigned int id;
+	kuid_t uid;
+
+	if (sscanf(buf, "%u %llu %llu", &id, &bps, &iops) != 3)
+		return -EINVAL;
+	uid = make_kuid(current_user_ns(), id);
+	if (!uid_valid(uid) || bps > JZPFS_QOS_MAX_RATE ||
+	    iops > JZPFS_QOS_MAX_RATE)
+		return -EINVAL;
+	if (bps || iops) {
+		new = kzalloc(sizeof(*new), GFP_KERNEL);
+		if (!new)
+			return -ENOMEM;
+		new->uid = uid;
+		spin_lock_init(&new->lock);
+		jzpfs_bucket_reset(&new->bytes, bps, now);
+		jzpfs_bucket_reset(&new->ios, iops, now);
+	}
+
+	spin_lock(&sbi->qos_lock);
+	r = jzpfs_qos_find(sbi, uid);
+	if (r && new) {
+		/* 改已有的规则：换速率，桶重新装满 */
+		spin_lock(&r->lock);
+		r->bytes = new->bytes;
+		r->ios = new->ios;
+		spin_unlock(&r->lock);
+	} else if (r) {
+		hlist_del_rcu(&r->node);
+		sbi->qos_nr_rules--;
+		kfree_rcu(r, rcu);
+	} else if (new) {
+		if (sbi->qos_nr_rules >= JZPFS_QOS_MAX_RULES) {
+			spin_unlock(&sbi->qos_lock);
+			kfree(new);
+			return -ENOSPC;
+		}
+		hlist_add_head_rcu(&new->node, &sbi->qos_rules);
+		sbi->qos_nr_rules++;
+		new = NULL;
+	}
+	spin_unlock(&sbi->qos_lock);
+	kfree(new);
+	return count;
+}
+
+static struct kobj_attribute jzpfs_qos_attr =
+	__ATTR(qos, S_IRUGO | S_IWUSR, jzpfs_qos_show, jzpfs_qos_store);
+
+static struct attribute *jzpfs_sb_attrs[] = {
+	&jzpfs_qos_attr.attr,
+	NULL,
+};
+
+static void jzpfs_sb_kobj_release(struct kobject *kobj)
+{
+	struct jzpfs_sb_info *sbi = container_of(kobj, struct jzpfs_sb_info,
+						 kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static struct kobj_type jzpfs_sb_ktype = {
+	.default_attrs	= jzpfs_sb_attrs,
+	.sysfs_ops	= &kobj_sysfs_ops,
+	.release	= jzpfs_sb_kobj_release,
+};
+
+/*
+ * 每个挂载点在/sys/fs/jzpfs下建一个目录。sysfs不可用时不能配置限速，
+ * 但挂载照常。
+ */
+void jzpfs_qos_init_sb(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_qos_init_sb");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	int err;
+
+	spin_lock_init(&sbi->qos_lock);
+	INIT_HLIST_HEAD(&sbi->qos_rules);
+	if (!jzpfs_kset)
+		return;
+
+	init_completion(&sbi->kobj_unregister);
+	sbi->kobj.kset = jzpfs_kset;
+	err = kobject_init_and_add(&sbi->kobj, &jzpfs_sb_ktype, NULL,
+				   "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+	if (err) {
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+		return;
+	}
+	sbi->kobj_added = true;
+}
+
+void jzpfs_qos_exit_sb(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_qos_exit_sb");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct jzpfs_qos_rule *r;
+	struct hlist_node *tmp;
+
+	/* 等sysfs里正在进行的读写结束，之后规则不会再变 */
+	if (sbi->kobj_added) {
+		kobject_del(&sbi->kobj);
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+		sbi->kobj_added = false;
+	}
+	hlist_for_each_entry_safe(r, tmp, &sbi->qos_rules, node) {
+		hlist_del(&r->node);
+		kfree(r);
+	}
+}
+
+int jzpfs_init_sysfs(void)
+{
+	printk(KERN_ALERT "jzpfs_init_sysfs");
+	jzpfs_kset = kset_create_and_add(JZPFS_NAME, NULL, fs_kobj);
+	/* 和debugfs一样，没有也能正常工作 */
+	return 0;
+}
+
+void jzpfs_exit_sysfs(void)
+{
+	printk(KERN_ALERT "jzpfs_exit_sysfs");
+	if (jzpfs_kset)
+		kset_unregister(jzpfs_kset);
+	jzpfs_kset = NULL;
+}
@@ -0,0 +1,113 @@
+/*
+ * 文件内的范围锁
+ *
+ * 变换过的文件（加密、旧格式）和打开了校验和的文件，写要把数据变换后
+ * 写到lower再更新校验和，这期间不能有别的写或校验插进同一段数据。
+ * 以前整个写都拿i_rwsem独占锁，同一个文件的写完全串行；现在写只拿
+ * i_rwsem的共享锁（截断等还是独占的），再按写的范围拿范围锁，不重叠的
+ * 写可以同时变换。
+ *
+ * 范围按JZPFS_CSUM_BLOCK对齐，同一块的校验和只会被一个写更新。每个inode
+ * 一棵区间树，记着所有持有的范围；有冲突的就在inode的等待队列上等。
+ */
+
+#include "jzpfs.h"
+#include <linux/interval_tree_generic.h>
+
+#define JZPFS_RANGE_START(r)	((r)->start)
+#define JZPFS_RANGE_LAST(r)	((r)->last)
+
+INTERVAL_TREE_DEFINE(struct jzpfs_range, rb, loff_t, subtree_last,
+		     JZPFS_RANGE_START, JZPFS_RANGE_LAST,
+		     static, jzpfs_range_tree)
+
+/* 读和读不冲突，其他重叠的都冲突 */
+static bool jzpfs_range_conflict(struct jzpfs_inode_info *info,
+				 struct jzpfs_range *r)
+{
+	struct jzpfs_range *n;
+
+	for (n = jzpfs_range_tree_iter_first(&info->ranges, r->start, r->last);
+	     n; n = jzpfs_range_tree_iter_next(n, r->start, r->last))
+		if (r->write || n->write)
+			return true;
+	return false;
+}
+
+static bool jzpfs_range_trylock(struct jzpfs_inode_info *info,
+				struct jzpfs_range *r)
+{
+	bool ok;
+
+	spin_lock(&info->range_lock);
+	ok = !jzpfs_range_conflict(info, r);
+	if (ok)
+		jzpfs_range_tree_insert(r, &info->ranges);
+	spin_unlock(&info->range_lock);
+	return ok;
+}
+
+/*
+ * 锁住[start, end)，end为LLONG_MAX表示到无穷远
+ */
+void jzpfs_range_lock(struct inode *inode, struct jzpfs_range *r,
+		      loff_t start, loff_t end, bool write)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+
+	r->start = round_down(start, JZPFS_CSUM_BLOCK);
+	if (end >= LLONG_MAX - JZPFS_CSUM_BLOCK)
+		r->last = LLONG_MAX;
+	else
+		r->last = round_up(max(end, start + 1), JZPFS_CSUM_BLOCK) - 1;
+	r->write = write;
+
+	if (jzpfs_range_trylock(info, r))
+		return;
+	jzpfs_stat_inc(inode->i_sb, JZPFS_STAT_RANGE_WAIT);
+	wait_event(info->range_wait, jzpfs_range_trylock(info, r));
+}
+
+void jzpfs_range_unlock(struct inode *inode, struct jzpfs_range *r)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+
+	spin_lock(&info->range_lock);
+	jzpfs_range_tree_remove(r, &info->ranges);
+	spin_unlock(&info->range_lock);
+	wake_up_all(&info->range_wait);
+}
+
+/*
+ * 写之前拿锁，返回写入位置。写到文件尾之后（包括O_APPEND）的写锁到
+ * 无穷远：文件尾的位置、加密文件要填的空洞和最后一块的校验和都跟文件
+ * 大小有关。没扩展文件的写只锁自己写的范围，i_rwsem的共享锁挡住了
+ * 截断，文件只会变大，不会变成扩展的写。
+ */
+loff_t jzpfs_write_lock(struct inode *inode, struct file *lower_file,
+			struct jzpfs_range *r, loff_t pos, size_t count,
+			bool append)
+{
+	struct inode *lower_inode = file_inode(lower_file);
+	loff_t size;
+
+	inode_lock_shared(inode);
+	size = i_size_read(lower_inode);
+	if (append)
+		pos = size;
+	if (pos + count <= size) {
+		jzpfs_range_lock(inode, r, pos, pos + count, true);
+		return pos;
+	}
+	jzpfs_range_lock(inode, r, min(pos, size), LLONG_MAX, true);
+	/* 等锁的时候前面的追加写可能已经把文件写长了 */
+	if (append)
+		pos = i_size_read(lower_inode);
+	return pos;
+}
+
+void jzpfs_write_unlock(struct inode *inode, struct jzpfs_range *r)
+{
+	jzpfs_range_unlock(inode, r);
+	inode_unlock_shared(inode);
+}
@@ -0,0 +1,221 @@
+/*
+ * 加载模块时的自检
+ *
+ * 默认不编译，make SELFTEST=1才有。init_jzpfs_fs最先调用，检查
+ * transform.c里不依赖挂载的函数：
+ *
+ *   - 旧格式变换对所有字节值的结果，以及encode/decode互逆
+ *   - buf跨过文件头（pos 0..JZPFS_HDR_SIZE+2）时只变换文件头之后的部分
+ *   - 同一段数据一次变换和任意切成几段分别变换结果相同
+ *   - 各种魔数和长度的文件头识别
+ *
+ * 有一项不对就打印出来，模块加载失败。全部通过后测一遍不同缓冲区大小
+ * 的变换吞吐，结果在dmesg里。
+ */
+
+#include "jzpfs.h"
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+
+#define JZPFS_SELFTEST_LEN	(1 << 20)
+#define JZPFS_SELFTEST_ROUNDS	64	/* per buffer size, 64 MiB */
+
+static int jzpfs_selftest_failed;
+
+#define ST_CHECK(cond, fmt, ...)					\
+	do {								\
+		if (!(cond)) {						\
+			pr_err("jzpfs: selftest: " fmt "\n", ##__VA_ARGS__); \
+			jzpfs_selftest_failed++;			\
+		}							\
+	} while (0)
+
+static u8 jzpfs_case_up(u8 c)
+{
+	return c >= 'a' && c <= 'z' ? c - 32 : c;
+}
+
+static u8 jzpfs_case_low(u8 c)
+{
+	return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+/* 所有字节值，文件头之后 */
+static void jzpfs_selftest_bytes(void)
+{
+	u8 buf[256];
+	int i;
+
+	for (i = 0; i < 256; i++)
+		buf[i] = i;
+	jzpfs_case_encode(buf, sizeof(buf), JZPFS_HDR_SIZE);
+	for (i = 0; i < 256; i++)
+		ST_CHECK(buf[i] == jzpfs_case_up(i),
+			 "case_encode(0x%02x) = 0x%02x", i, buf[i]);
+
+	for (i = 0; i < 256; i++)
+		buf[i] = i;
+	jzpfs_case_decode(buf, sizeof(buf), JZPFS_HDR_SIZE);
+	for (i = 0; i < 256; i++)
+		ST_CHECK(buf[i] == jzpfs_case_low(i),
+			 "case_decode(0x%02x) = 0x%02x", i, buf[i]);
+
+	/* 没有大写字母的数据变换后能还原 */
+	for (i = 0; i < 256; i++)
+		buf[i] = jzpfs_case_low(i);
+	jzpfs_case_encode(buf, sizeof(buf), 4096);
+	jzpfs_case_decode(buf, sizeof(buf), 4096);
+	for (i = 0; i < 256; i++)
+		ST_CHECK(buf[i] == jzpfs_case_low(i),
+			 "round trip of 0x%02x gave 0x%02x", i, buf[i]);
+}
+
+/* buf从pos开始，长度len，前面落在文件头里的部分不能动 */
+static void jzpfs_selftest_header(void)
+{
+	u8 buf[8];
+	loff_t pos;
+	size_t len, i, skip;
+
+	for (pos = 0; pos <= JZPFS_HDR_SIZE + 2; pos++) {
+		for (len = 0; len <= sizeof(buf); len++) {
+			skip = pos < JZPFS_HDR_SIZE ?
+			       min_t(size_t, len, JZPFS_HDR_SIZE - pos) : 0;
+
+			memset(buf, 'a', sizeof(buf));
+			jzpfs_case_encode(buf, len, pos);
+			for (i = 0; i < sizeof(buf); i++)
+				ST_CHECK(buf[i] == (i >= skip && i < len ?
+						    'A' : 'a'),
+					 "case_encode pos %lld len %zu: byte %zu is '%c'",
+					 pos, len, i, buf[i]);
+
+			memset(buf, 'A', sizeof(buf));
+			jzpfs_case_decode(buf, len, pos);
+			for (i = 0; i < sizeof(buf); i++)
+				ST_CHECK(buf[i] == (i >= skip && i < len ?
+						    'a' : 'A'),
+					 "case_decode pos %lld len %zu: byte %zu is '%c'",
+					 pos, len, i, buf[i]);
+		}
+	}
+}
+
+/* 一次变换和切成几段变换一样，读写路径按页或者按用户缓冲区切 */
+static void jzpfs_selftest_split(u8 *buf, u8 *ref)
+{
+	static const size_t splits[] = { 1, 2, 3, 5, 511, 4095, 4096, 4097 };
+	const size_t len = 3 * 4096 + 17;
+	size_t i, off, n;
+	loff_t pos;
+
+	for (i = 0; i < len; i++)
+		ref[i] = "jZ.pf s\n"[i % 8] + (i / 8) % 3;
+
+	for (pos = 0; pos <= JZPFS_HDR_SIZE + 1; pos++) {
+		for (i = 0; i < ARRAY_SIZE(splits); i++) {
+			memcpy(buf, ref, len);
+			for (off = 0; off < len; off += n) {
+				n = min(splits[i], len - off);
+				jzpfs_case_encode(buf + off, n, pos + off);
+			}
+			memcpy(buf + len, ref, len);
+			jzpfs_case_encode(buf + len, len, pos);
+			ST_CHECK(!memcmp(buf, buf + len, len),
+				 "case_encode split %zu at pos %lld differs",
+				 splits[i], pos);
+		}
+	}
+}
+
+static void jzpfs_selftest_hdr_type(void)
+{
+	static const struct {
+		const char *buf;
+		ssize_t len;
+		enum jzpfs_hdr_type type;
+	} cases[] = {
+		{ JZPFS_HDR_MAGIC, JZPFS_HDR_SIZE, JZPFS_HDR_LEGACY },
+		{ "JFZ", JZPFS_HDR_SIZE, JZPFS_HDR_EXTENT },
+		{ "JFD", JZPFS_HDR_SIZE, JZPFS_HDR_EXTENT },
+		{ "jfs", JZPFS_HDR_SIZE, JZPFS_HDR_NONE },
+		{ "JFX", JZPFS_HDR_SIZE, JZPFS_HDR_NONE },
+		{ "\0\0\0", JZPFS_HDR_SIZE, JZPFS_HDR_NONE },
+		/* 比文件头短的文件，或者读出错 */
+		{ JZPFS_HDR_MAGIC, JZPFS_HDR_SIZE - 1, JZPFS_HDR_NONE },
+		{ JZPFS_HDR_MAGIC, 0, JZPFS_HDR_NONE },
+		{ JZPFS_HDR_MAGIC, -EIO, JZPFS_HDR_NONE },
+		{ "JFZ", 1, JZPFS_HDR_NONE },
+	};
+	enum jzpfs_hdr_type type;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		type = jzpfs_hdr_type((const u8 *)cases[i].buf, cases[i].len);
+		ST_CHECK(type == cases[i].type,
+			 "hdr_type(\"%.3s\", %zd) = %d, expected %d",
+			 cases[i].buf, cases[i].len, type, cases[i].type);
+	}
+}
+
+/* 整个缓冲区按size切块编码一遍再解码一遍，数据每轮都回到原样 */
+static void jzpfs_selftest_speed(u8 *buf)
+{
+	static const size_t sizes[] = { 64, 512, 4096, 65536, 1 << 20 };
+	u64 start, ns[2];
+	size_t i, off;
+	int round;
+
+	for (off = 0; off < JZPFS_SELFTEST_LEN; off++)
+		buf[off] = "the quick brown fox\n"[off % 20];
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		ns[0] = ns[1] = 0;
+		for (round = 0; round < JZPFS_SELFTEST_ROUNDS; round++) {
+			start = ktime_get_ns();
+			for (off = 0; off < JZPFS_SELFTEST_LEN; off += sizes[i])
+				jzpfs_case_encode(buf + off, sizes[i], off);
+			ns[0] += ktime_get_ns() - start;
+
+			start = ktime_get_ns();
+			for (off = 0; off < JZPFS_SELFTEST_LEN; off += sizes[i])
+				jzpfs_case_decode(buf + off, sizes[i], off);
+			ns[1] += ktime_get_ns() - start;
+			cond_resched();
+		}
+
+		/* bytes/ns * 1000 = MB/s */
+		pr_info("jzpfs: selftest: %7zu byte buffers: encode %llu MB/s, decode %llu MB/s\n",
+			sizes[i],
+			div64_u64((u64)JZPFS_SELFTEST_LEN *
+				  JZPFS_SELFTEST_ROUNDS * 1000, ns[0] ?: 1),
+			div64_u64((u64)JZPFS_SELFTEST_LEN *
+				  JZPFS_SELFTEST_ROUNDS * 1000, ns[1] ?: 1));
+	}
+}
+
+int jzpfs_selftest(void)
+{
+	u8 *buf;
+
+	buf = vmalloc(2 * JZPFS_SELFTEST_LEN);
+	if (!buf)
+		return -ENOMEM;
+
+	jzpfs_selftest_failed = 0;
+	jzpfs_selftest_bytes();
+	jzpfs_selftest_header();
+	jzpfs_selftest_split(buf, buf + JZPFS_SELFTEST_LEN);
+	jzpfs_selftest_hdr_type();
+	if (jzpfs_selftest_failed) {
+		pr_err("jzpfs: selftest: %d checks failed\n",
+		       jzpfs_selftest_failed);
+		vfree(buf);
+		return -EINVAL;
+	}
+	pr_info("jzpfs: selftest passed\n");
+
+	jzpfs_selftest_speed(buf);
+	vfree(buf);
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * 统计信息，通过debugfs导出
+ *
+ * /sys/kernel/debug/jzpfs/<major:minor>/stats
+ * /sys/kernel/debug/jzpfs/<major:minor>/heat（见heat.c）
+ * /sys/kernel/debug/jzpfs/<major:minor>/trace、trace_ctl（见trace.c）
+ */
+
+#include "jzpfs.h"
+
+/* debugfs下jzpfs的根目录 */
+static struct dentry *jzpfs_debugfs_root;
+
+static const char * const jzpfs_stat_names[JZPFS_NR_STATS] = {
+	[JZPFS_STAT_IGET_HIT]		= "iget_hit",
+	[JZPFS_STAT_IGET_MISS]		= "iget_miss",
+	[JZPFS_STAT_IGET_REFRESH]	= "iget_refresh",
+	[JZPFS_STAT_INODE_EVICT]	= "inode_evict",
+	[JZPFS_STAT_DENTRY_STALE]	= "dentry_stale",
+	[JZPFS_STAT_CSUM_VERIFIED]	= "csum_verified",
+	[JZPFS_STAT_CSUM_FAILED]	= "csum_failed",
+	[JZPFS_STAT_CSUM_UPDATED]	= "csum_updated",
+	[JZPFS_STAT_EXT_READ]		= "ext_read",
+	[JZPFS_STAT_EXT_READ_LOWER]	= "ext_read_lower",
+	[JZPFS_STAT_EXT_WRITE]		= "ext_write",
+	[JZPFS_STAT_EXT_WRITE_LOWER]	= "ext_write_lower",
+	[JZPFS_STAT_DEDUP_HIT]		= "dedup_hit",
+	[JZPFS_STAT_DEDUP_NEW]		= "dedup_new",
+	[JZPFS_STAT_CHUNK_CACHE_HIT]	= "chunk_cache_hit",
+	[JZPFS_STAT_CHUNK_CACHE_MISS]	= "chunk_cache_miss",
+	[JZPFS_STAT_RANGE_WAIT]		= "range_wait",
+	[JZPFS_STAT_OPEN_DEFERRED]	= "open_deferred",
+	[JZPFS_STAT_OPEN_LOWER_LAZY]	= "open_lower_lazy",
+	[JZPFS_STAT_OPEN_LOWER_SHARED]	= "open_lower_shared",
+	[JZPFS_STAT_LINK_CACHED]	= "link_cached",
+	[JZPFS_STAT_XATTR_HIT]		= "xattr_hit",
+	[JZPFS_STAT_XATTR_MISS]		= "xattr_miss",
+	[JZPFS_STAT_COMMIT_BATCH]	= "commit_batch",
+	[JZPFS_STAT_COMMIT_JOINED]	= "commit_joined",
+	[JZPFS_STAT_QOS_DELAYED]	= "qos_delayed",
+	[JZPFS_STAT_QOS_DELAY_US]	= "qos_delay_us",
+	[JZPFS_STAT_PREFETCH]		= "prefetch",
+	[JZPFS_STAT_PREFETCH_DROPPED]	= "prefetch_dropped",
+	[JZPFS_STAT_READAHEAD]		= "readahead",
+};
+
+/* 把所有cpu上的计数加起来 */
+static u64 jzpfs_stat_sum(struct jzpfs_sb_info *sbi, int item)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->stats, cpu)->count[item];
+	return sum;
+}
+
+static int jzpfs_stats_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	u64 hit, miss;
+	int i;
+
+	for (i = 0; i < JZPFS_NR_STATS; i++)
+		seq_printf(m, "%-16s %llu\n", jzpfs_stat_names[i],
+			   jzpfs_stat_sum(sbi, i));
+
+	/* 命中率，以万分之一为单位避免浮点 */
+	hit = jzpfs_stat_sum(sbi, JZPFS_STAT_IGET_HIT);
+	miss = jzpfs_stat_sum(sbi, JZPFS_STAT_IGET_MISS);
+	if (hit + miss)
+		seq_printf(m, "%-16s %llu.%02llu%%\n", "iget_hit_rate",
+			   div64_u64(hit * 10000, hit + miss) / 100,
+			   div64_u64(hit * 10000, hit + miss) % 100);
+	return 0;
+}
+
+static int jzpfs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, jzpfs_stats_show, inode->i_private);
+}
+
+static const struct file_operations jzpfs_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= jzpfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * 每个挂载点分配计数器并建立debugfs目录
+ */
+int jzpfs_sb_stats_init(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_sb_stats_init");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	char name[32];
+
+	sbi->stats = alloc_percpu(struct jzpfs_stats);
+	if (!sbi->stats)
+		return -ENOMEM;
+
+	/* debugfs不可用时只保留计数器 */
+	if (IS_ERR_OR_NULL(jzpfs_debugfs_root))
+		return 0;
+
+	snprintf(name, sizeof(name), "%u:%u",
+		 MAJOR(sb->s_dev), MINOR(sb->s_dev));
+	sbi->debugfs_dir = debugfs_create_dir(name, jzpfs_debugfs_root);
+	if (IS_ERR_OR_NULL(sbi->debugfs_dir)) {
+		sbi->debugfs_dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("stats", S_IRUSR, sbi->debugfs_dir, sb,
+			    &jzpfs_stats_fops);
+	debugfs_create_file("heat", S_IRUSR, sbi->debugfs_dir, sb,
+			    &jzpfs_heat_fops);
+	debugfs_create_file("trace", S_IRUSR, sbi->debugfs_dir, sb,
+			    &jzpfs_trace_fops);
+	debugfs_create_file("trace_ctl", S_IRUSR | S_IWUSR, sbi->debugfs_dir,
+			    sb, &jzpfs_trace_ctl_fops);
+	return 0;
+}
+
+void jzpfs_sb_stats_exit(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_sb_stats_exit");
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+
+	debugfs_remove_recursive(sbi->debugfs_dir);
+	sbi->debugfs_dir = NULL;
+	free_percpu(sbi->stats);
+	sbi->stats = NULL;
+}
+
+int jzpfs_init_debugfs(void)
+{
+	printk(KERN_ALERT "jzpfs_init_debugfs");
+	jzpfs_debugfs_root = debugfs_create_dir(JZPFS_NAME, NULL);
+	/* 没有debugfs也能正常工作 */
+	if (IS_ERR(jzpfs_debugfs_root))
+		jzpfs_debugfs_root = NULL;
+	else
+		jzpfs_inject_init_debugfs(jzpfs_debugfs_root);
+	return 0;
+}
+
+void jzpfs_exit_debugfs(void)
+{
+	printk(KERN_ALERT "jzpfs_exit_debugfs");
+	debugfs_remove_recursive(jzpfs_debugfs_root);
+	jzpfs_debugfs_root = NULL;
+}
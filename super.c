@@ -3,6 +3,7 @@
  */
 
 #include "jzpfs.h"
+#include <linux/writeback.h>
 
 /*
  * The inode cache is used with alloc_inode for both our inode info and the
@@ -26,6 +27,17 @@ static void jzpfs_put_super(struct super_block *sb)
 	jzpfs_set_lower_super(sb, NULL);
 	atomic_dec(&s->s_active);
 
+	dput(spd->csum_dir);
+	jzpfs_dedup_exit_sb(sb);
+	jzpfs_meta_exit(sb);
+	put_cred(spd->mounter_cred);
+	jzpfs_crypto_exit_sb(sb);
+	jzpfs_qos_exit_sb(sb);
+	jzpfs_sb_stats_exit(sb);
+	jzpfs_trace_exit_sb(sb);
+	/* inode都已经回收，bdi上不会再有东西 */
+	bdi_destroy(&spd->bdi);
+	sb->s_bdi = &noop_backing_dev_info;
 	kfree(spd);
 	sb->s_fs_info = NULL;
 }
@@ -73,6 +85,62 @@ static int jzpfs_remount_fs(struct super_block *sb, int *flags, char *options)
 	return err;
 }
 
+/*
+ * syncfs()和sync()时调用。jzpfs自己没有脏数据：文件数据、校验和文件、
+ * 去重的块都直接写在lower上（块缓存只缓存读），所以只要把lower整个
+ * 刷下去。lower的s_umount要自己拿，sync_filesystem要求持有它。
+ */
+static int jzpfs_sync_fs(struct super_block *sb, int wait)
+{
+	printk(KERN_ALERT "jzpfs_sync_fs");
+	struct super_block *lower_sb = jzpfs_lower_super(sb);
+	int err = 0;
+
+	if (!lower_sb)
+		return 0;
+	down_read(&lower_sb->s_umount);
+	if (wait)
+		err = sync_filesystem(lower_sb);
+	else
+		writeback_inodes_sb(lower_sb, WB_REASON_SYNC);
+	up_read(&lower_sb->s_umount);
+	return err;
+}
+
+/*
+ * 冻结jzpfs时把lower也冻结，之后可以直接给lower做一致的快照。lower已经
+ * 被别人冻结了也算成功，但解冻时不归我们解。
+ */
+static int jzpfs_freeze_fs(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_freeze_fs");
+	struct super_block *lower_sb = jzpfs_lower_super(sb);
+	int err;
+
+	err = freeze_super(lower_sb);
+	if (!err)
+		JZPFS_SB(sb)->lower_frozen = true;
+	else if (err == -EBUSY && lower_sb->s_writers.frozen != SB_UNFROZEN)
+		err = 0;
+	return err;
+}
+
+static int jzpfs_unfreeze_fs(struct super_block *sb)
+{
+	printk(KERN_ALERT "jzpfs_unfreeze_fs");
+	int err = 0;
+
+	if (JZPFS_SB(sb)->lower_frozen) {
+		err = thaw_super(jzpfs_lower_super(sb));
+		/* 别人已经直接把lower解冻了，不然jzpfs会一直解冻不了 */
+		if (err == -EINVAL)
+			err = 0;
+		if (!err)
+			JZPFS_SB(sb)->lower_frozen = false;
+	}
+	return err;
+}
+
 /*
  * 引用计数法销毁inode
  */
@@ -81,8 +149,14 @@ static void jzpfs_evict_inode(struct inode *inode)
 	printk(KERN_ALERT "jzpfs_evict_inode");
 	struct inode *lower_inode;
 
+	jzpfs_stat_inc(inode->i_sb, JZPFS_STAT_INODE_EVICT);
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	/* 文件密钥、校验和文件、压缩tfm和xattr缓存跟着inode一起销毁 */
+	jzpfs_crypto_drop(inode);
+	jzpfs_csum_release(inode);
+	jzpfs_z_drop(inode);
+	jzpfs_xattr_drop(inode);
 	/*
 	 * 减少对lower_inode的引用，当初始创建它时，它被read_inode增加。
 	 */
@@ -91,6 +165,23 @@ static void jzpfs_evict_inode(struct inode *inode)
 	iput(lower_inode);
 }
 
+/*
+ * 最后一个引用释放时决定inode是否留在缓存中
+ *
+ * 正常情况下按generic_drop_inode的语义保留在LRU里，下次stat/open可以
+ * 直接命中，不必重新iget5_locked/igrab/拷贝属性。如果lower inode已经被
+ * 删除（nlink为0），缓存它没有意义，立即销毁以释放对lower inode的引用，
+ * 让下层文件系统可以回收空间。
+ */
+static int jzpfs_drop_inode(struct inode *inode)
+{
+	struct inode *lower_inode = jzpfs_lower_inode(inode);
+
+	if (!lower_inode || !lower_inode->i_nlink)
+		return 1;
+	return generic_drop_inode(inode);
+}
+
 /*
  *申请inode
  */
@@ -105,18 +196,41 @@ static struct inode *jzpfs_alloc_inode(struct super_block *sb)
 
 	/* 将所有的内容记录到inode 0 */
 	memset(i, 0, offsetof(struct jzpfs_inode_info, vfs_inode));
+	init_rwsem(&i->key_sem);
+	mutex_init(&i->csum_mutex);
+	mutex_init(&i->z_mutex);
+	spin_lock_init(&i->range_lock);
+	i->ranges = RB_ROOT;
+	init_waitqueue_head(&i->range_wait);
+	mutex_init(&i->lower_mutex);
+	INIT_LIST_HEAD(&i->lower_files);
+	spin_lock_init(&i->xattr_lock);
+	INIT_LIST_HEAD(&i->xattrs);
+	jzpfs_heat_init(&i->vfs_inode);
 
 	i->vfs_inode.i_version = 1;
 	return &i->vfs_inode;
 }
 
+static void jzpfs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	if (S_ISLNK(inode->i_mode))
+		kfree(inode->i_link);
+	kmem_cache_free(jzpfs_inode_cachep, JZPFS_I(inode));
+}
+
 /*
  *销毁inode
+ *
+ * RCU路径查找可能还在看这个inode（包括缓存的符号链接目标i_link），
+ * 等一个RCU宽限期再释放。
  */
 static void jzpfs_destroy_inode(struct inode *inode)
 {
 	printk(KERN_ALERT "jzpfs_destroy_inode");
-	kmem_cache_free(jzpfs_inode_cachep, JZPFS_I(inode));
+	call_rcu(&inode->i_rcu, jzpfs_i_callback);
 }
 
 /* jzpfs inode cache constructor */
@@ -149,6 +263,8 @@ int jzpfs_init_inode_cache(void)
 void jzpfs_destroy_inode_cache(void)
 {
 	printk(KERN_ALERT "jzpfs_destroy_inode_cache");
+	/* 等jzpfs_destroy_inode里call_rcu排队的inode都释放完 */
+	rcu_barrier();
 	if (jzpfs_inode_cachep)
 		kmem_cache_destroy(jzpfs_inode_cachep);
 }
@@ -166,14 +282,41 @@ static void jzpfs_umount_begin(struct super_block *sb)
 		lower_sb->s_op->umount_begin(lower_sb);
 }
 
+/*
+ * 显示挂载选项
+ */
+static int jzpfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct jzpfs_sb_info *sbi = JZPFS_SB(root->d_sb);
+
+	if (sbi->key_desc)
+		seq_show_option(m, "key", sbi->key_desc);
+	if (sbi->csum)
+		seq_puts(m, ",csum");
+	if (sbi->compress)
+		seq_printf(m, ",compress=%s", jzpfs_z_algo_name(sbi->compress));
+	if (sbi->dedup)
+		seq_puts(m, ",dedup");
+	if (sbi->group_commit && sbi->commit_delay)
+		seq_printf(m, ",group_commit=%u", sbi->commit_delay);
+	else if (sbi->group_commit)
+		seq_puts(m, ",group_commit");
+	if (sbi->prefetch)
+		seq_puts(m, ",readdir_prefetch");
+	return 0;
+}
+
 const struct super_operations jzpfs_sops = {
 	.put_super	= jzpfs_put_super,
+	.sync_fs	= jzpfs_sync_fs,
+	.freeze_fs	= jzpfs_freeze_fs,
+	.unfreeze_fs	= jzpfs_unfreeze_fs,
 	.statfs		= jzpfs_statfs,
 	.remount_fs	= jzpfs_remount_fs,
 	.evict_inode	= jzpfs_evict_inode,
 	.umount_begin	= jzpfs_umount_begin,
-	.show_options	= generic_show_options,
+	.show_options	= jzpfs_show_options,
 	.alloc_inode	= jzpfs_alloc_inode,
 	.destroy_inode	= jzpfs_destroy_inode,
-	.drop_inode	= generic_delete_inode,
+	.drop_inode	= jzpfs_drop_inode,
 };
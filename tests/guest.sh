@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# 在虚拟机里执行（由run.sh通过virtme启动）：加载jzpfs.ko，以tmpfs为
+# lower挂载，检查功能是否正确、内核有没有报错。全部通过时往$1写"ok"。
+#
+# 每个检查一个函数，失败时打印原因并返回非0。
+#
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+STATUS=$1
+WORK=/tmp/jzcheck
+LOWER=$WORK/lower
+MNT=$WORK/mnt
+failed=0
+
+insmod "$TESTS/../jzpfs.ko" || exit 1
+# jzpfs每个操作都会printk，只看错误
+echo 1 > /proc/sys/kernel/printk
+dmesg -C
+
+mkdir -p $WORK
+mount -t tmpfs tmpfs $WORK
+mkdir -p $LOWER $MNT
+
+jz_mount() {
+	mount -t jzpfs ${1:+-o "$1"} $LOWER $MNT
+}
+
+jz_umount() {
+	umount $MNT
+}
+
+# 元数据目录在jzpfs里看不见，查找它不能出错（也不能oops）
+check_meta_hidden() {
+	jz_mount csum || return 1
+	echo data > $MNT/f
+	if [ ! -d $LOWER/.jzpfs ]; then
+		echo "lower has no .jzpfs"; jz_umount; return 1
+	fi
+	if stat $MNT/.jzpfs >/dev/null 2>&1; then
+		echo "stat .jzpfs succeeded"; jz_umount; return 1
+	fi
+	if ls -a $MNT | grep -qx .jzpfs; then
+		echo ".jzpfs listed by readdir"; jz_umount; return 1
+	fi
+	# 负的dentry留在缓存里，再查一次
+	if stat $MNT/.jzpfs/csum >/dev/null 2>&1; then
+		echo "stat .jzpfs/csum succeeded"; jz_umount; return 1
+	fi
+	[ "$(cat $MNT/f)" = data ] || { echo "read back failed"; jz_umount; return 1; }
+	jz_umount
+}
+
+# user.jzpfs.*是jzpfs自己的元数据，上层不能改也看不见
+check_xattr_private() {
+	jz_mount || return 1
+	echo data > $MNT/f
+	if setfattr -n user.jzpfs.nonce -v 0x00 $MNT/f 2>/dev/null; then
+		echo "setting user.jzpfs.nonce succeeded"; jz_umount; return 1
+	fi
+	if setfattr -x user.jzpfs.nonce $MNT/f 2>/dev/null; then
+		echo "removing user.jzpfs.nonce succeeded"; jz_umount; return 1
+	fi
+	# 旧内核的tmpfs没有user.* xattr，剩下的查不了
+	if setfattr -n user.jzpfs.test -v 1 $LOWER/f 2>/dev/null &&
+	   setfattr -n user.visible -v 1 $LOWER/f; then
+		list=$(getfattr -d -m - $MNT/f 2>&1)
+		if echo "$list" | grep -q user.jzpfs; then
+			echo "listxattr shows $list"; jz_umount; return 1
+		fi
+		if ! echo "$list" | grep -q user.visible; then
+			echo "listxattr lost user.visible: $list"; jz_umount; return 1
+		fi
+	fi
+	jz_umount
+}
+
+# 改名覆盖掉的文件和unlink一样，校验和文件要删掉
+check_csum_rename() {
+	jz_mount csum || return 1
+	echo a > $MNT/a
+	echo b > $MNT/b
+	sync
+	csum=$LOWER/.jzpfs/csum/$(printf %x "$(stat -c %i $LOWER/b)")
+	if [ ! -e "$csum" ]; then
+		echo "no checksum file for b"; jz_umount; return 1
+	fi
+	mv $MNT/a $MNT/b
+	if [ -e "$csum" ]; then
+		echo "checksum file of the replaced b is still there"
+		jz_umount; return 1
+	fi
+	[ "$(cat $MNT/b)" = a ] || { echo "read back failed"; jz_umount; return 1; }
+	jz_umount
+}
+
+CHECKS="check_meta_hidden check_xattr_private check_csum_rename"
+
+for c in $CHECKS; do
+	rm -rf $LOWER/* $LOWER/.jzpfs
+	if out=$($c 2>&1); then
+		echo "PASS $c"
+	else
+		echo "FAIL $c: $out"
+		failed=1
+	fi
+	if dmesg | grep -qE 'BUG:|Oops|WARNING:|general protection'; then
+		echo "FAIL $c: kernel reported an error"
+		dmesg | grep -E -A20 'BUG:|Oops|WARNING:|general protection'
+		failed=1
+	fi
+	dmesg -C
+done
+
+umount $WORK
+rmmod jzpfs
+
+[ $failed = 0 ] && echo ok > "$STATUS"
+exit $failed
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# make check调用：用virtme起一个虚拟机，在里面跑guest.sh。全部通过时
+# 退出码为0。
+#
+# 环境变量：
+#   KDIR        编译jzpfs.ko用的内核目录，虚拟机跑同一个内核
+#   CHECK_MEM   虚拟机内存（默认1G）
+#
+# 需要virtme-run和qemu；虚拟机里用的是主机的根文件系统。
+#
+
+set -e
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+KDIR=${KDIR:-/lib/modules/$(uname -r)/build}
+MEM=${CHECK_MEM:-1G}
+STATUS=$TESTS/.status
+
+if ! command -v virtme-run >/dev/null 2>&1; then
+	echo "check: virtme-run not found" >&2
+	exit 1
+fi
+
+case $KDIR in
+/lib/modules/*)	kernel="--installed-kernel $(basename "$(dirname "$KDIR")")" ;;
+*)		kernel="--kdir $KDIR" ;;
+esac
+
+# virtme-run不把脚本的退出码带出来，结果写在文件里
+rm -f "$STATUS"
+virtme-run $kernel --rwdir "$TESTS/.." --memory "$MEM" \
+	--script-sh "sh '$TESTS/guest.sh' '$STATUS'"
+
+if [ "$(cat "$STATUS" 2>/dev/null)" != "ok" ]; then
+	echo "check: FAILED" >&2
+	exit 1
+fi
+echo "check: all passed"
@@ -0,0 +1,367 @@
+/*
+ * jzpfs-convert：整个目录树离线转换jzpfs格式
+ *
+ *   jzpfs-convert [选项] decode <lower目录> <输出目录>
+ *   jzpfs-convert [选项] encode <明文目录> <lower目录>
+ *
+ * decode按文件头自动识别每个文件的格式还原成明文；encode把明文按-f指定
+ * 的格式写成lower，之后可以直接挂载。目录、符号链接和权限照原样复制，
+ * 其他类型的文件跳过。
+ *
+ * 主线程遍历目录树，普通文件交给工作线程池转换，每个线程一套缓冲区和
+ * 算法上下文（见libjzpfs.c）。
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/xattr.h>
+
+#include "libjzpfs.h"
+
+struct job {
+	struct job *next;
+	mode_t mode;
+	off_t size;
+	char path[];		/* relative to the source root */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job *head, **tail;
+	unsigned int queued;
+	int done;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.tail = &queue.head,
+};
+
+#define QUEUE_MAX	1024
+
+static int decode;
+static const char *src_root, *dst_root;
+static size_t src_len;
+static struct jzpfs_params params;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long nr_files, nr_failed;
+static unsigned long long nr_bytes;
+
+static void queue_push(struct job *job)
+{
+	pthread_mutex_lock(&queue.lock);
+	/* 遍历比转换快得多，别把整棵树都排进队列 */
+	while (queue.queued >= QUEUE_MAX)
+		pthread_cond_wait(&queue.cond, &queue.lock);
+	*queue.tail = job;
+	queue.tail = &job->next;
+	queue.queued++;
+	pthread_cond_broadcast(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static struct job *queue_pop(void)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&queue.lock);
+	while (!queue.head && !queue.done)
+		pthread_cond_wait(&queue.cond, &queue.lock);
+	job = queue.head;
+	if (job) {
+		queue.head = job->next;
+		if (!queue.head)
+			queue.tail = &queue.head;
+		queue.queued--;
+		pthread_cond_broadcast(&queue.cond);
+	}
+	pthread_mutex_unlock(&queue.lock);
+	return job;
+}
+
+static void path_join(char *buf, size_t len, const char *root,
+		      const char *rel)
+{
+	snprintf(buf, len, "%s%s%s", root, *rel ? "/" : "", rel);
+}
+
+static void convert_file(struct jzpfs_ctx *ctx, struct job *job)
+{
+	char src[4096], dst[4096];
+	int in, out, err;
+
+	path_join(src, sizeof(src), src_root, job->path);
+	path_join(dst, sizeof(dst), dst_root, job->path);
+
+	in = open(src, O_RDONLY | O_NOFOLLOW);
+	if (in < 0) {
+		err = -errno;
+		goto out;
+	}
+	out = open(dst, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (out < 0) {
+		err = -errno;
+		close(in);
+		goto out;
+	}
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (decode)
+		err = jzpfs_decode_file(ctx, in, out);
+	else
+		err = jzpfs_encode_file(ctx, in, out);
+	if (!err && fchmod(out, job->mode & 07777))
+		err = -errno;
+	if (close(out) && !err)
+		err = -errno;
+	close(in);
+	/* 转换失败的输出不留下 */
+	if (err)
+		unlink(dst);
+out:
+	pthread_mutex_lock(&stats_lock);
+	if (err) {
+		fprintf(stderr, "jzpfs-convert: %s: %s\n", src, strerror(-err));
+		nr_failed++;
+	} else {
+		nr_files++;
+		nr_bytes += job->size;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void *worker(void *arg)
+{
+	struct jzpfs_ctx *ctx;
+	struct job *job;
+
+	ctx = jzpfs_ctx_new(&params);
+	if (!ctx) {
+		fprintf(stderr, "jzpfs-convert: out of memory\n");
+		exit(1);
+	}
+	while ((job = queue_pop()) != NULL) {
+		convert_file(ctx, job);
+		free(job);
+	}
+	jzpfs_ctx_free(ctx);
+	return NULL;
+}
+
+static int walk(const char *path, const struct stat *st, int type,
+		struct FTW *ftw)
+{
+	const char *rel = path + src_len;
+	char dst[4096], target[4096];
+	struct job *job;
+	ssize_t len;
+
+	while (*rel == '/')
+		rel++;
+	path_join(dst, sizeof(dst), dst_root, rel);
+
+	switch (type) {
+	case FTW_D:
+		/* lower上的元数据目录不是用户数据，挂载后也看不到 */
+		if (!strcmp(rel, JZPFS_META_DIR))
+			return FTW_SKIP_SUBTREE;
+		if (mkdir(dst, 0700) && errno != EEXIST) {
+			perror(dst);
+			return FTW_STOP;
+		}
+		/* 目录里的文件还没写，自己先保留写权限 */
+		chmod(dst, (st->st_mode & 07777) | S_IRWXU);
+		return FTW_CONTINUE;
+	case FTW_F:
+		if (S_ISREG(st->st_mode))
+			break;
+		fprintf(stderr, "jzpfs-convert: %s: skipping special file\n",
+			path);
+		return FTW_CONTINUE;
+	case FTW_SL:
+		len = readlink(path, target, sizeof(target) - 1);
+		if (len < 0) {
+			perror(path);
+			return FTW_CONTINUE;
+		}
+		target[len] = 0;
+		if (symlink(target, dst))
+			perror(dst);
+		return FTW_CONTINUE;
+	default:
+		fprintf(stderr, "jzpfs-convert: %s: cannot read\n", path);
+		return FTW_CONTINUE;
+	}
+
+	job = malloc(sizeof(*job) + strlen(rel) + 1);
+	if (!job) {
+		fprintf(stderr, "jzpfs-convert: out of memory\n");
+		return FTW_STOP;
+	}
+	job->next = NULL;
+	job->mode = st->st_mode;
+	job->size = st->st_size;
+	strcpy(job->path, rel);
+	queue_push(job);
+	return FTW_CONTINUE;
+}
+
+static int read_key(const char *file)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror(file);
+		return -1;
+	}
+	/* 和add_key的logon密钥一样是原始字节 */
+	len = read(fd, params.master_key, sizeof(params.master_key));
+	close(fd);
+	if (len < JZPFS_MASTER_KEY_MIN) {
+		fprintf(stderr, "jzpfs-convert: %s: key must be %d-%d bytes\n",
+			file, JZPFS_MASTER_KEY_MIN, JZPFS_MASTER_KEY_MAX);
+		return -1;
+	}
+	params.master_key_len = len;
+	return 0;
+}
+
+static int parse_format(const char *arg)
+{
+	if (!strcmp(arg, "plain"))
+		params.format = JZPFS_FMT_PLAIN;
+	else if (!strcmp(arg, "legacy"))
+		params.format = JZPFS_FMT_LEGACY;
+	else if (!strcmp(arg, "crypt"))
+		params.format = JZPFS_FMT_CRYPT;
+	else if (!strcmp(arg, "dedup"))
+		params.format = JZPFS_FMT_DEDUP;
+	else if (!strncmp(arg, "compress=", 9)) {
+		params.format = JZPFS_FMT_COMPRESS;
+		params.algo = jzpfs_z_algo(arg + 9);
+		if (params.algo < 0)
+			return -1;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: jzpfs-convert [-j threads] [-k keyfile] [-f format] "
+		"decode|encode <src> <dst>\n"
+		"  format: plain, legacy (default), crypt, compress=<algo>, "
+		"dedup\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static char chunk_dir[4096];
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct timeval t0, t1;
+	pthread_t *tid;
+	double secs;
+	int i, opt;
+
+	params.format = JZPFS_FMT_LEGACY;
+	while ((opt = getopt(argc, argv, "j:k:f:")) != -1) {
+		switch (opt) {
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'k':
+			if (read_key(optarg))
+				return 1;
+			break;
+		case 'f':
+			if (parse_format(optarg)) {
+				fprintf(stderr, "jzpfs-convert: bad format %s\n",
+					optarg);
+				return 2;
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 3 || threads < 1)
+		usage();
+	if (!strcmp(argv[optind], "decode"))
+		decode = 1;
+	else if (strcmp(argv[optind], "encode"))
+		usage();
+	src_root = argv[optind + 1];
+	dst_root = argv[optind + 2];
+	src_len = strlen(src_root);
+
+	if (!decode && params.format == JZPFS_FMT_CRYPT &&
+	    !params.master_key_len) {
+		fprintf(stderr, "jzpfs-convert: crypt needs -k keyfile\n");
+		return 2;
+	}
+
+	/* 去重的块仓库在lower根目录的元数据目录里 */
+	snprintf(chunk_dir, sizeof(chunk_dir), "%s/%s",
+		 decode ? src_root : dst_root, JZPFS_CHUNK_DIR);
+	params.chunk_dir = chunk_dir;
+	if (!decode && params.format == JZPFS_FMT_DEDUP) {
+		char meta[4096];
+
+		mkdir(dst_root, 0755);
+		snprintf(meta, sizeof(meta), "%s/%s", dst_root, JZPFS_META_DIR);
+		if (!mkdir(meta, 0700)) {
+			/* 新建的和模块建的一样带标记，块文件都会打上 */
+			setxattr(meta, JZPFS_XATTR_META, "1", 1, 0);
+		} else if (errno != EEXIST) {
+			perror(meta);
+			return 1;
+		}
+		if (mkdir(chunk_dir, 0700) && errno != EEXIST) {
+			perror(chunk_dir);
+			return 1;
+		}
+	}
+
+	tid = calloc(threads, sizeof(*tid));
+	if (!tid)
+		return 1;
+	gettimeofday(&t0, NULL);
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tid[i], NULL, worker, NULL)) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	if (nftw(src_root, walk, 64, FTW_PHYS | FTW_ACTIONRETVAL))
+		nr_failed++;
+
+	pthread_mutex_lock(&queue.lock);
+	queue.done = 1;
+	pthread_cond_broadcast(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	gettimeofday(&t1, NULL);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+	fprintf(stderr, "jzpfs-convert: %lu files, %.1f MiB in %.1fs "
+		"(%.1f MiB/s), %lu failed\n", nr_files, nr_bytes / 1048576.0,
+		secs, secs > 0 ? nr_bytes / 1048576.0 / secs : 0, nr_failed);
+	free(tid);
+	return nr_failed ? 1 : 0;
+}
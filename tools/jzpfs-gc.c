@@ -0,0 +1,215 @@
+/*
+ * jzpfs-gc：离线回收去重块仓库里没有引用的块
+ *
+ *   jzpfs-gc [-n] <lower目录>
+ *
+ * 去重的块没有引用计数（见dedup.c），删除、截断和覆盖文件都会留下没人
+ * 用的块。这里先遍历整个lower，收集所有去重文件块映射里的摘要，再扫
+ * .jzpfs/chunks，删掉不在里面的块文件，以及jzpfs-convert中断留下的
+ * 临时文件。-n只统计不删除。
+ *
+ * 必须在lower没有挂载jzpfs的时候运行：挂载中的写可能正好引用一个刚被
+ * 判定为没有引用的块。读任何一个去重文件出错都不删除任何东西。
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libjzpfs.h"
+
+/* 所有引用的摘要，收集完排序后二分查找 */
+static struct {
+	uint8_t (*d)[JZPFS_DIGEST_SIZE];
+	size_t nr, max;
+} refs;
+
+static const char *root;
+static size_t root_len;
+static unsigned long nr_files, nr_failed;
+
+static int ref_add(const uint8_t *digest, void *arg)
+{
+	void *d;
+
+	if (refs.nr == refs.max) {
+		refs.max = refs.max ? refs.max * 2 : 4096;
+		d = realloc(refs.d, refs.max * JZPFS_DIGEST_SIZE);
+		if (!d)
+			return -ENOMEM;
+		refs.d = d;
+	}
+	memcpy(refs.d[refs.nr++], digest, JZPFS_DIGEST_SIZE);
+	return 0;
+}
+
+static int ref_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, JZPFS_DIGEST_SIZE);
+}
+
+static int walk(const char *path, const struct stat *st, int type,
+		struct FTW *ftw)
+{
+	enum jzpfs_format format;
+	int fd, err;
+
+	if (type == FTW_D && ftw->level == 1 &&
+	    !strcmp(path + root_len + 1, JZPFS_META_DIR))
+		return FTW_SKIP_SUBTREE;
+	if (type == FTW_DNR || type == FTW_NS) {
+		fprintf(stderr, "jzpfs-gc: %s: cannot read\n", path);
+		nr_failed++;
+		return FTW_CONTINUE;
+	}
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return FTW_CONTINUE;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		fprintf(stderr, "jzpfs-gc: %s: %s\n", path, strerror(errno));
+		nr_failed++;
+		return FTW_CONTINUE;
+	}
+	err = jzpfs_probe(fd, &format);
+	if (!err && format == JZPFS_FMT_DEDUP) {
+		err = jzpfs_dedup_refs(fd, ref_add, NULL);
+		nr_files++;
+	}
+	close(fd);
+	if (err == -ENOMEM) {
+		fprintf(stderr, "jzpfs-gc: out of memory\n");
+		return FTW_STOP;
+	}
+	if (err) {
+		fprintf(stderr, "jzpfs-gc: %s: %s\n", path, strerror(-err));
+		nr_failed++;
+	}
+	return FTW_CONTINUE;
+}
+
+/* 块文件名是64个小写十六进制字符 */
+static int chunk_name(const char *name, uint8_t *digest)
+{
+	unsigned int v;
+	int i;
+
+	if (strlen(name) != 2 * JZPFS_DIGEST_SIZE)
+		return -1;
+	for (i = 0; i < JZPFS_DIGEST_SIZE; i++) {
+		if (!strchr("0123456789abcdef", name[2 * i]) ||
+		    !strchr("0123456789abcdef", name[2 * i + 1]) ||
+		    sscanf(name + 2 * i, "%2x", &v) != 1)
+			return -1;
+		digest[i] = v;
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: jzpfs-gc [-n] <lower>\n"
+		"  the lower must not be mounted through jzpfs\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nr_kept = 0, nr_dead = 0, nr_tmp = 0;
+	unsigned long long bytes = 0;
+	uint8_t digest[JZPFS_DIGEST_SIZE];
+	char dir[4096];
+	struct dirent *de;
+	struct stat st;
+	int dry_run = 0;
+	int opt, dfd;
+	DIR *d;
+
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		switch (opt) {
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+	root = argv[optind];
+	root_len = strlen(root);
+	while (root_len > 1 && root[root_len - 1] == '/')
+		root_len--;
+
+	snprintf(dir, sizeof(dir), "%.*s/%s", (int)root_len, root,
+		 JZPFS_CHUNK_DIR);
+	d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		return 1;
+	}
+	dfd = dirfd(d);
+
+	if (nftw(root, walk, 64, FTW_PHYS | FTW_ACTIONRETVAL))
+		nr_failed++;
+	if (nr_failed) {
+		fprintf(stderr, "jzpfs-gc: %lu errors, nothing removed\n",
+			nr_failed);
+		return 1;
+	}
+	qsort(refs.d, refs.nr, JZPFS_DIGEST_SIZE, ref_cmp);
+
+	while ((errno = 0, de = readdir(d))) {
+		if (de->d_name[0] == '.' &&
+		    (!de->d_name[1] ||
+		     (de->d_name[1] == '.' && !de->d_name[2])))
+			continue;
+		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			fprintf(stderr, "jzpfs-gc: %s/%s: %s\n", dir,
+				de->d_name, strerror(errno));
+			nr_failed++;
+			continue;
+		}
+		if (!S_ISREG(st.st_mode))
+			continue;
+		if (!chunk_name(de->d_name, digest)) {
+			if (bsearch(digest, refs.d, refs.nr, JZPFS_DIGEST_SIZE,
+				    ref_cmp)) {
+				nr_kept++;
+				continue;
+			}
+			nr_dead++;
+		} else if (strlen(de->d_name) > 2 * JZPFS_DIGEST_SIZE &&
+			   de->d_name[2 * JZPFS_DIGEST_SIZE] == '.') {
+			/* jzpfs-convert的"<摘要>.<pid>.<ctx>"临时文件 */
+			nr_tmp++;
+		} else {
+			continue;
+		}
+		bytes += st.st_size;
+		if (!dry_run && unlinkat(dfd, de->d_name, 0)) {
+			fprintf(stderr, "jzpfs-gc: %s/%s: %s\n", dir,
+				de->d_name, strerror(errno));
+			nr_failed++;
+		}
+	}
+	if (errno) {
+		perror(dir);
+		nr_failed++;
+	}
+	closedir(d);
+
+	fprintf(stderr, "jzpfs-gc: %lu files, %lu chunks kept, %lu unreferenced"
+		" and %lu temporary %s (%.1f MiB), %lu failed\n", nr_files,
+		nr_kept, nr_dead, nr_tmp, dry_run ? "found" : "removed",
+		bytes / 1048576.0, nr_failed);
+	free(refs.d);
+	return nr_failed ? 1 : 0;
+}
@@ -0,0 +1,539 @@
+/*
+ * jzpfs-replay：抓取jzpfs的I/O跟踪，在测试挂载点上按原来的节奏回放
+ *
+ *   jzpfs-replay record [-b 记录数] <debugfs目录> <跟踪文件>
+ *   jzpfs-replay dump <跟踪文件>
+ *   jzpfs-replay run [-s 倍速] <跟踪文件> <目录>
+ *
+ * record打开挂载点的跟踪（debugfs目录是/sys/kernel/debug/jzpfs/<设备号>，
+ * -b是每个cpu的缓冲区记录数），不停把记录读出来追加到跟踪文件，直到
+ * Ctrl-C或SIGTERM。dump按时间顺序打印成文本。
+ *
+ * run在目录下为跟踪里的每个inode准备一个文件i<inode号>，大小够跟踪里
+ * 所有的读写，然后每个原线程一个回放线程，按时间戳的间隔重新发出
+ * 读、写、fsync和截断。-s 1（默认）按原速，-s 10快10倍，-s 0不等待。
+ * 所有线程共用每个文件的一个fd；open只在原来的时间点打开再关闭一次，
+ * release不回放，O_DIRECT等打开标志也不回放。结束时打印一行：操作数、
+ * 错误数、秒数、每秒操作数、读写MB/s和比计划晚发出的p99毫秒数。
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libjzpfs.h"
+
+#define RECORD_CHUNK	1024	/* records per read of the trace file */
+#define RECORD_POLL_US	100000
+#define FILL_BS		(1 << 20)
+#define MAX_THREADS	256
+
+static const char * const op_names[JZPFS_TR_NR_OPS] = {
+	[JZPFS_TR_OPEN]		= "open",
+	[JZPFS_TR_RELEASE]	= "release",
+	[JZPFS_TR_READ]		= "read",
+	[JZPFS_TR_WRITE]	= "write",
+	[JZPFS_TR_FSYNC]	= "fsync",
+	[JZPFS_TR_TRUNCATE]	= "truncate",
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: jzpfs-replay record [-b records] <debugfs dir> <trace>\n"
+		"       jzpfs-replay dump <trace>\n"
+		"       jzpfs-replay run [-s speed] <trace> <dir>\n");
+	exit(2);
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ---- record ---- */
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+	stopping = 1;
+}
+
+static void write_ctl(const char *dir, const char *cmd)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/trace_ctl", dir);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		die(path);
+	if (write(fd, cmd, strlen(cmd)) < 0)
+		die(path);
+	close(fd);
+}
+
+static void print_ctl(const char *dir)
+{
+	char path[4096], buf[128];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/trace_ctl", dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	n = read(fd, buf, sizeof(buf) - 1);
+	if (n > 0) {
+		buf[n] = '\0';
+		fprintf(stderr, "trace: %s", buf);
+	}
+	close(fd);
+}
+
+/* 读出现有的记录，返回读到的条数 */
+static long drain(int in, FILE *out, const char *path)
+{
+	static struct jzpfs_trace_rec buf[RECORD_CHUNK];
+	long total = 0;
+	ssize_t n;
+
+	for (;;) {
+		n = read(in, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read trace");
+		}
+		if (!n)
+			return total;
+		if (fwrite(buf, 1, n, out) != (size_t)n)
+			die(path);
+		total += n / sizeof(buf[0]);
+	}
+}
+
+static int cmd_record(int argc, char **argv)
+{
+	char path[4096], cmd[32] = "start";
+	struct sigaction sa;
+	const char *dir;
+	long total = 0;
+	FILE *out;
+	int opt, in;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		switch (opt) {
+		case 'b':
+			snprintf(cmd, sizeof(cmd), "start %lu",
+				 strtoul(optarg, NULL, 0));
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+	dir = argv[optind];
+
+	out = fopen(argv[optind + 1], "w");
+	if (!out)
+		die(argv[optind + 1]);
+	snprintf(path, sizeof(path), "%s/trace", dir);
+	in = open(path, O_RDONLY);
+	if (in < 0)
+		die(path);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	write_ctl(dir, cmd);
+	while (!stopping) {
+		total += drain(in, out, argv[optind + 1]);
+		usleep(RECORD_POLL_US);
+	}
+	write_ctl(dir, "stop");
+	total += drain(in, out, argv[optind + 1]);
+	print_ctl(dir);
+
+	close(in);
+	if (fclose(out))
+		die(argv[optind + 1]);
+	fprintf(stderr, "%ld records\n", total);
+	return 0;
+}
+
+/* ---- loading ---- */
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct jzpfs_trace_rec *x = a, *y = b;
+
+	if (x->ts != y->ts)
+		return x->ts < y->ts ? -1 : 1;
+	return 0;
+}
+
+/* 读入整个跟踪文件并按时间排序 */
+static struct jzpfs_trace_rec *load(const char *path, long *nr)
+{
+	struct jzpfs_trace_rec *recs;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		die(path);
+	if (fstat(fileno(f), &st))
+		die(path);
+	*nr = st.st_size / sizeof(*recs);
+	recs = malloc((*nr ? *nr : 1) * sizeof(*recs));
+	if (!recs)
+		die("malloc");
+	if (fread(recs, sizeof(*recs), *nr, f) != (size_t)*nr)
+		die(path);
+	fclose(f);
+	qsort(recs, *nr, sizeof(*recs), cmp_rec);
+	return recs;
+}
+
+static int cmd_dump(int argc, char **argv)
+{
+	struct jzpfs_trace_rec *recs, *r;
+	long i, nr;
+
+	if (argc != 2)
+		usage();
+	recs = load(argv[1], &nr);
+	for (i = 0; i < nr; i++) {
+		r = &recs[i];
+		printf("%12.3f %7u %-8s %10llu %12llu %10u %#x\n",
+		       (r->ts - recs[0].ts) / 1e3, r->pid,
+		       r->op < JZPFS_TR_NR_OPS ? op_names[r->op] : "?",
+		       (unsigned long long)r->ino,
+		       (unsigned long long)r->off, r->len, r->flags);
+	}
+	free(recs);
+	return 0;
+}
+
+/* ---- run ---- */
+
+struct replay_file {
+	uint64_t ino;
+	off_t size;		/* needed for the traced I/O */
+	int fd;
+	char path[4096];
+};
+
+struct replay_thread {
+	pthread_t tid;
+	uint32_t pid;
+	struct jzpfs_trace_rec **recs;
+	long nr, alloc;
+	/* results */
+	long ops, errors;
+	uint64_t read_bytes, write_bytes;
+	double *lag;		/* ms behind schedule, one per op */
+};
+
+static struct {
+	struct replay_file *files;
+	long nr_files;
+	double speed;
+	uint64_t ts0, start;
+} replay;
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_ino(const void *a, const void *b)
+{
+	const struct replay_file *x = a, *y = b;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static struct replay_file *find_file(uint64_t ino)
+{
+	struct replay_file key = { .ino = ino };
+
+	return bsearch(&key, replay.files, replay.nr_files,
+		       sizeof(key), cmp_ino);
+}
+
+/* 每个inode一个文件，先写满跟踪里会碰到的范围，读的时候有真实的数据 */
+static void prepare_files(const char *dir, struct jzpfs_trace_rec *recs,
+			  long nr)
+{
+	struct replay_file *f;
+	struct stat st;
+	off_t end, pos;
+	uint64_t *inos;
+	char *buf;
+	long i, n;
+
+	inos = malloc((nr ? nr : 1) * sizeof(*inos));
+	if (!inos)
+		die("malloc");
+	for (i = 0; i < nr; i++)
+		inos[i] = recs[i].ino;
+	qsort(inos, nr, sizeof(*inos), cmp_u64);
+	for (i = n = 0; i < nr; i++)
+		if (!n || inos[n - 1] != inos[i])
+			inos[n++] = inos[i];
+	replay.files = calloc(n ? n : 1, sizeof(*replay.files));
+	if (!replay.files)
+		die("calloc");
+	for (i = 0; i < n; i++)
+		replay.files[i].ino = inos[i];
+	replay.nr_files = n;
+	free(inos);
+
+	for (i = 0; i < nr; i++) {
+		f = find_file(recs[i].ino);
+		end = 0;
+		if (recs[i].op == JZPFS_TR_READ || recs[i].op == JZPFS_TR_WRITE)
+			end = recs[i].off + recs[i].len;
+		else if (recs[i].op == JZPFS_TR_TRUNCATE)
+			end = recs[i].off;
+		if (end > f->size)
+			f->size = end;
+	}
+
+	buf = malloc(FILL_BS);
+	if (!buf)
+		die("malloc");
+	for (i = 0; i < FILL_BS; i++)
+		buf[i] = "jzpfs-replay\n"[i % 13];
+	for (i = 0; i < replay.nr_files; i++) {
+		f = &replay.files[i];
+		snprintf(f->path, sizeof(f->path), "%s/i%llu", dir,
+			 (unsigned long long)f->ino);
+		f->fd = open(f->path, O_RDWR | O_CREAT, 0644);
+		if (f->fd < 0 || fstat(f->fd, &st))
+			die(f->path);
+		for (pos = st.st_size; pos < f->size; pos += FILL_BS) {
+			n = f->size - pos < FILL_BS ? f->size - pos : FILL_BS;
+			if (pwrite(f->fd, buf, n, pos) != n)
+				die(f->path);
+		}
+		if (fsync(f->fd))
+			die(f->path);
+	}
+	free(buf);
+}
+
+static int replay_one(struct replay_thread *t, struct jzpfs_trace_rec *r,
+		      char **buf, size_t *buflen)
+{
+	struct replay_file *f = find_file(r->ino);
+	ssize_t n;
+	int fd;
+
+	if ((r->op == JZPFS_TR_READ || r->op == JZPFS_TR_WRITE) &&
+	    r->len > *buflen) {
+		free(*buf);
+		*buflen = r->len;
+		*buf = malloc(*buflen);
+		if (!*buf)
+			die("malloc");
+		memset(*buf, 'j', *buflen);
+	}
+
+	switch (r->op) {
+	case JZPFS_TR_OPEN:
+		fd = open(f->path, r->flags & O_ACCMODE);
+		if (fd < 0)
+			return -1;
+		close(fd);
+		return 0;
+	case JZPFS_TR_READ:
+		n = pread(f->fd, *buf, r->len, r->off);
+		if (n > 0)
+			t->read_bytes += n;
+		return n < 0 ? -1 : 0;
+	case JZPFS_TR_WRITE:
+		n = pwrite(f->fd, *buf, r->len, r->off);
+		if (n > 0)
+			t->write_bytes += n;
+		return n < 0 ? -1 : 0;
+	case JZPFS_TR_FSYNC:
+		return r->flags ? fdatasync(f->fd) : fsync(f->fd);
+	case JZPFS_TR_TRUNCATE:
+		return ftruncate(f->fd, r->off);
+	}
+	return 0;
+}
+
+static void *replay_thread(void *p)
+{
+	struct replay_thread *t = p;
+	struct jzpfs_trace_rec *r;
+	struct timespec ts;
+	size_t buflen = 0;
+	char *buf = NULL;
+	uint64_t due;
+	long i;
+
+	t->lag = malloc((t->nr ? t->nr : 1) * sizeof(*t->lag));
+	if (!t->lag)
+		die("malloc");
+	for (i = 0; i < t->nr; i++) {
+		r = t->recs[i];
+		if (r->op == JZPFS_TR_RELEASE || r->op >= JZPFS_TR_NR_OPS)
+			continue;
+		due = replay.start;
+		if (replay.speed > 0) {
+			due += (r->ts - replay.ts0) / replay.speed;
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL) == EINTR)
+				;
+		}
+		t->lag[t->ops++] = replay.speed > 0 && now_ns() > due ?
+				   (now_ns() - due) / 1e6 : 0;
+		if (replay_one(t, r, &buf, &buflen))
+			t->errors++;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmd_run(int argc, char **argv)
+{
+	struct replay_thread *threads, *t;
+	struct jzpfs_trace_rec *recs;
+	long i, j, nr, ops = 0, errors = 0;
+	uint64_t rbytes = 0, wbytes = 0;
+	double secs, *lag, p99 = 0;
+	int opt, nr_threads = 0;
+
+	replay.speed = 1;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			replay.speed = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2 || replay.speed < 0)
+		usage();
+
+	recs = load(argv[optind], &nr);
+	prepare_files(argv[optind + 1], recs, nr);
+
+	/* 每个原线程一个回放线程，太多时按出现的顺序轮流分配 */
+	threads = calloc(MAX_THREADS, sizeof(*threads));
+	if (!threads)
+		die("calloc");
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < nr_threads; j++)
+			if (threads[j].pid == recs[i].pid)
+				break;
+		if (j == nr_threads) {
+			if (nr_threads < MAX_THREADS)
+				threads[nr_threads++].pid = recs[i].pid;
+			else
+				j = recs[i].pid % MAX_THREADS;
+		}
+		t = &threads[j];
+		if (t->nr == t->alloc) {
+			t->alloc = t->alloc ? t->alloc * 2 : 64;
+			t->recs = realloc(t->recs, t->alloc * sizeof(*t->recs));
+			if (!t->recs)
+				die("realloc");
+		}
+		t->recs[t->nr++] = &recs[i];
+	}
+
+	replay.ts0 = nr ? recs[0].ts : 0;
+	replay.start = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i].tid, NULL, replay_thread,
+				   &threads[i]))
+			die("pthread_create");
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].tid, NULL);
+	secs = (now_ns() - replay.start) / 1e9;
+
+	lag = malloc((nr ? nr : 1) * sizeof(*lag));
+	if (!lag)
+		die("malloc");
+	for (i = 0; i < nr_threads; i++) {
+		t = &threads[i];
+		memcpy(lag + ops, t->lag, t->ops * sizeof(*lag));
+		ops += t->ops;
+		errors += t->errors;
+		rbytes += t->read_bytes;
+		wbytes += t->write_bytes;
+	}
+	if (ops) {
+		qsort(lag, ops, sizeof(*lag), cmp_double);
+		p99 = lag[(ops - 1) * 99 / 100];
+	}
+	printf("ops %ld errors %ld secs %.3f ops/s %.0f read_MB/s %.1f "
+	       "write_MB/s %.1f lag_p99_ms %.3f\n", ops, errors, secs,
+	       ops / secs, rbytes / secs / 1048576, wbytes / secs / 1048576,
+	       p99);
+
+	for (i = 0; i < replay.nr_files; i++)
+		close(replay.files[i].fd);
+	for (i = 0; i < nr_threads; i++) {
+		free(threads[i].recs);
+		free(threads[i].lag);
+	}
+	free(threads);
+	free(replay.files);
+	free(recs);
+	free(lag);
+	return errors ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage();
+	if (!strcmp(argv[1], "record"))
+		return cmd_record(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "dump"))
+		return cmd_dump(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "run"))
+		return cmd_run(argc - 1, argv + 1);
+	usage();
+	return 2;
+}
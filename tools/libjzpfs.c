@@ -0,0 +1,815 @@
+/*
+ * libjzpfs：jzpfs格式的离线读写
+ *
+ * 加解密和摘要用OpenSSL，deflate用zlib，lz4要用LZ4=1编译（liblz4）。
+ * OpenSSL会按CPU选AES-NI、SHA扩展等实现，和模块里内核crypto选的
+ * 加速实现对应。zstd和lzo的压缩文件还不支持。
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <zlib.h>
+#ifdef JZPFS_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "libjzpfs.h"
+
+#define JZPFS_HKDF_INFO		"jzpfs file key"
+
+/* 明文、旧格式和加密文件每次读写的大小 */
+#define JZPFS_IO_SIZE		(1 << 20)
+
+/* 压缩文件的布局，见compress.c */
+#define JZPFS_Z_IDX_SIZE	4096
+#define JZPFS_Z_GROUP_EXTENTS	(JZPFS_Z_IDX_SIZE / 4)
+#define JZPFS_Z_GROUP_SIZE	(JZPFS_Z_IDX_SIZE + \
+				 ((off_t)JZPFS_Z_GROUP_EXTENTS << \
+				  JZPFS_EXT_SHIFT))
+#define JZPFS_Z_RAW		0x80000000
+#define JZPFS_Z_LEN_MASK	0x0001ffff
+
+/* 内核crypto的deflate：raw deflate，窗口2^11 */
+#define JZPFS_DEFLATE_WINBITS	11
+
+/* 去重文件的块映射一次读写一页 */
+#define JZPFS_DEDUP_MAP_BATCH	(4096 / JZPFS_DIGEST_SIZE)
+
+/* extent文件头，见extent.c */
+#define JZPFS_EXT_OFF_VERSION	3
+#define JZPFS_EXT_OFF_ALGO	4
+#define JZPFS_EXT_OFF_SHIFT	5
+#define JZPFS_EXT_OFF_SIZE	8
+
+struct jzpfs_ctx {
+	const struct jzpfs_params *params;
+	uint8_t *buf;		/* JZPFS_IO_SIZE */
+	uint8_t *ext;		/* one extent */
+	uint8_t *cbuf;		/* compressed extent */
+	uint8_t *idx;		/* compress index / dedup map page */
+	EVP_CIPHER_CTX *cipher;
+	z_stream zdef, zinf;
+	int zdef_ok, zinf_ok;
+};
+
+static const char * const jzpfs_z_algos[JZPFS_Z_NR_ALGOS] = {
+	[JZPFS_Z_LZ4]		= "lz4",
+	[JZPFS_Z_ZSTD]		= "zstd",
+	[JZPFS_Z_DEFLATE]	= "deflate",
+	[JZPFS_Z_LZO]		= "lzo",
+};
+
+struct jzpfs_ctx *jzpfs_ctx_new(const struct jzpfs_params *params)
+{
+	struct jzpfs_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->params = params;
+	ctx->buf = malloc(JZPFS_IO_SIZE);
+	/* 压缩结果补齐到整块前可能比extent大一点 */
+	ctx->ext = malloc(JZPFS_EXT_SIZE);
+	ctx->cbuf = malloc(2 * JZPFS_EXT_SIZE);
+	ctx->idx = malloc(JZPFS_Z_IDX_SIZE);
+	ctx->cipher = EVP_CIPHER_CTX_new();
+	if (!ctx->buf || !ctx->ext || !ctx->cbuf || !ctx->idx ||
+	    !ctx->cipher) {
+		jzpfs_ctx_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void jzpfs_ctx_free(struct jzpfs_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	if (ctx->zdef_ok)
+		deflateEnd(&ctx->zdef);
+	if (ctx->zinf_ok)
+		inflateEnd(&ctx->zinf);
+	EVP_CIPHER_CTX_free(ctx->cipher);
+	free(ctx->buf);
+	free(ctx->ext);
+	free(ctx->cbuf);
+	free(ctx->idx);
+	free(ctx);
+}
+
+/* 读满len字节，文件尾之前返回的字节数可能小于len */
+static ssize_t jzpfs_pread(int fd, void *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, (char *)buf + done, len - done, pos + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int jzpfs_pwrite(int fd, const void *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pwrite(fd, (const char *)buf + done, len - done,
+			     pos + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+static int jzpfs_all_zero(const uint8_t *buf, size_t len)
+{
+	return !len || (!buf[0] && !memcmp(buf, buf + 1, len - 1));
+}
+
+/* buf里落在文件头之后的部分：返回要跳过的字节数，同transform.c */
+static size_t jzpfs_hdr_skip(size_t len, off_t pos)
+{
+	if (pos >= JZPFS_HDR_SIZE)
+		return 0;
+	return len < (size_t)(JZPFS_HDR_SIZE - pos) ?
+	       len : (size_t)(JZPFS_HDR_SIZE - pos);
+}
+
+void jzpfs_case_encode(uint8_t *buf, size_t len, off_t pos)
+{
+	size_t i;
+
+	for (i = jzpfs_hdr_skip(len, pos); i < len; i++)
+		if (buf[i] >= 'a' && buf[i] <= 'z')
+			buf[i] -= 32;
+}
+
+void jzpfs_case_decode(uint8_t *buf, size_t len, off_t pos)
+{
+	size_t i;
+
+	for (i = jzpfs_hdr_skip(len, pos); i < len; i++)
+		if (buf[i] >= 'A' && buf[i] <= 'Z')
+			buf[i] += 32;
+}
+
+/* HKDF-SHA256(IKM = 主密钥, salt = nonce, info = "jzpfs file key")，同crypto.c */
+int jzpfs_file_key(const uint8_t *master, size_t master_len,
+		   const uint8_t *nonce, uint8_t *key)
+{
+	uint8_t prk[SHA256_DIGEST_LENGTH];
+	uint8_t info[sizeof(JZPFS_HKDF_INFO)];
+	unsigned int len;
+	int ret = 0;
+
+	if (master_len < JZPFS_MASTER_KEY_MIN ||
+	    master_len > JZPFS_MASTER_KEY_MAX)
+		return -EINVAL;
+
+	memcpy(info, JZPFS_HKDF_INFO, sizeof(info) - 1);
+	info[sizeof(info) - 1] = 1;
+	if (!HMAC(EVP_sha256(), nonce, JZPFS_NONCE_SIZE, master, master_len,
+		  prk, &len) ||
+	    !HMAC(EVP_sha256(), prk, sizeof(prk), info, sizeof(info),
+		  key, &len))
+		ret = -EIO;
+	OPENSSL_cleanse(prk, sizeof(prk));
+	return ret;
+}
+
+/* AES-256-CTR，计数器是lower偏移/16，文件头不加密，同crypto.c */
+static int jzpfs_ctr(EVP_CIPHER_CTX *cipher, const uint8_t *key,
+		     uint8_t *buf, size_t len, off_t pos)
+{
+	uint8_t iv[16] = { 0 }, pad[16] = { 0 };
+	uint64_t ctr;
+	size_t skip;
+	int n;
+
+	skip = jzpfs_hdr_skip(len, pos);
+	buf += skip;
+	len -= skip;
+	pos += skip;
+	if (!len)
+		return 0;
+
+	ctr = htobe64((uint64_t)pos >> 4);
+	memcpy(iv + 8, &ctr, sizeof(ctr));
+	if (!EVP_EncryptInit_ex(cipher, EVP_aes_256_ctr(), NULL, key, iv))
+		return -EIO;
+	/* 不在16字节边界上开始时，丢掉这个计数器块前面的密钥流 */
+	if ((pos & 15) && !EVP_EncryptUpdate(cipher, pad, &n, pad, pos & 15))
+		return -EIO;
+	while (len) {
+		n = len > INT32_MAX ? INT32_MAX : len;
+		if (!EVP_EncryptUpdate(cipher, buf, &n, buf, n))
+			return -EIO;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int jzpfs_crypt(const uint8_t *key, uint8_t *buf, size_t len, off_t pos)
+{
+	EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+	int err;
+
+	if (!cipher)
+		return -ENOMEM;
+	err = jzpfs_ctr(cipher, key, buf, len, pos);
+	EVP_CIPHER_CTX_free(cipher);
+	return err;
+}
+
+int jzpfs_z_algo(const char *name)
+{
+	int i;
+
+	for (i = 1; i < JZPFS_Z_NR_ALGOS; i++)
+		if (!strcmp(name, jzpfs_z_algos[i]))
+			return i;
+	return -EINVAL;
+}
+
+const char *jzpfs_z_algo_name(int algo)
+{
+	if (algo <= 0 || algo >= JZPFS_Z_NR_ALGOS)
+		return "unknown";
+	return jzpfs_z_algos[algo];
+}
+
+int jzpfs_probe(int fd, enum jzpfs_format *format)
+{
+	uint8_t hdr[JZPFS_HDR_SIZE], nonce[JZPFS_NONCE_SIZE];
+	ssize_t ret;
+
+	*format = JZPFS_FMT_PLAIN;
+	ret = jzpfs_pread(fd, hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return ret;
+	if (ret != JZPFS_HDR_SIZE)
+		return 0;
+
+	if (!memcmp(hdr, JZPFS_Z_MAGIC, JZPFS_HDR_SIZE)) {
+		*format = JZPFS_FMT_COMPRESS;
+	} else if (!memcmp(hdr, JZPFS_DEDUP_MAGIC, JZPFS_HDR_SIZE)) {
+		*format = JZPFS_FMT_DEDUP;
+	} else if (!memcmp(hdr, JZPFS_HDR_MAGIC, JZPFS_HDR_SIZE)) {
+		/* 没有nonce的是旧格式文件 */
+		ret = fgetxattr(fd, JZPFS_XATTR_NONCE, nonce, sizeof(nonce));
+		if (ret == JZPFS_NONCE_SIZE)
+			*format = JZPFS_FMT_CRYPT;
+		else if (ret >= 0)
+			return -EUCLEAN;
+		else if (errno == ENODATA || errno == ENOTSUP)
+			*format = JZPFS_FMT_LEGACY;
+		else
+			return -errno;
+	}
+	return 0;
+}
+
+/*
+ * 明文、旧格式和加密文件：lower偏移 = 明文偏移 + delta，逐块变换
+ */
+static int jzpfs_stream(struct jzpfs_ctx *ctx, int in, off_t in_pos,
+			int out, off_t out_pos, enum jzpfs_format format,
+			int encode, const uint8_t *key)
+{
+	off_t lower_pos;
+	ssize_t ret;
+	int err;
+
+	for (;;) {
+		ret = jzpfs_pread(in, ctx->buf, JZPFS_IO_SIZE, in_pos);
+		if (ret <= 0)
+			return ret;
+		lower_pos = encode ? out_pos : in_pos;
+		if (format == JZPFS_FMT_LEGACY) {
+			if (encode)
+				jzpfs_case_encode(ctx->buf, ret, lower_pos);
+			else
+				jzpfs_case_decode(ctx->buf, ret, lower_pos);
+		} else if (format == JZPFS_FMT_CRYPT) {
+			err = jzpfs_ctr(ctx->cipher, key, ctx->buf, ret,
+					lower_pos);
+			if (err)
+				return err;
+		}
+		err = jzpfs_pwrite(out, ctx->buf, ret, out_pos);
+		if (err)
+			return err;
+		in_pos += ret;
+		out_pos += ret;
+		if (ret < JZPFS_IO_SIZE)
+			return 0;
+	}
+}
+
+static int jzpfs_get_file_key(struct jzpfs_ctx *ctx, const uint8_t *nonce,
+			      uint8_t *key)
+{
+	if (!ctx->params->master_key_len)
+		return -ENOKEY;
+	return jzpfs_file_key(ctx->params->master_key,
+			      ctx->params->master_key_len, nonce, key);
+}
+
+/* 压缩 */
+
+static off_t jzpfs_z_group_off(uint64_t ext)
+{
+	return JZPFS_EXT_HDR_SIZE +
+	       (off_t)(ext / JZPFS_Z_GROUP_EXTENTS) * JZPFS_Z_GROUP_SIZE;
+}
+
+static off_t jzpfs_z_slot_off(uint64_t ext)
+{
+	return jzpfs_z_group_off(ext) + JZPFS_Z_IDX_SIZE +
+	       ((off_t)(ext % JZPFS_Z_GROUP_EXTENTS) << JZPFS_EXT_SHIFT);
+}
+
+static int jzpfs_z_compress(struct jzpfs_ctx *ctx, int algo,
+			    const uint8_t *src, size_t len, size_t *clen)
+{
+	int ret;
+
+	switch (algo) {
+	case JZPFS_Z_DEFLATE:
+		if (!ctx->zdef_ok) {
+			if (deflateInit2(&ctx->zdef, Z_DEFAULT_COMPRESSION,
+					 Z_DEFLATED, -JZPFS_DEFLATE_WINBITS,
+					 MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY)
+			    != Z_OK)
+				return -ENOMEM;
+			ctx->zdef_ok = 1;
+		} else {
+			deflateReset(&ctx->zdef);
+		}
+		ctx->zdef.next_in = (uint8_t *)src;
+		ctx->zdef.avail_in = len;
+		ctx->zdef.next_out = ctx->cbuf;
+		ctx->zdef.avail_out = JZPFS_EXT_SIZE;
+		ret = deflate(&ctx->zdef, Z_FINISH);
+		if (ret != Z_STREAM_END)
+			return -ENOSPC;
+		*clen = ctx->zdef.total_out;
+		return 0;
+#ifdef JZPFS_HAVE_LZ4
+	case JZPFS_Z_LZ4:
+		ret = LZ4_compress_default((const char *)src,
+					   (char *)ctx->cbuf, len,
+					   JZPFS_EXT_SIZE);
+		if (ret <= 0)
+			return -ENOSPC;
+		*clen = ret;
+		return 0;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int jzpfs_z_decompress(struct jzpfs_ctx *ctx, int algo,
+			      const uint8_t *src, size_t clen, size_t *dlen)
+{
+	int ret;
+
+	switch (algo) {
+	case JZPFS_Z_DEFLATE:
+		if (!ctx->zinf_ok) {
+			if (inflateInit2(&ctx->zinf, -JZPFS_DEFLATE_WINBITS)
+			    != Z_OK)
+				return -ENOMEM;
+			ctx->zinf_ok = 1;
+		} else {
+			inflateReset(&ctx->zinf);
+		}
+		ctx->zinf.next_in = (uint8_t *)src;
+		ctx->zinf.avail_in = clen;
+		ctx->zinf.next_out = ctx->ext;
+		ctx->zinf.avail_out = JZPFS_EXT_SIZE;
+		ret = inflate(&ctx->zinf, Z_FINISH);
+		if (ret != Z_STREAM_END)
+			return -EIO;
+		*dlen = ctx->zinf.total_out;
+		return 0;
+#ifdef JZPFS_HAVE_LZ4
+	case JZPFS_Z_LZ4:
+		ret = LZ4_decompress_safe((const char *)src,
+					  (char *)ctx->ext, clen,
+					  JZPFS_EXT_SIZE);
+		if (ret < 0)
+			return -EIO;
+		*dlen = ret;
+		return 0;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* 读出第ext个extent到ctx->ext，返回有数据的长度，空洞返回0 */
+static ssize_t jzpfs_z_read_extent(struct jzpfs_ctx *ctx, int in, int algo,
+				   uint64_t ext)
+{
+	uint32_t entry, clen;
+	size_t dlen;
+	ssize_t ret;
+	int err;
+
+	/* 每组的索引读一次 */
+	if (ext % JZPFS_Z_GROUP_EXTENTS == 0) {
+		memset(ctx->idx, 0, JZPFS_Z_IDX_SIZE);
+		ret = jzpfs_pread(in, ctx->idx, JZPFS_Z_IDX_SIZE,
+				  jzpfs_z_group_off(ext));
+		if (ret < 0)
+			return ret;
+	}
+	memcpy(&entry, ctx->idx + (ext % JZPFS_Z_GROUP_EXTENTS) * 4, 4);
+	entry = le32toh(entry);
+	if (!entry)
+		return 0;
+
+	clen = entry & JZPFS_Z_LEN_MASK;
+	if (!clen || clen > JZPFS_EXT_SIZE)
+		return -EUCLEAN;
+	ret = jzpfs_pread(in, (entry & JZPFS_Z_RAW) ? ctx->ext : ctx->cbuf,
+			  clen, jzpfs_z_slot_off(ext));
+	if (ret < 0)
+		return ret;
+	if (ret < clen)
+		return -EUCLEAN;
+	if (entry & JZPFS_Z_RAW)
+		return clen;
+	err = jzpfs_z_decompress(ctx, algo, ctx->cbuf, clen, &dlen);
+	return err ? err : (ssize_t)dlen;
+}
+
+/* 写第ext个extent，索引先记在ctx->idx里，整组写完再写 */
+static int jzpfs_z_write_extent(struct jzpfs_ctx *ctx, int out, int algo,
+				uint64_t ext, size_t len)
+{
+	const uint8_t *src = ctx->cbuf;
+	uint32_t entry;
+	size_t clen, wlen;
+	int err;
+
+	if (jzpfs_all_zero(ctx->ext, len))
+		return 0;
+	err = jzpfs_z_compress(ctx, algo, ctx->ext, len, &clen);
+	if (err == -ENOSPC || (!err && clen >= len)) {
+		memcpy(ctx->cbuf, ctx->ext, len);
+		clen = len;
+		entry = clen | JZPFS_Z_RAW;
+	} else if (err) {
+		return err;
+	} else {
+		entry = clen;
+	}
+	wlen = (clen + JZPFS_CSUM_BLOCK - 1) & ~(size_t)(JZPFS_CSUM_BLOCK - 1);
+	memset(ctx->cbuf + clen, 0, wlen - clen);
+	err = jzpfs_pwrite(out, src, wlen, jzpfs_z_slot_off(ext));
+	if (err)
+		return err;
+	entry = htole32(entry);
+	memcpy(ctx->idx + (ext % JZPFS_Z_GROUP_EXTENTS) * 4, &entry, 4);
+	return 0;
+}
+
+/* 去重 */
+
+static void jzpfs_chunk_path(struct jzpfs_ctx *ctx, const uint8_t *digest,
+			     char *path, size_t len)
+{
+	int i, n;
+
+	n = snprintf(path, len, "%s/", ctx->params->chunk_dir);
+	for (i = 0; i < JZPFS_DIGEST_SIZE; i++)
+		n += snprintf(path + n, len - n, "%02x", digest[i]);
+}
+
+static ssize_t jzpfs_dedup_read_extent(struct jzpfs_ctx *ctx, int in,
+				       uint64_t ext)
+{
+	static const uint8_t zero[JZPFS_DIGEST_SIZE];
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	const uint8_t *d;
+	char path[4096];
+	ssize_t ret;
+	int fd;
+
+	if (ext % JZPFS_DEDUP_MAP_BATCH == 0) {
+		memset(ctx->idx, 0, JZPFS_Z_IDX_SIZE);
+		ret = jzpfs_pread(in, ctx->idx, JZPFS_Z_IDX_SIZE,
+				  JZPFS_EXT_HDR_SIZE + ext * JZPFS_DIGEST_SIZE);
+		if (ret < 0)
+			return ret;
+	}
+	d = ctx->idx + (ext % JZPFS_DEDUP_MAP_BATCH) * JZPFS_DIGEST_SIZE;
+	if (!memcmp(d, zero, JZPFS_DIGEST_SIZE))
+		return 0;
+
+	jzpfs_chunk_path(ctx, d, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? -EUCLEAN : -errno;
+	ret = jzpfs_pread(fd, ctx->ext, JZPFS_EXT_SIZE, 0);
+	close(fd);
+	if (ret <= 0)
+		return ret ? ret : -EUCLEAN;
+	SHA256(ctx->ext, ret, digest);
+	if (memcmp(digest, d, JZPFS_DIGEST_SIZE))
+		return -EUCLEAN;
+	return ret;
+}
+
+/*
+ * 保存块。多个线程可能同时保存同一个块，先写临时文件再rename，块文件
+ * 要么不存在要么是完整的。
+ */
+static int jzpfs_chunk_store(struct jzpfs_ctx *ctx, const uint8_t *digest,
+			     size_t len)
+{
+	char path[4096], tmp[4096 + 32];
+	struct stat st;
+	int fd, err;
+
+	jzpfs_chunk_path(ctx, digest, path, sizeof(path));
+	if (!stat(path, &st) && (size_t)st.st_size == len)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.%p", path, getpid(), (void *)ctx);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -errno;
+	err = jzpfs_pwrite(fd, ctx->ext, len, 0);
+	/* 元数据文件的标记，见模块的meta.c；lower不支持xattr时目录也没有 */
+	if (!err && fsetxattr(fd, JZPFS_XATTR_META, "1", 1, 0) &&
+	    errno != ENOTSUP)
+		err = -errno;
+	if (close(fd) && !err)
+		err = -errno;
+	if (!err && rename(tmp, path))
+		err = -errno;
+	if (err)
+		unlink(tmp);
+	return err;
+}
+
+static int jzpfs_dedup_write_extent(struct jzpfs_ctx *ctx, uint64_t ext,
+				    size_t len)
+{
+	uint8_t *d;
+
+	d = ctx->idx + (ext % JZPFS_DEDUP_MAP_BATCH) * JZPFS_DIGEST_SIZE;
+	if (jzpfs_all_zero(ctx->ext, len))
+		return 0;
+	SHA256(ctx->ext, len, d);
+	return jzpfs_chunk_store(ctx, d, len);
+}
+
+int jzpfs_dedup_refs(int fd, int (*fn)(const uint8_t *digest, void *arg),
+		     void *arg)
+{
+	static const uint8_t zero[JZPFS_DIGEST_SIZE];
+	uint8_t hdr[16], map[JZPFS_DEDUP_MAP_BATCH * JZPFS_DIGEST_SIZE];
+	uint64_t ext, nr, size;
+	const uint8_t *d;
+	ssize_t ret;
+	int err;
+
+	ret = jzpfs_pread(fd, hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(hdr) || memcmp(hdr, JZPFS_DEDUP_MAGIC,
+					 JZPFS_HDR_SIZE) ||
+	    hdr[JZPFS_EXT_OFF_VERSION] != JZPFS_EXT_VERSION ||
+	    hdr[JZPFS_EXT_OFF_SHIFT] != JZPFS_EXT_SHIFT ||
+	    hdr[JZPFS_EXT_OFF_ALGO] != JZPFS_DEDUP_SHA256)
+		return -EOPNOTSUPP;
+	memcpy(&size, hdr + JZPFS_EXT_OFF_SIZE, sizeof(size));
+	size = le64toh(size);
+
+	/* 截断后映射里可能还留着i_size之外的摘要，读回来是空洞，不算引用 */
+	nr = (size + JZPFS_EXT_SIZE - 1) >> JZPFS_EXT_SHIFT;
+	for (ext = 0; ext < nr; ext++) {
+		if (ext % JZPFS_DEDUP_MAP_BATCH == 0) {
+			memset(map, 0, sizeof(map));
+			ret = jzpfs_pread(fd, map, sizeof(map),
+					  JZPFS_EXT_HDR_SIZE +
+					  ext * JZPFS_DIGEST_SIZE);
+			if (ret < 0)
+				return ret;
+		}
+		d = map + (ext % JZPFS_DEDUP_MAP_BATCH) * JZPFS_DIGEST_SIZE;
+		if (!memcmp(d, zero, JZPFS_DIGEST_SIZE))
+			continue;
+		err = fn(d, arg);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/* extent文件 */
+
+static int jzpfs_ext_decode(struct jzpfs_ctx *ctx, int in, int out,
+			    enum jzpfs_format format)
+{
+	uint8_t hdr[16];
+	uint64_t ext, nr, size;
+	ssize_t ret;
+	int err;
+
+	ret = jzpfs_pread(in, hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(hdr) || hdr[JZPFS_EXT_OFF_VERSION] !=
+	    JZPFS_EXT_VERSION || hdr[JZPFS_EXT_OFF_SHIFT] != JZPFS_EXT_SHIFT)
+		return -EOPNOTSUPP;
+	if (format == JZPFS_FMT_DEDUP ?
+	    hdr[JZPFS_EXT_OFF_ALGO] != JZPFS_DEDUP_SHA256 :
+	    (hdr[JZPFS_EXT_OFF_ALGO] == JZPFS_Z_NONE ||
+	     hdr[JZPFS_EXT_OFF_ALGO] >= JZPFS_Z_NR_ALGOS))
+		return -EOPNOTSUPP;
+	memcpy(&size, hdr + JZPFS_EXT_OFF_SIZE, sizeof(size));
+	size = le64toh(size);
+
+	nr = (size + JZPFS_EXT_SIZE - 1) >> JZPFS_EXT_SHIFT;
+	for (ext = 0; ext < nr; ext++) {
+		if (format == JZPFS_FMT_DEDUP)
+			ret = jzpfs_dedup_read_extent(ctx, in, ext);
+		else
+			ret = jzpfs_z_read_extent(ctx, in,
+						  hdr[JZPFS_EXT_OFF_ALGO], ext);
+		if (ret < 0)
+			return ret;
+		/* 空洞不写，最后ftruncate */
+		if (!ret)
+			continue;
+		if ((uint64_t)ret > size - (ext << JZPFS_EXT_SHIFT))
+			ret = size - (ext << JZPFS_EXT_SHIFT);
+		err = jzpfs_pwrite(out, ctx->ext, ret,
+				   (off_t)ext << JZPFS_EXT_SHIFT);
+		if (err)
+			return err;
+	}
+	return ftruncate(out, size) ? -errno : 0;
+}
+
+static int jzpfs_ext_encode(struct jzpfs_ctx *ctx, int in, int out)
+{
+	const struct jzpfs_params *params = ctx->params;
+	int dedup = params->format == JZPFS_FMT_DEDUP;
+	uint64_t ext, size = 0, batch;
+	off_t batch_off;
+	uint8_t *hdr;
+	ssize_t ret;
+	int err = 0;
+
+	batch = dedup ? JZPFS_DEDUP_MAP_BATCH : JZPFS_Z_GROUP_EXTENTS;
+	for (ext = 0; ; ext++) {
+		if (ext % batch == 0)
+			memset(ctx->idx, 0, JZPFS_Z_IDX_SIZE);
+		ret = jzpfs_pread(in, ctx->ext, JZPFS_EXT_SIZE,
+				  (off_t)ext << JZPFS_EXT_SHIFT);
+		if (ret < 0)
+			return ret;
+		if (ret) {
+			if (dedup)
+				err = jzpfs_dedup_write_extent(ctx, ext, ret);
+			else
+				err = jzpfs_z_write_extent(ctx, out,
+							   params->algo,
+							   ext, ret);
+			if (err)
+				return err;
+			size += ret;
+		}
+
+		/* 一组（一页映射）满了或者到了文件尾，写索引 */
+		if (ret == JZPFS_EXT_SIZE && (ext + 1) % batch)
+			continue;
+		batch_off = dedup ?
+			JZPFS_EXT_HDR_SIZE +
+			(ext - ext % batch) * JZPFS_DIGEST_SIZE :
+			jzpfs_z_group_off(ext);
+		if (!jzpfs_all_zero(ctx->idx, JZPFS_Z_IDX_SIZE)) {
+			err = jzpfs_pwrite(out, ctx->idx, JZPFS_Z_IDX_SIZE,
+					   batch_off);
+			if (err)
+				return err;
+		}
+		if (ret < JZPFS_EXT_SIZE)
+			break;
+	}
+
+	/* 文件头最后写，中途失败的输出不会被当成有效文件 */
+	hdr = calloc(1, JZPFS_EXT_HDR_SIZE);
+	if (!hdr)
+		return -ENOMEM;
+	memcpy(hdr, dedup ? JZPFS_DEDUP_MAGIC : JZPFS_Z_MAGIC, JZPFS_HDR_SIZE);
+	hdr[JZPFS_EXT_OFF_VERSION] = JZPFS_EXT_VERSION;
+	hdr[JZPFS_EXT_OFF_ALGO] = dedup ? JZPFS_DEDUP_SHA256 : params->algo;
+	hdr[JZPFS_EXT_OFF_SHIFT] = JZPFS_EXT_SHIFT;
+	size = htole64(size);
+	memcpy(hdr + JZPFS_EXT_OFF_SIZE, &size, sizeof(size));
+	err = jzpfs_pwrite(out, hdr, JZPFS_EXT_HDR_SIZE, 0);
+	free(hdr);
+	return err;
+}
+
+int jzpfs_decode_file(struct jzpfs_ctx *ctx, int in, int out)
+{
+	uint8_t nonce[JZPFS_NONCE_SIZE], key[JZPFS_FILE_KEY_SIZE];
+	enum jzpfs_format format;
+	int err;
+
+	err = jzpfs_probe(in, &format);
+	if (err)
+		return err;
+
+	switch (format) {
+	case JZPFS_FMT_PLAIN:
+		return jzpfs_stream(ctx, in, 0, out, 0, format, 0, NULL);
+	case JZPFS_FMT_LEGACY:
+		return jzpfs_stream(ctx, in, JZPFS_HDR_SIZE, out, 0, format,
+				    0, NULL);
+	case JZPFS_FMT_CRYPT:
+		if (fgetxattr(in, JZPFS_XATTR_NONCE, nonce, sizeof(nonce)) !=
+		    sizeof(nonce))
+			return -EUCLEAN;
+		err = jzpfs_get_file_key(ctx, nonce, key);
+		if (!err)
+			err = jzpfs_stream(ctx, in, JZPFS_HDR_SIZE, out, 0,
+					   format, 0, key);
+		OPENSSL_cleanse(key, sizeof(key));
+		return err;
+	default:
+		return jzpfs_ext_decode(ctx, in, out, format);
+	}
+}
+
+int jzpfs_encode_file(struct jzpfs_ctx *ctx, int in, int out)
+{
+	uint8_t nonce[JZPFS_NONCE_SIZE], key[JZPFS_FILE_KEY_SIZE];
+	enum jzpfs_format format = ctx->params->format;
+	int err;
+
+	switch (format) {
+	case JZPFS_FMT_PLAIN:
+		return jzpfs_stream(ctx, in, 0, out, 0, format, 1, NULL);
+	case JZPFS_FMT_LEGACY:
+		err = jzpfs_pwrite(out, JZPFS_HDR_MAGIC, JZPFS_HDR_SIZE, 0);
+		if (err)
+			return err;
+		return jzpfs_stream(ctx, in, 0, out, JZPFS_HDR_SIZE, format,
+				    1, NULL);
+	case JZPFS_FMT_CRYPT:
+		if (RAND_bytes(nonce, sizeof(nonce)) != 1)
+			return -EIO;
+		err = jzpfs_get_file_key(ctx, nonce, key);
+		if (err)
+			return err;
+		if (fsetxattr(out, JZPFS_XATTR_NONCE, nonce, sizeof(nonce), 0))
+			err = -errno;
+		if (!err)
+			err = jzpfs_pwrite(out, JZPFS_HDR_MAGIC,
+					   JZPFS_HDR_SIZE, 0);
+		if (!err)
+			err = jzpfs_stream(ctx, in, 0, out, JZPFS_HDR_SIZE,
+					   format, 1, key);
+		OPENSSL_cleanse(key, sizeof(key));
+		return err;
+	default:
+		return jzpfs_ext_encode(ctx, in, out);
+	}
+}
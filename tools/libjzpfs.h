@@ -0,0 +1,123 @@
+/*
+ * libjzpfs：不挂载jzpfs，直接读写lower上的jzpfs格式文件
+ *
+ * 格式和模块里的定义一一对应（jzpfs.h、transform.c、crypto.c、
+ * extent.c、compress.c、dedup.c），改了模块的格式这里要一起改。
+ */
+
+#ifndef _LIBJZPFS_H_
+#define _LIBJZPFS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* 文件头，见jzpfs.h */
+#define JZPFS_HDR_MAGIC		"JFS"
+#define JZPFS_HDR_SIZE		3
+#define JZPFS_Z_MAGIC		"JFZ"
+#define JZPFS_DEDUP_MAGIC	"JFD"
+
+#define JZPFS_XATTR_NONCE	"user.jzpfs.nonce"
+#define JZPFS_XATTR_META	"user.jzpfs.meta"
+#define JZPFS_NONCE_SIZE	16
+#define JZPFS_MASTER_KEY_MIN	16
+#define JZPFS_MASTER_KEY_MAX	64
+#define JZPFS_FILE_KEY_SIZE	32
+
+#define JZPFS_META_DIR		".jzpfs"
+#define JZPFS_CHUNK_DIR		JZPFS_META_DIR "/chunks"
+
+#define JZPFS_EXT_HDR_SIZE	4096
+#define JZPFS_EXT_VERSION	1
+#define JZPFS_EXT_SHIFT		16
+#define JZPFS_EXT_SIZE		(1 << JZPFS_EXT_SHIFT)
+#define JZPFS_CSUM_BLOCK	4096
+#define JZPFS_DIGEST_SIZE	32
+
+/* 压缩算法编号，和模块的枚举一致 */
+enum {
+	JZPFS_Z_NONE,
+	JZPFS_Z_LZ4,
+	JZPFS_Z_ZSTD,
+	JZPFS_Z_DEFLATE,
+	JZPFS_Z_LZO,
+	JZPFS_Z_NR_ALGOS,
+};
+
+#define JZPFS_DEDUP_SHA256	1
+
+/* lower文件的格式 */
+enum jzpfs_format {
+	JZPFS_FMT_PLAIN,	/* no header, passthrough */
+	JZPFS_FMT_LEGACY,	/* "JFS", case transform */
+	JZPFS_FMT_CRYPT,	/* "JFS" with a nonce xattr, AES-256-CTR */
+	JZPFS_FMT_COMPRESS,	/* "JFZ" */
+	JZPFS_FMT_DEDUP,	/* "JFD" */
+};
+
+/* I/O跟踪记录，模块debugfs的trace文件读出的格式，见trace.c */
+enum jzpfs_trace_op {
+	JZPFS_TR_OPEN,		/* flags = open flags */
+	JZPFS_TR_RELEASE,
+	JZPFS_TR_READ,		/* off, len = request */
+	JZPFS_TR_WRITE,
+	JZPFS_TR_FSYNC,		/* off, len = range, flags = datasync */
+	JZPFS_TR_TRUNCATE,	/* off = new size */
+	JZPFS_TR_NR_OPS,
+};
+
+struct jzpfs_trace_rec {
+	uint64_t ts;		/* ns, CLOCK_MONOTONIC */
+	uint64_t ino;
+	uint64_t off;
+	uint32_t len;
+	uint32_t flags;
+	uint32_t pid;
+	uint16_t op;
+	uint16_t pad;
+};
+
+/* 转换参数，所有线程共享、只读 */
+struct jzpfs_params {
+	enum jzpfs_format format;	/* encode target */
+	int algo;			/* JZPFS_FMT_COMPRESS */
+	uint8_t master_key[JZPFS_MASTER_KEY_MAX];
+	size_t master_key_len;		/* 0: no key */
+	const char *chunk_dir;		/* dedup chunk store */
+};
+
+/* 每个线程一个，里面是缓冲区和算法上下文 */
+struct jzpfs_ctx;
+
+extern struct jzpfs_ctx *jzpfs_ctx_new(const struct jzpfs_params *params);
+extern void jzpfs_ctx_free(struct jzpfs_ctx *ctx);
+
+extern void jzpfs_case_encode(uint8_t *buf, size_t len, off_t pos);
+extern void jzpfs_case_decode(uint8_t *buf, size_t len, off_t pos);
+extern int jzpfs_file_key(const uint8_t *master, size_t master_len,
+			  const uint8_t *nonce, uint8_t *key);
+extern int jzpfs_crypt(const uint8_t *key, uint8_t *buf, size_t len,
+		       off_t pos);
+extern int jzpfs_z_algo(const char *name);
+extern const char *jzpfs_z_algo_name(int algo);
+
+/* 判断lower文件fd的格式 */
+extern int jzpfs_probe(int fd, enum jzpfs_format *format);
+
+/*
+ * 对去重文件fd的块映射里每个引用的块调用一次fn，空洞跳过。fn返回非0
+ * 时停止并返回它的值，不是去重文件返回-EOPNOTSUPP
+ */
+extern int jzpfs_dedup_refs(int fd,
+			    int (*fn)(const uint8_t *digest, void *arg),
+			    void *arg);
+
+/*
+ * 整个文件的转换。decode把lower文件in还原成明文写到out；encode把明文in
+ * 按params->format写成lower文件out。成功返回0，失败返回负的errno。
+ */
+extern int jzpfs_decode_file(struct jzpfs_ctx *ctx, int in, int out);
+extern int jzpfs_encode_file(struct jzpfs_ctx *ctx, int in, int out);
+
+#endif	/* _LIBJZPFS_H_ */
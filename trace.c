@@ -0,0 +1,262 @@
+/*
+ * I/O跟踪，抓应用真实的操作序列，给tools/jzpfs-replay回放
+ *
+ *   /sys/kernel/debug/jzpfs/<major:minor>/trace_ctl
+ *     写"start [每个cpu的记录数]"开始（丢掉上一次的记录），"stop"停止，
+ *     读出状态、缓冲区大小和满了丢掉的记录数
+ *   /sys/kernel/debug/jzpfs/<major:minor>/trace
+ *     读出并清掉已记录的struct jzpfs_trace_rec，没有了返回0；停止之后
+ *     还能把剩下的读完
+ *
+ * 记录open、release、read、write、fsync和截断，每条带时间戳、inode号、
+ * 偏移、长度、标志和线程号。每个cpu一个环形缓冲区、一把锁，记录时只
+ * 碰本cpu的；满了不覆盖旧的，新记录计入dropped，读的人要跟上。各cpu
+ * 的记录之间没有顺序，回放时按时间戳排。
+ */
+
+#include "jzpfs.h"
+#include <linux/vmalloc.h>
+
+#define JZPFS_TRACE_DEFAULT	65536	/* records per cpu */
+#define JZPFS_TRACE_MAX		(1 << 22)
+#define JZPFS_TRACE_CHUNK	1024	/* records per read() */
+
+struct jzpfs_trace_cpu {
+	spinlock_t lock;
+	u32 head, tail;		/* free-running, index modulo size */
+	struct jzpfs_trace_rec *recs;
+};
+
+struct jzpfs_trace {
+	struct jzpfs_trace_cpu __percpu *cpu;
+	u32 size;
+	bool on;
+	atomic64_t dropped;
+};
+
+void __jzpfs_trace(struct inode *inode, u16 op, u64 off, u64 len, u32 flags)
+{
+	struct jzpfs_trace_rec *rec;
+	struct jzpfs_trace_cpu *c;
+	struct jzpfs_trace *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(JZPFS_SB(inode->i_sb)->trace);
+	if (!t || !READ_ONCE(t->on))
+		goto out;
+	c = get_cpu_ptr(t->cpu);
+	spin_lock(&c->lock);
+	if (c->head - c->tail < t->size) {
+		rec = &c->recs[c->head % t->size];
+		rec->ts = ktime_get_ns();
+		rec->ino = inode->i_ino;
+		rec->off = off;
+		rec->len = min_t(u64, len, U32_MAX);
+		rec->flags = flags;
+		rec->pid = task_pid_nr(current);
+		rec->op = op;
+		rec->pad = 0;
+		c->head++;
+	} else {
+		atomic64_inc(&t->dropped);
+	}
+	spin_unlock(&c->lock);
+	put_cpu_ptr(t->cpu);
+out:
+	rcu_read_unlock();
+}
+
+static void jzpfs_trace_free(struct jzpfs_trace *t)
+{
+	int cpu;
+
+	if (!t)
+		return;
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(t->cpu, cpu)->recs);
+	free_percpu(t->cpu);
+	kfree(t);
+}
+
+static struct jzpfs_trace *jzpfs_trace_alloc(u32 size)
+{
+	struct jzpfs_trace_cpu *c;
+	struct jzpfs_trace *t;
+	int cpu;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return NULL;
+	t->cpu = alloc_percpu(struct jzpfs_trace_cpu);
+	if (!t->cpu) {
+		kfree(t);
+		return NULL;
+	}
+	t->size = size;
+	atomic64_set(&t->dropped, 0);
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(t->cpu, cpu);
+		spin_lock_init(&c->lock);
+		c->recs = vmalloc_node(size * sizeof(*c->recs),
+				       cpu_to_node(cpu));
+		if (!c->recs) {
+			jzpfs_trace_free(t);
+			return NULL;
+		}
+	}
+	return t;
+}
+
+/* 摘下当前的缓冲区，等正在记录的人走了再释放 */
+static void jzpfs_trace_drop(struct jzpfs_sb_info *sbi)
+{
+	struct jzpfs_trace *t;
+
+	t = rcu_dereference_protected(sbi->trace,
+				      lockdep_is_held(&sbi->trace_mutex));
+	if (!t)
+		return;
+	RCU_INIT_POINTER(sbi->trace, NULL);
+	synchronize_rcu();
+	jzpfs_trace_free(t);
+}
+
+static ssize_t jzpfs_trace_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct super_block *sb = file_inode(file)->i_private;
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct jzpfs_trace_rec *out;
+	struct jzpfs_trace_cpu *c;
+	struct jzpfs_trace *t;
+	size_t n, max;
+	ssize_t ret;
+	int cpu;
+
+	max = min_t(size_t, count / sizeof(*out), JZPFS_TRACE_CHUNK);
+	if (!max)
+		return -EINVAL;
+	out = kmalloc_array(max, sizeof(*out), GFP_KERNEL);
+	if (!out)
+		return -ENOMEM;
+
+	n = 0;
+	mutex_lock(&sbi->trace_mutex);
+	t = rcu_dereference_protected(sbi->trace,
+				      lockdep_is_held(&sbi->trace_mutex));
+	if (t) {
+		for_each_possible_cpu(cpu) {
+			c = per_cpu_ptr(t->cpu, cpu);
+			spin_lock(&c->lock);
+			while (c->tail != c->head && n < max)
+				out[n++] = c->recs[c->tail++ % t->size];
+			spin_unlock(&c->lock);
+			if (n == max)
+				break;
+		}
+	}
+	mutex_unlock(&sbi->trace_mutex);
+
+	ret = n * sizeof(*out);
+	if (copy_to_user(buf, out, ret))
+		ret = -EFAULT;
+	kfree(out);
+	return ret;
+}
+
+const struct file_operations jzpfs_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= jzpfs_trace_read,
+	.llseek		= no_llseek,
+};
+
+static ssize_t jzpfs_trace_ctl_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct super_block *sb = file_inode(file)->i_private;
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct jzpfs_trace *t;
+	char tmp[80];
+	int len;
+
+	mutex_lock(&sbi->trace_mutex);
+	t = rcu_dereference_protected(sbi->trace,
+				      lockdep_is_held(&sbi->trace_mutex));
+	if (t)
+		len = scnprintf(tmp, sizeof(tmp), "%s size %u dropped %lld\n",
+				t->on ? "on" : "off", t->size,
+				(long long)atomic64_read(&t->dropped));
+	else
+		len = scnprintf(tmp, sizeof(tmp), "off\n");
+	mutex_unlock(&sbi->trace_mutex);
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static ssize_t jzpfs_trace_ctl_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	struct super_block *sb = file_inode(file)->i_private;
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+	struct jzpfs_trace *t;
+	u32 size = JZPFS_TRACE_DEFAULT;
+	char tmp[32];
+	ssize_t err = count;
+
+	if (count >= sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(tmp, buf, count))
+		return -EFAULT;
+	tmp[count] = '\0';
+
+	mutex_lock(&sbi->trace_mutex);
+	if (sysfs_streq(tmp, "stop")) {
+		t = rcu_dereference_protected(sbi->trace,
+					lockdep_is_held(&sbi->trace_mutex));
+		if (t)
+			WRITE_ONCE(t->on, false);
+	} else if (!strncmp(tmp, "start", 5) &&
+		   (sysfs_streq(tmp, "start") ||
+		    (sscanf(tmp + 5, "%u", &size) == 1 &&
+		     size && size <= JZPFS_TRACE_MAX))) {
+		jzpfs_trace_drop(sbi);
+		t = jzpfs_trace_alloc(size);
+		if (t) {
+			t->on = true;
+			rcu_assign_pointer(sbi->trace, t);
+		} else {
+			err = -ENOMEM;
+		}
+	} else {
+		err = -EINVAL;
+	}
+	mutex_unlock(&sbi->trace_mutex);
+	return err;
+}
+
+const struct file_operations jzpfs_trace_ctl_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= jzpfs_trace_ctl_read,
+	.write		= jzpfs_trace_ctl_write,
+	.llseek		= default_llseek,
+};
+
+void jzpfs_trace_init_sb(struct super_block *sb)
+{
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+
+	mutex_init(&sbi->trace_mutex);
+	RCU_INIT_POINTER(sbi->trace, NULL);
+}
+
+/* debugfs文件已经删掉之后调用 */
+void jzpfs_trace_exit_sb(struct super_block *sb)
+{
+	struct jzpfs_sb_info *sbi = JZPFS_SB(sb);
+
+	mutex_lock(&sbi->trace_mutex);
+	jzpfs_trace_drop(sbi);
+	mutex_unlock(&sbi->trace_mutex);
+}
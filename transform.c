@@ -0,0 +1,118 @@
+/*
+ * 数据变换和文件头
+ *
+ * 普通文件的lower开头可能有一个JZPFS_HDR_SIZE字节的魔数，决定读写时对
+ * 数据做什么变换：
+ *
+ *   "JFS"         旧格式变换文件：文件头之后的字母写入时转大写，读出时
+ *                 转小写；挂载了主密钥时改为AES-CTR加密（见crypto.c）
+ *   "JFZ"、"JFD"  按extent组织的文件，见extent.c
+ *   其他           不变换，直接透传
+ *
+ * 这里的函数只处理内核缓冲区和给定的文件偏移，不碰用户内存和锁，读写
+ * 路径（file.c）负责把数据搬进搬出。文件头永远不变换，所以buf跨过文件头
+ * 时只变换pos >= JZPFS_HDR_SIZE的部分。
+ */
+
+#include "jzpfs.h"
+
+/* buf里落在文件头之后的部分：返回要跳过的字节数 */
+static inline size_t jzpfs_hdr_skip(size_t len, loff_t pos)
+{
+	if (pos >= JZPFS_HDR_SIZE)
+		return 0;
+	return min_t(size_t, len, JZPFS_HDR_SIZE - pos);
+}
+
+/* 旧格式变换：写入时小写转大写 */
+void jzpfs_case_encode(u8 *buf, size_t len, loff_t pos)
+{
+	size_t i;
+
+	for (i = jzpfs_hdr_skip(len, pos); i < len; i++)
+		if (buf[i] >= 'a' && buf[i] <= 'z')
+			buf[i] -= 32;
+}
+
+/* 旧格式变换：读出时大写转小写 */
+void jzpfs_case_decode(u8 *buf, size_t len, loff_t pos)
+{
+	size_t i;
+
+	for (i = jzpfs_hdr_skip(len, pos); i < len; i++)
+		if (buf[i] >= 'A' && buf[i] <= 'Z')
+			buf[i] += 32;
+}
+
+/* 写到lower之前的变换，pos是lower文件偏移 */
+int jzpfs_encode(struct file *file, u8 *buf, size_t len, loff_t pos)
+{
+	if (jzpfs_inode_encrypted(file_inode(file)))
+		return jzpfs_crypt(file_inode(file), buf, len, pos);
+	if (jzpfs_file_transformed(file))
+		jzpfs_case_encode(buf, len, pos);
+	return 0;
+}
+
+/* 从lower读出之后的反变换，CTR模式加解密是同一个操作 */
+int jzpfs_decode(struct file *file, u8 *buf, size_t len, loff_t pos)
+{
+	if (jzpfs_inode_encrypted(file_inode(file)))
+		return jzpfs_crypt(file_inode(file), buf, len, pos);
+	if (jzpfs_file_transformed(file))
+		jzpfs_case_decode(buf, len, pos);
+	return 0;
+}
+
+/* 根据读到的len字节文件头判断文件格式 */
+enum jzpfs_hdr_type jzpfs_hdr_type(const u8 *buf, ssize_t len)
+{
+	if (len != JZPFS_HDR_SIZE)
+		return JZPFS_HDR_NONE;
+	if (!memcmp(buf, JZPFS_HDR_MAGIC, JZPFS_HDR_SIZE))
+		return JZPFS_HDR_LEGACY;
+	if (jzpfs_ext_magic((const char *)buf))
+		return JZPFS_HDR_EXTENT;
+	return JZPFS_HDR_NONE;
+}
+
+/*
+ * 读lower文件开头的文件头，返回读到的字节数。用__vfs_read而不是
+ * vfs_read：只写打开的文件也要识别文件头，否则写进去的数据不会做变换。
+ */
+ssize_t jzpfs_hdr_read(struct file *lower_file, u8 *buf)
+{
+	mm_segment_t old_fs;
+	loff_t pos = 0;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = __vfs_read(lower_file, (char __user *)buf, JZPFS_HDR_SIZE, &pos);
+	set_fs(old_fs);
+	if (ret >= 0)
+		fsstack_copy_attr_atime(d_inode(lower_file->f_path.dentry),
+					file_inode(lower_file));
+	return ret;
+}
+
+/*
+ * 给新建的空文件写旧格式文件头，返回写入的字节数。lower文件可能被多个
+ * open共享，不用也不改它的f_pos。
+ */
+ssize_t jzpfs_hdr_write(struct file *lower_file)
+{
+	mm_segment_t old_fs;
+	loff_t pos = 0;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = vfs_write(lower_file, (const char __user *)JZPFS_HDR_MAGIC,
+			JZPFS_HDR_SIZE, &pos);
+	set_fs(old_fs);
+	if (ret >= 0)
+		fsstack_copy_attr_atime(d_inode(lower_file->f_path.dentry),
+					file_inode(lower_file));
+	return ret;
+}
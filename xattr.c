@@ -0,0 +1,274 @@
+/*
+ * 扩展属性
+ *
+ * 所有xattr都原样转给lower，sb->s_xattr只有一个前缀为空的处理器，匹配
+ * 所有名字。security.*（SELinux等每次lookup、open都要查）和jzpfs自己的
+ * user.jzpfs.*元数据读得很频繁，值（包括“不存在”）缓存在inode上，通过
+ * jzpfs设置、删除时作废。绕过jzpfs直接改lower上的这些xattr，在inode
+ * 被回收之前看不到。
+ *
+ * user.jzpfs.*只有jzpfs自己能改（见crypto.c），从上层设置、删除返回
+ * -EPERM，listxattr也不列出来。
+ *
+ * 读lower和填缓存之间没有锁，同时有人改了xattr的话，读到的旧值不能
+ * 填进去：作废时增加inode的xattr_gen，填之前对一下读lower之前的值。
+ */
+
+#include "jzpfs.h"
+
+#define JZPFS_XATTR_CACHE_MAX	8	/* entries per inode */
+#define JZPFS_XATTR_VALUE_MAX	256	/* larger values are not cached */
+
+/* 一个缓存的xattr，err为-ENODATA表示lower上没有这个xattr */
+struct jzpfs_xattr {
+	struct list_head list;
+	int err;
+	size_t size;
+	char *name;
+	char value[];
+};
+
+static bool jzpfs_xattr_private(const char *name)
+{
+	return !strncmp(name, JZPFS_XATTR_PREFIX,
+			sizeof(JZPFS_XATTR_PREFIX) - 1);
+}
+
+static bool jzpfs_xattr_cacheable(const char *name)
+{
+	return !strncmp(name, XATTR_SECURITY_PREFIX,
+			XATTR_SECURITY_PREFIX_LEN) ||
+	       jzpfs_xattr_private(name);
+}
+
+static struct jzpfs_xattr *jzpfs_xattr_find(struct jzpfs_inode_info *info,
+					    const char *name)
+{
+	struct jzpfs_xattr *x;
+
+	list_for_each_entry(x, &info->xattrs, list)
+		if (!strcmp(x->name, name))
+			return x;
+	return NULL;
+}
+
+/*
+ * 缓存命中返回值的长度或错误，没命中返回-EAGAIN，*gen是没命中时的
+ * xattr_gen，填缓存时要用
+ */
+static int jzpfs_xattr_cached(struct inode *inode, const char *name,
+			      void *buffer, size_t size, unsigned int *gen)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct jzpfs_xattr *x;
+	int ret = -EAGAIN;
+
+	spin_lock(&info->xattr_lock);
+	x = jzpfs_xattr_find(info, name);
+	if (x) {
+		/* 最近用过的放到前面，满了从后面淘汰 */
+		list_move(&x->list, &info->xattrs);
+		if (x->err)
+			ret = x->err;
+		else if (size && size < x->size)
+			ret = -ERANGE;
+		else {
+			if (size)
+				memcpy(buffer, x->value, x->size);
+			ret = x->size;
+		}
+	} else {
+		*gen = info->xattr_gen;
+	}
+	spin_unlock(&info->xattr_lock);
+	return ret;
+}
+
+/*
+ * 记下从lower读到的结果：值（ret为长度）或-ENODATA。gen是读lower之前
+ * 取的xattr_gen，之后作废过就不填
+ */
+static void jzpfs_xattr_fill(struct inode *inode, const char *name,
+			     const void *value, int ret, unsigned int gen)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct jzpfs_xattr *x, *old;
+	size_t size = ret > 0 ? ret : 0;
+
+	if (ret < 0 && ret != -ENODATA)
+		return;
+	if (size > JZPFS_XATTR_VALUE_MAX)
+		return;
+	x = kmalloc(sizeof(*x) + size, GFP_KERNEL);
+	if (!x)
+		return;
+	x->name = kstrdup(name, GFP_KERNEL);
+	if (!x->name) {
+		kfree(x);
+		return;
+	}
+	x->err = ret < 0 ? ret : 0;
+	x->size = size;
+	memcpy(x->value, value, size);
+
+	spin_lock(&info->xattr_lock);
+	old = jzpfs_xattr_find(info, name);
+	if (old || gen != info->xattr_gen) {
+		/* 别人已经填好了，或者读的时候被改了 */
+		spin_unlock(&info->xattr_lock);
+		kfree(x->name);
+		kfree(x);
+		return;
+	}
+	list_add(&x->list, &info->xattrs);
+	if (++info->nr_xattrs > JZPFS_XATTR_CACHE_MAX) {
+		old = list_last_entry(&info->xattrs, struct jzpfs_xattr, list);
+		list_del(&old->list);
+		info->nr_xattrs--;
+	} else {
+		old = NULL;
+	}
+	spin_unlock(&info->xattr_lock);
+	if (old) {
+		kfree(old->name);
+		kfree(old);
+	}
+}
+
+/* lower上的name改了，扔掉缓存的值 */
+void jzpfs_xattr_invalidate(struct inode *inode, const char *name)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct jzpfs_xattr *x;
+
+	spin_lock(&info->xattr_lock);
+	info->xattr_gen++;
+	x = jzpfs_xattr_find(info, name);
+	if (x) {
+		list_del(&x->list);
+		info->nr_xattrs--;
+	}
+	spin_unlock(&info->xattr_lock);
+	if (x) {
+		kfree(x->name);
+		kfree(x);
+	}
+}
+
+/* inode回收时释放整个缓存 */
+void jzpfs_xattr_drop(struct inode *inode)
+{
+	struct jzpfs_inode_info *info = JZPFS_I(inode);
+	struct jzpfs_xattr *x, *tmp;
+
+	list_for_each_entry_safe(x, tmp, &info->xattrs, list) {
+		kfree(x->name);
+		kfree(x);
+	}
+	INIT_LIST_HEAD(&info->xattrs);
+	info->nr_xattrs = 0;
+}
+
+static int jzpfs_xattr_get(const struct xattr_handler *handler,
+			   struct dentry *dentry, struct inode *inode,
+			   const char *name, void *buffer, size_t size)
+{
+	struct path lower_path;
+	unsigned int gen = 0;
+	bool cache;
+	u8 *value = NULL;
+	int err;
+
+	cache = jzpfs_xattr_cacheable(name);
+	if (cache) {
+		err = jzpfs_xattr_cached(inode, name, buffer, size, &gen);
+		if (err != -EAGAIN) {
+			jzpfs_stat_inc(inode->i_sb, JZPFS_STAT_XATTR_HIT);
+			return err;
+		}
+		jzpfs_stat_inc(inode->i_sb, JZPFS_STAT_XATTR_MISS);
+		/* 只问长度的调用也要读出值来缓存 */
+		if (!size) {
+			value = kmalloc(JZPFS_XATTR_VALUE_MAX, GFP_KERNEL);
+			if (!value)
+				cache = false;
+		}
+	}
+
+	jzpfs_get_lower_path(dentry, &lower_path);
+	if (value) {
+		err = vfs_getxattr(lower_path.dentry, name, value,
+				   JZPFS_XATTR_VALUE_MAX);
+		/* 太大不缓存，再问一次长度 */
+		if (err == -ERANGE) {
+			cache = false;
+			err = vfs_getxattr(lower_path.dentry, name, NULL, 0);
+		}
+	} else {
+		err = vfs_getxattr(lower_path.dentry, name, buffer, size);
+	}
+	jzpfs_put_lower_path(dentry, &lower_path);
+
+	if (cache)
+		jzpfs_xattr_fill(inode, name, value ? value : buffer, err,
+				 gen);
+	kfree(value);
+	return err;
+}
+
+/* value为NULL表示删除 */
+static int jzpfs_xattr_set(const struct xattr_handler *handler,
+			   struct dentry *dentry, struct inode *inode,
+			   const char *name, const void *value, size_t size,
+			   int flags)
+{
+	struct path lower_path;
+	int err;
+
+	if (jzpfs_xattr_private(name))
+		return -EPERM;
+
+	jzpfs_get_lower_path(dentry, &lower_path);
+	if (value)
+		err = vfs_setxattr(lower_path.dentry, name, value, size, flags);
+	else
+		err = vfs_removexattr(lower_path.dentry, name);
+	/* 失败了lower也可能已经改了一半，一律作废 */
+	if (jzpfs_xattr_cacheable(name))
+		jzpfs_xattr_invalidate(inode, name);
+	if (!err)
+		fsstack_copy_attr_all(inode, d_inode(lower_path.dentry));
+	jzpfs_put_lower_path(dentry, &lower_path);
+	return err;
+}
+
+/*
+ * 从lower读出的名字列表list（len字节）里去掉user.jzpfs.*，返回剩下的
+ * 长度
+ */
+ssize_t jzpfs_xattr_list_filter(char *list, ssize_t len)
+{
+	char *p = list, *out = list, *end = list + len;
+	size_t n;
+
+	while (p < end) {
+		n = min_t(size_t, strnlen(p, end - p) + 1, end - p);
+		if (!jzpfs_xattr_private(p)) {
+			memmove(out, p, n);
+			out += n;
+		}
+		p += n;
+	}
+	return out - list;
+}
+
+static const struct xattr_handler jzpfs_xattr_handler = {
+	.prefix	= "",	/* catch all */
+	.get	= jzpfs_xattr_get,
+	.set	= jzpfs_xattr_set,
+};
+
+const struct xattr_handler *jzpfs_xattr_handlers[] = {
+	&jzpfs_xattr_handler,
+	NULL
+};